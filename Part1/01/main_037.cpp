@@ -20,74 +20,13 @@ using f64 = double;
 using cstr = const char*;
 
 
-class ByteBuffer
-{
-public:
-    u32 size = 0;
-    u8* data = nullptr;
-};
-
-
-static void destroy_buffer(ByteBuffer& buffer)
-{
-    if (buffer.data)
-    {
-        std::free(buffer.data);
-    }
-}
-
-
-static bool create_buffer(ByteBuffer& buffer, u32 size)
-{
-    assert(!buffer.data);
-    assert(size);
-    
-    if (buffer.data || !size)
-    {
-        return false;
-    }
-
-    buffer.data = (u8*)std::malloc(size);
-    if (!buffer.data)
-    {
-        return false;
-    }
-
-    return true;
-}
+#include "../lib/bytes.hpp"
 
 
 constexpr auto BIN_FILE = "listing_0037_single_register_mov";
 
 
 
-static ByteBuffer read_bytes(fs::path const& path)
-{
-    ByteBuffer buffer;
-
-    auto size = fs::file_size(path);
-    if (size == 0 || !create_buffer(buffer, size))
-    {
-        assert(false);
-        return buffer;
-    }
-
-    std::ifstream file(path, std::ios::binary);
-    if (!file.is_open())
-    {
-        assert(false);
-        destroy_buffer(buffer);
-        return buffer;
-    }
-
-    file.read((char*)buffer.data, size);
-    buffer.size = size;
-
-    file.close();
-    return buffer;
-}
-
-
 static int parse_opcode(u8 byte)
 {
     return (byte & 0b11111100) >> 2;
@@ -204,11 +143,11 @@ static void print_instruction(cstr op, cstr src, cstr dst)
 
 static void decode(cstr bin_file)
 {
-    auto buffer = read_bytes(bin_file);
+    auto buffer = Bytes::read(bin_file);
 
     auto byte1 = buffer.data[0];
     auto byte2 = buffer.data[1];
-    destroy_buffer(buffer);
+    Bytes::destroy(buffer);
 
     int opcode = parse_opcode(byte1);
     int direction = parse_direction(byte1);
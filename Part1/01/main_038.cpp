@@ -20,74 +20,13 @@ using f64 = double;
 using cstr = const char*;
 
 
-class ByteBuffer
-{
-public:
-    u32 size = 0;
-    u8* data = nullptr;
-};
-
-
-static void destroy_buffer(ByteBuffer& buffer)
-{
-    if (buffer.data)
-    {
-        std::free(buffer.data);
-    }
-}
-
-
-static bool create_buffer(ByteBuffer& buffer, u32 size)
-{
-    assert(!buffer.data);
-    assert(size);
-    
-    if (buffer.data || !size)
-    {
-        return false;
-    }
-
-    buffer.data = (u8*)std::malloc(size);
-    if (!buffer.data)
-    {
-        return false;
-    }
-
-    return true;
-}
+#include "../lib/bytes.hpp"
 
 
 constexpr auto BIN_FILE = "listing_0038_many_register_mov";
 
 
 
-static ByteBuffer read_bytes(fs::path const& path)
-{
-    ByteBuffer buffer;
-
-    auto size = fs::file_size(path);
-    if (size == 0 || !create_buffer(buffer, size))
-    {
-        assert(false);
-        return buffer;
-    }
-
-    std::ifstream file(path, std::ios::binary);
-    if (!file.is_open())
-    {
-        assert(false);
-        destroy_buffer(buffer);
-        return buffer;
-    }
-
-    file.read((char*)buffer.data, size);
-    buffer.size = size;
-
-    file.close();
-    return buffer;
-}
-
-
 static int parse_opcode(u8 byte)
 {
     return (byte & 0b11111100) >> 2;
@@ -214,7 +153,7 @@ static void decode_single(u8 byte1, u8 byte2)
 
 static void decode(cstr bin_file)
 {
-    auto buffer = read_bytes(bin_file);
+    auto buffer = Bytes::read(bin_file);
 
     assert(buffer.data);
     assert(buffer.size);
@@ -227,7 +166,7 @@ static void decode(cstr bin_file)
         decode_single(buffer.data[i], buffer.data[i + 1]);
     }
 
-    destroy_buffer(buffer);
+    Bytes::destroy(buffer);
 }
 
 
@@ -3,6 +3,8 @@
 #include <cassert>
 #include <cstdlib>
 #include <cstring>
+#include <cstdarg>
+#include <thread>
 
 namespace fs = std::filesystem;
 
@@ -21,80 +23,109 @@ using f64 = double;
 using cstr = const char*;
 
 
-#define PRINTDBG
-
-
-static void printdbg(cstr msg)
-{
-#ifdef PRINTDBG
+#include "../lib/bytes.hpp"
 
-printf("%s", msg);
 
-#endif
-}
+#define PRINTDBG
 
 
-class ByteBuffer
+// decoded text written by one thread
+class TextArena
 {
 public:
+    char* data = nullptr;
     u32 size = 0;
-    u8* data = nullptr;
+    u32 capacity = 0;
 };
 
 
-static void destroy_buffer(ByteBuffer& buffer)
+static void destroy_arena(TextArena& arena)
 {
-    if (buffer.data)
+    if (arena.data)
     {
-        std::free(buffer.data);
+        std::free(arena.data);
+        arena.data = nullptr;
     }
+
+    arena.size = 0;
+    arena.capacity = 0;
 }
 
 
-static bool create_buffer(ByteBuffer& buffer, u32 size)
+static bool reserve_arena(TextArena& arena, u32 size)
 {
-    assert(!buffer.data);
-    assert(size);
-    
-    if (buffer.data || !size)
+    if (arena.size + size <= arena.capacity)
     {
-        return false;
+        return true;
+    }
+
+    auto capacity = arena.capacity ? arena.capacity : 4096;
+    while (capacity < arena.size + size)
+    {
+        capacity *= 2;
     }
 
-    buffer.data = (u8*)std::malloc(size);
-    if (!buffer.data)
+    auto data = (char*)std::realloc(arena.data, capacity);
+    if (!data)
     {
         return false;
     }
 
+    arena.data = data;
+    arena.capacity = capacity;
+
     return true;
 }
 
 
-static ByteBuffer read_bytes(fs::path const& path)
+// decoders print to the arena of their thread, stdout when there is none
+static thread_local TextArena* text_out = nullptr;
+
+
+static void print_text(cstr fmt, ...)
 {
-    ByteBuffer buffer;
+    va_list args;
+    va_start(args, fmt);
 
-    auto size = fs::file_size(path);
-    if (size == 0 || !create_buffer(buffer, size))
+    if (!text_out)
     {
-        assert(false);
-        return buffer;
+        vprintf(fmt, args);
+        va_end(args);
+        return;
     }
 
-    std::ifstream file(path, std::ios::binary);
-    if (!file.is_open())
+    auto& arena = *text_out;
+
+    // format in place, grow and format again when it does not fit
+    va_list copy;
+    va_copy(copy, args);
+    auto room = arena.capacity - arena.size;
+    auto len = vsnprintf(arena.data + arena.size, room, fmt, copy);
+    va_end(copy);
+
+    if (len >= (int)room && reserve_arena(arena, (u32)len + 1))
+    {
+        vsnprintf(arena.data + arena.size, len + 1, fmt, args);
+    }
+    else if (len >= (int)room)
     {
         assert(false);
-        destroy_buffer(buffer);
-        return buffer;
+        len = 0;
     }
 
-    file.read((char*)buffer.data, size);
-    buffer.size = size;
+    arena.size += len > 0 ? len : 0;
+
+    va_end(args);
+}
+
 
-    file.close();
-    return buffer;
+static void printdbg(cstr msg)
+{
+#ifdef PRINTDBG
+
+print_text("%s", msg);
+
+#endif
 }
 
 
@@ -474,7 +505,7 @@ static int decode_mov_rm_tf_r(u8* data, int offset)
         dst = rm_str;
     }
 
-    printf("mov %s, %s\n", dst, src);
+    print_text("mov %s, %s\n", dst, src);
 
     return offset;
 }
@@ -531,7 +562,7 @@ static int decode_mov_i_to_rm(u8* data, int offset)
 
     auto dst = rm_str;
 
-    printf("mov %s, %s %s\n", dst, disp_str, src);
+    print_text("mov %s, %s %s\n", dst, disp_str, src);
 
     return offset;
 }
@@ -561,7 +592,7 @@ static int decode_mov_i_to_r(u8* data, int offset)
 
     auto dst = decode_register(reg_bits3, w_bits1);
 
-    printf("mov %s, %s\n", dst, src);
+    print_text("mov %s, %s\n", dst, src);
 
     return offset;
 }
@@ -590,7 +621,7 @@ static int decode_mov_m_to_a(u8* data, int offset)
 
     auto dst = "ax";
 
-    printf("mov %s, %s\n", dst, src);
+    print_text("mov %s, %s\n", dst, src);
 
     return offset;
 }
@@ -619,13 +650,13 @@ static int decode_mov_a_to_m(u8* data, int offset)
     char dst[8] = { 0 };
     snprintf(dst, 8, "[%d]", addr);
 
-    printf("mov %s, %s\n", dst, src);
+    print_text("mov %s, %s\n", dst, src);
 
     return offset;
 }
 
 
-static int decode_next(u8* data, int offset)
+static int decode_op(u8* data, int offset)
 {
     using OC = OpCode;
 
@@ -651,7 +682,7 @@ static int decode_next(u8* data, int offset)
         offset = decode_mov_a_to_m(data, offset);
         break;
     default:
-        printf("opcode (byte1): %d\n", (int)data[offset]);
+        print_text("opcode (byte1): %d\n", (int)data[offset]);
         return -1;
     }
 
@@ -659,11 +690,60 @@ static int decode_next(u8* data, int offset)
 }
 
 
+// longest instruction decoded, mov immediate to memory with a 16 bit displacement
+constexpr int MAX_LENGTH = 6;
+
+
+// the decoders read a whole instruction without knowing where the image ends
+// near the end they read a zero padded copy and print to a scratch arena
+// returns -1 for an unknown opcode or an instruction cut off by the end of the image
+static int decode_next(u8* data, int size, int offset)
+{
+    if (offset + MAX_LENGTH <= size)
+    {
+        return decode_op(data, offset);
+    }
+
+    auto n_left = size - offset;
+
+    u8 tail[MAX_LENGTH] = { 0 };
+    std::memcpy(tail, data + offset, n_left);
+
+    TextArena scratch{};
+
+    auto out = text_out;
+    text_out = &scratch;
+
+    auto next = decode_op(tail, 0);
+
+    text_out = out;
+
+    if (next > n_left)
+    {
+        print_text("incomplete instruction at %d\n", offset);
+        next = -1;
+    }
+    else
+    {
+        if (scratch.size)
+        {
+            print_text("%.*s", (int)scratch.size, scratch.data);
+        }
+
+        next = next < 0 ? -1 : offset + next;
+    }
+
+    destroy_arena(scratch);
+
+    return next;
+}
+
+
 static void decode(cstr bin_file)
 {
     printf("\n==================\n\n");
 
-    auto buffer = read_bytes(bin_file);
+    auto buffer = Bytes::read(bin_file);
 
     assert(buffer.data);
     assert(buffer.size);
@@ -673,17 +753,239 @@ static void decode(cstr bin_file)
     int offset = 0;
     while (offset >= 0 && offset < buffer.size)
     {
-        offset = decode_next(buffer.data, offset);
+        offset = decode_next(buffer.data, (int)buffer.size, offset);
+    }
+
+    Bytes::destroy(buffer);
+
+    printf("\n\n------------------\n");
+}
+
+
+constexpr u32 MAX_THREADS = 256;
+
+// smaller images are not split
+constexpr u32 MIN_CHUNK_SIZE = 1024;
+
+
+// instructions decoded by one thread from a guessed boundary
+class Chunk
+{
+public:
+    int begin = 0;
+    int end = 0;
+
+    // start, next offset and text of each instruction, next is -1 for an unknown opcode
+    int* offsets = nullptr;
+    int* nexts = nullptr;
+    u32* texts = nullptr;
+    u32 n_decoded = 0;
+
+    TextArena text;
+};
+
+
+static void destroy_chunk(Chunk& chunk)
+{
+    std::free(chunk.offsets);
+    std::free(chunk.nexts);
+    std::free(chunk.texts);
+    chunk.offsets = nullptr;
+    chunk.nexts = nullptr;
+    chunk.texts = nullptr;
+
+    destroy_arena(chunk.text);
+}
+
+
+static bool create_chunk(Chunk& chunk, int begin, int end)
+{
+    assert(!chunk.offsets);
+
+    // every instruction is at least one byte
+    auto n = (u32)(end - begin);
+
+    chunk.begin = begin;
+    chunk.end = end;
+    chunk.offsets = (int*)std::malloc(sizeof(int) * n);
+    chunk.nexts = (int*)std::malloc(sizeof(int) * n);
+    chunk.texts = (u32*)std::malloc(sizeof(u32) * n);
+
+    if (!chunk.offsets || !chunk.nexts || !chunk.texts)
+    {
+        destroy_chunk(chunk);
+        return false;
+    }
+
+    return true;
+}
+
+
+// the first instruction may start mid instruction, the path resynchronizes after a few
+// the last one may run into the next chunk, only size bounds the reads
+static void decode_chunk(u8* data, int size, Chunk& chunk)
+{
+    text_out = &chunk.text;
+
+    int offset = chunk.begin;
+    while (offset < chunk.end)
+    {
+        auto i = chunk.n_decoded++;
+
+        chunk.offsets[i] = offset;
+        chunk.texts[i] = chunk.text.size;
+
+        auto next = decode_next(data, size, offset);
+        chunk.nexts[i] = next;
+
+        // skip a byte and keep looking for a boundary
+        offset = next < 0 ? offset + 1 : next;
+    }
+
+    text_out = nullptr;
+}
+
+
+// index of the instruction starting at offset, -1 when the chunk did not decode one there
+static int find_offset(Chunk const& chunk, int offset)
+{
+    int lo = 0;
+    int hi = (int)chunk.n_decoded - 1;
+
+    while (lo <= hi)
+    {
+        auto mid = (lo + hi) / 2;
+        auto value = chunk.offsets[mid];
+
+        if (value == offset)
+        {
+            return mid;
+        }
+
+        if (value < offset)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid - 1;
+        }
+    }
+
+    return -1;
+}
+
+
+// prints the instructions of the chunk on the true path starting at offset
+// returns where the path leaves the chunk, -1 when it ends
+static int print_chunk(u8* data, int size, Chunk const& chunk, int offset)
+{
+    auto i = find_offset(chunk, offset);
+
+    // the guessed boundary was wrong, decode until the paths converge
+    while (i < 0 && offset >= 0 && offset < chunk.end)
+    {
+        offset = decode_next(data, size, offset);
+        i = find_offset(chunk, offset);
+    }
+
+    if (i < 0)
+    {
+        return offset;
     }
 
-    destroy_buffer(buffer);
+    for (auto k = (u32)i; k < chunk.n_decoded; ++k)
+    {
+        auto text_end = k + 1 < chunk.n_decoded ? chunk.texts[k + 1] : chunk.text.size;
+        fwrite(chunk.text.data + chunk.texts[k], 1, text_end - chunk.texts[k], stdout);
+
+        offset = chunk.nexts[k];
+        if (offset < 0 || offset >= chunk.end)
+        {
+            break;
+        }
+
+        // the next instruction decoded is the one at offset
+        assert(chunk.offsets[k + 1] == offset);
+    }
+
+    return offset;
+}
+
+
+// same output as decode, chunks of the image are decoded on their own threads
+static void decode_parallel(cstr bin_file, u32 n_threads)
+{
+    printf("\n==================\n\n");
+
+    auto buffer = Bytes::read(bin_file);
+
+    assert(buffer.data);
+    assert(buffer.size);
+
+    printf("bits 16\n\n");
+
+    auto n_chunks = (u32)std::min((u64)n_threads, buffer.size / MIN_CHUNK_SIZE);
+    n_chunks = std::max(std::min(n_chunks, MAX_THREADS), 1u);
+
+    Chunk chunks[MAX_THREADS];
+
+    auto chunk_size = buffer.size / n_chunks;
+
+    for (u32 i = 0; i < n_chunks; ++i)
+    {
+        auto begin = (int)(i * chunk_size);
+        auto end = i + 1 == n_chunks ? (int)buffer.size : begin + (int)chunk_size;
+
+        if (!create_chunk(chunks[i], begin, end))
+        {
+            assert(false);
+            n_chunks = 0;
+        }
+    }
+
+    std::thread workers[MAX_THREADS];
+
+    for (u32 i = 0; i < n_chunks; ++i)
+    {
+        workers[i] = std::thread(decode_chunk, buffer.data, (int)buffer.size, std::ref(chunks[i]));
+    }
+
+    for (u32 i = 0; i < n_chunks; ++i)
+    {
+        workers[i].join();
+    }
+
+    // the first chunk starts on a boundary, each seam continues the path of the chunk before it
+    int offset = 0;
+    for (u32 i = 0; i < n_chunks && offset >= 0; ++i)
+    {
+        offset = print_chunk(buffer.data, (int)buffer.size, chunks[i], offset);
+    }
+
+    for (u32 i = 0; i < MAX_THREADS; ++i)
+    {
+        destroy_chunk(chunks[i]);
+    }
+
+    Bytes::destroy(buffer);
 
     printf("\n\n------------------\n");
 }
 
 
-int main()
+int main(int argc, char* argv[])
 {
+    // decode --parallel bin_file [n_threads]
+    if (argc > 2 && strcmp(argv[1], "--parallel") == 0)
+    {
+        u32 n_threads = argc > 3 ? (u32)atoi(argv[3]) : std::thread::hardware_concurrency();
+
+        decode_parallel(argv[2], n_threads ? n_threads : 1);
+        return 0;
+    }
+
+
     decode("listing_0039_more_movs");
 
     decode("listing_0040_challenge_movs");
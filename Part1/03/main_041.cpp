@@ -3,6 +3,8 @@
 #include <cassert>
 #include <cstdlib>
 #include <cstring>
+#include <cstdarg>
+#include <thread>
 
 namespace fs = std::filesystem;
 
@@ -24,11 +26,101 @@ using cstr = const char*;
 #define PRINTDBG
 
 
+// decoded text written by one thread
+class TextArena
+{
+public:
+    char* data = nullptr;
+    u32 size = 0;
+    u32 capacity = 0;
+};
+
+
+static void destroy_arena(TextArena& arena)
+{
+    if (arena.data)
+    {
+        std::free(arena.data);
+        arena.data = nullptr;
+    }
+
+    arena.size = 0;
+    arena.capacity = 0;
+}
+
+
+static bool reserve_arena(TextArena& arena, u32 size)
+{
+    if (arena.size + size <= arena.capacity)
+    {
+        return true;
+    }
+
+    auto capacity = arena.capacity ? arena.capacity : 4096;
+    while (capacity < arena.size + size)
+    {
+        capacity *= 2;
+    }
+
+    auto data = (char*)std::realloc(arena.data, capacity);
+    if (!data)
+    {
+        return false;
+    }
+
+    arena.data = data;
+    arena.capacity = capacity;
+
+    return true;
+}
+
+
+// decoders print to the arena of their thread, stdout when there is none
+static thread_local TextArena* text_out = nullptr;
+
+
+static void print_text(cstr fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+
+    if (!text_out)
+    {
+        vprintf(fmt, args);
+        va_end(args);
+        return;
+    }
+
+    auto& arena = *text_out;
+
+    // format in place, grow and format again when it does not fit
+    va_list copy;
+    va_copy(copy, args);
+    auto room = arena.capacity - arena.size;
+    auto len = vsnprintf(arena.data + arena.size, room, fmt, copy);
+    va_end(copy);
+
+    if (len >= (int)room && reserve_arena(arena, (u32)len + 1))
+    {
+        vsnprintf(arena.data + arena.size, len + 1, fmt, args);
+    }
+    else if (len >= (int)room)
+    {
+        assert(false);
+        len = 0;
+    }
+
+    arena.size += len > 0 ? len : 0;
+
+    va_end(args);
+}
+
+
 static void printdbg(cstr msg)
 {
 #ifdef PRINTDBG
 
-printf("%s", msg);
+print_text("%s", msg);
 
 #endif
 }
@@ -36,12 +128,12 @@ printf("%s", msg);
 
 void print_binary(uint8_t value) 
 {
-    printf("[");
+    print_text("[");
     for (int i = 7; i >= 0; --i) 
     {
-        printf("%d", (value >> i) & 1);
+        print_text("%d", (value >> i) & 1);
     }
-    printf("]");
+    print_text("]");
 }
 
 
@@ -49,10 +141,10 @@ static void printdbg(cstr msg, u8 byte1, u8 byte2)
 {
 #ifdef PRINTDBG
 
-printf("%s ", msg);
+print_text("%s ", msg);
 print_binary(byte1);
 print_binary(byte2);
-printf(" ");
+print_text(" ");
 
 #endif
 }
@@ -62,83 +154,18 @@ static void printdbg(cstr msg, u8 byte1, u8 byte2, u8 byte3, u8 byte4)
 {
 #ifdef PRINTDBG
 
-printf("%s ", msg);
+print_text("%s ", msg);
 print_binary(byte1);
 print_binary(byte2);
 print_binary(byte3);
 print_binary(byte4);
-printf(" ");
+print_text(" ");
 
 #endif
 }
 
 
-namespace Bytes
-{
-    class Buffer
-    {
-    public:
-        u32 size = 0;
-        u8* data = nullptr;
-    };
-
-
-    static void destroy(Buffer& buffer)
-    {
-        if (buffer.data)
-        {
-            std::free(buffer.data);
-        }
-    }
-
-
-    static bool create(Buffer& buffer, u32 size)
-    {
-        assert(!buffer.data);
-        assert(size);
-        
-        if (buffer.data || !size)
-        {
-            return false;
-        }
-
-        buffer.data = (u8*)std::malloc(size);
-        if (!buffer.data)
-        {
-            return false;
-        }
-
-        return true;
-    }
-
-
-    static Buffer read(fs::path const& path)
-    {
-        Buffer buffer;
-
-        auto size = fs::file_size(path);
-        if (size == 0 || !create(buffer, size))
-        {
-            assert(false);
-            return buffer;
-        }
-
-        std::ifstream file(path, std::ios::binary);
-        if (!file.is_open())
-        {
-            assert(false);
-            destroy(buffer);
-            return buffer;
-        }
-
-        file.read((char*)buffer.data, size);
-        buffer.size = size;
-
-        file.close();
-        return buffer;
-    }
-
-}
+#include "../lib/bytes.hpp"
 
 
 namespace Reg
@@ -702,7 +729,7 @@ namespace CMD
             dst = rm_str;
         }
 
-        printf("%s %s, %s\n", cmd, dst, src);
+        print_text("%s %s, %s\n", cmd, dst, src);
 
         /*printf("%s %s, %s", cmd, dst, src);
         printdbg("", byte1, byte2, byte3, byte4);
@@ -780,7 +807,7 @@ namespace CMD
         char src[7] = { 0 };
         snprintf(src, 7, "%d", im_data);
 
-        printf("%s %s%s, %s\n", cmd, disp_str, dst, src);
+        print_text("%s %s%s, %s\n", cmd, disp_str, dst, src);
 
         /*printf("%s %s%s, %s", cmd, disp_str, dst, src);
         printdbg("", byte1, byte2, byte3, byte4);
@@ -811,7 +838,7 @@ namespace CMD
         char src[6] = { 0 };
         snprintf(src, 6, "%d", im_data);        
 
-        printf("%s %s, %s\n", cmd, dst, src);
+        print_text("%s %s, %s\n", cmd, dst, src);
 
         return offset;
     }
@@ -821,7 +848,7 @@ namespace CMD
     {
         auto byte2 = data[offset + 1];
 
-        printf("%s %d\n", cmd, byte2);
+        print_text("%s %d\n", cmd, byte2);
 
         return offset + 2;
     }
@@ -896,7 +923,7 @@ namespace MOV
 
         auto dst = rm_str;
 
-        printf("mov %s, %s %s\n", dst, disp_str, src);
+        print_text("mov %s, %s %s\n", dst, disp_str, src);
 
         return offset;
     }
@@ -926,7 +953,7 @@ namespace MOV
 
         auto dst = R::decode(reg_bits3, w_bits1);
 
-        printf("mov %s, %s\n", dst, src);
+        print_text("mov %s, %s\n", dst, src);
 
         return offset;
     }
@@ -955,7 +982,7 @@ namespace MOV
 
         auto dst = "ax";
 
-        printf("mov %s, %s\n", dst, src);
+        print_text("mov %s, %s\n", dst, src);
 
         return offset;
     }
@@ -984,7 +1011,7 @@ namespace MOV
         char dst[8] = { 0 };
         snprintf(dst, 8, "[%d]", addr);
 
-        printf("mov %s, %s\n", dst, src);
+        print_text("mov %s, %s\n", dst, src);
 
         return offset;
     }
@@ -1073,15 +1100,20 @@ namespace CMP
 }
 
 
-static int decode_next(u8* data, int offset)
+// numbered across every listing decoded
+static void print_line_number()
 {
-    using OC = OpCode::Name;
-
-    auto opcode =  OpCode::parse(data[offset], data[offset + 1]);
-
     static int line = 1;
 
     printf("%3d ", line++);
+}
+
+
+static int decode_op(u8* data, int offset)
+{
+    using OC = OpCode::Name;
+
+    auto opcode =  OpCode::parse(data[offset], data[offset + 1]);
 
     switch (opcode)
     {
@@ -1193,7 +1225,7 @@ static int decode_next(u8* data, int offset)
         break;
 
     default:
-        printf("opcode (byte1): ");
+        print_text("opcode (byte1): ");
         print_binary(data[offset]);
         return -1;
     }
@@ -1202,6 +1234,55 @@ static int decode_next(u8* data, int offset)
 }
 
 
+// longest instruction decoded, immediate to memory with a 16 bit displacement
+constexpr int MAX_LENGTH = 6;
+
+
+// the decoders read a whole instruction without knowing where the image ends
+// near the end they read a zero padded copy and print to a scratch arena
+// returns -1 for an unknown opcode or an instruction cut off by the end of the image
+static int decode_next(u8* data, int size, int offset)
+{
+    if (offset + MAX_LENGTH <= size)
+    {
+        return decode_op(data, offset);
+    }
+
+    auto n_left = size - offset;
+
+    u8 tail[MAX_LENGTH] = { 0 };
+    std::memcpy(tail, data + offset, n_left);
+
+    TextArena scratch{};
+
+    auto out = text_out;
+    text_out = &scratch;
+
+    auto next = decode_op(tail, 0);
+
+    text_out = out;
+
+    if (next > n_left)
+    {
+        print_text("incomplete instruction at %d\n", offset);
+        next = -1;
+    }
+    else
+    {
+        if (scratch.size)
+        {
+            print_text("%.*s", (int)scratch.size, scratch.data);
+        }
+
+        next = next < 0 ? -1 : offset + next;
+    }
+
+    destroy_arena(scratch);
+
+    return next;
+}
+
+
 static void decode(cstr bin_file)
 {
     printf("\n==================\n\n");
@@ -1216,7 +1297,8 @@ static void decode(cstr bin_file)
     int offset = 0;
     while (offset >= 0 && offset < buffer.size)
     {
-        offset = decode_next(buffer.data, offset);
+        print_line_number();
+        offset = decode_next(buffer.data, (int)buffer.size, offset);
     }
 
     destroy(buffer);
@@ -1225,8 +1307,232 @@ static void decode(cstr bin_file)
 }
 
 
-int main()
+constexpr u32 MAX_THREADS = 256;
+
+// smaller images are not split
+constexpr u32 MIN_CHUNK_SIZE = 1024;
+
+
+// instructions decoded by one thread from a guessed boundary
+class Chunk
+{
+public:
+    int begin = 0;
+    int end = 0;
+
+    // start, next offset and text of each instruction, next is -1 for an unknown opcode
+    int* offsets = nullptr;
+    int* nexts = nullptr;
+    u32* texts = nullptr;
+    u32 n_decoded = 0;
+
+    TextArena text;
+};
+
+
+static void destroy_chunk(Chunk& chunk)
+{
+    std::free(chunk.offsets);
+    std::free(chunk.nexts);
+    std::free(chunk.texts);
+    chunk.offsets = nullptr;
+    chunk.nexts = nullptr;
+    chunk.texts = nullptr;
+
+    destroy_arena(chunk.text);
+}
+
+
+static bool create_chunk(Chunk& chunk, int begin, int end)
+{
+    assert(!chunk.offsets);
+
+    // every instruction is at least one byte
+    auto n = (u32)(end - begin);
+
+    chunk.begin = begin;
+    chunk.end = end;
+    chunk.offsets = (int*)std::malloc(sizeof(int) * n);
+    chunk.nexts = (int*)std::malloc(sizeof(int) * n);
+    chunk.texts = (u32*)std::malloc(sizeof(u32) * n);
+
+    if (!chunk.offsets || !chunk.nexts || !chunk.texts)
+    {
+        destroy_chunk(chunk);
+        return false;
+    }
+
+    return true;
+}
+
+
+// the first instruction may start mid instruction, the path resynchronizes after a few
+// the last one may run into the next chunk, only size bounds the reads
+static void decode_chunk(u8* data, int size, Chunk& chunk)
+{
+    text_out = &chunk.text;
+
+    int offset = chunk.begin;
+    while (offset < chunk.end)
+    {
+        auto i = chunk.n_decoded++;
+
+        chunk.offsets[i] = offset;
+        chunk.texts[i] = chunk.text.size;
+
+        auto next = decode_next(data, size, offset);
+        chunk.nexts[i] = next;
+
+        // skip a byte and keep looking for a boundary
+        offset = next < 0 ? offset + 1 : next;
+    }
+
+    text_out = nullptr;
+}
+
+
+// index of the instruction starting at offset, -1 when the chunk did not decode one there
+static int find_offset(Chunk const& chunk, int offset)
 {
+    int lo = 0;
+    int hi = (int)chunk.n_decoded - 1;
+
+    while (lo <= hi)
+    {
+        auto mid = (lo + hi) / 2;
+        auto value = chunk.offsets[mid];
+
+        if (value == offset)
+        {
+            return mid;
+        }
+
+        if (value < offset)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid - 1;
+        }
+    }
+
+    return -1;
+}
+
+
+// prints the instructions of the chunk on the true path starting at offset
+// returns where the path leaves the chunk, -1 when it ends
+static int print_chunk(u8* data, int size, Chunk const& chunk, int offset)
+{
+    auto i = find_offset(chunk, offset);
+
+    // the guessed boundary was wrong, decode until the paths converge
+    while (i < 0 && offset >= 0 && offset < chunk.end)
+    {
+        print_line_number();
+        offset = decode_next(data, size, offset);
+        i = find_offset(chunk, offset);
+    }
+
+    if (i < 0)
+    {
+        return offset;
+    }
+
+    for (auto k = (u32)i; k < chunk.n_decoded; ++k)
+    {
+        print_line_number();
+
+        auto text_end = k + 1 < chunk.n_decoded ? chunk.texts[k + 1] : chunk.text.size;
+        fwrite(chunk.text.data + chunk.texts[k], 1, text_end - chunk.texts[k], stdout);
+
+        offset = chunk.nexts[k];
+        if (offset < 0 || offset >= chunk.end)
+        {
+            break;
+        }
+
+        // the next instruction decoded is the one at offset
+        assert(chunk.offsets[k + 1] == offset);
+    }
+
+    return offset;
+}
+
+
+// same output as decode, chunks of the image are decoded on their own threads
+static void decode_parallel(cstr bin_file, u32 n_threads)
+{
+    printf("\n==================\n\n");
+
+    auto buffer = Bytes::read(bin_file);
+
+    assert(buffer.data);
+    assert(buffer.size);
+
+    printf("bits 16\n\n");
+
+    auto n_chunks = (u32)std::min((u64)n_threads, buffer.size / MIN_CHUNK_SIZE);
+    n_chunks = std::max(std::min(n_chunks, MAX_THREADS), 1u);
+
+    Chunk chunks[MAX_THREADS];
+
+    auto chunk_size = buffer.size / n_chunks;
+
+    for (u32 i = 0; i < n_chunks; ++i)
+    {
+        auto begin = (int)(i * chunk_size);
+        auto end = i + 1 == n_chunks ? (int)buffer.size : begin + (int)chunk_size;
+
+        if (!create_chunk(chunks[i], begin, end))
+        {
+            assert(false);
+            n_chunks = 0;
+        }
+    }
+
+    std::thread workers[MAX_THREADS];
+
+    for (u32 i = 0; i < n_chunks; ++i)
+    {
+        workers[i] = std::thread(decode_chunk, buffer.data, (int)buffer.size, std::ref(chunks[i]));
+    }
+
+    for (u32 i = 0; i < n_chunks; ++i)
+    {
+        workers[i].join();
+    }
+
+    // the first chunk starts on a boundary, each seam continues the path of the chunk before it
+    int offset = 0;
+    for (u32 i = 0; i < n_chunks && offset >= 0; ++i)
+    {
+        offset = print_chunk(buffer.data, (int)buffer.size, chunks[i], offset);
+    }
+
+    for (u32 i = 0; i < MAX_THREADS; ++i)
+    {
+        destroy_chunk(chunks[i]);
+    }
+
+    Bytes::destroy(buffer);
+
+    printf("\n\n------------------\n");
+}
+
+
+int main(int argc, char* argv[])
+{
+    // decode --parallel bin_file [n_threads]
+    if (argc > 2 && strcmp(argv[1], "--parallel") == 0)
+    {
+        u32 n_threads = argc > 3 ? (u32)atoi(argv[3]) : std::thread::hardware_concurrency();
+
+        decode_parallel(argv[2], n_threads ? n_threads : 1);
+        return 0;
+    }
+
     decode("../02/listing_0039_more_movs");
     decode("../02/listing_0040_challenge_movs");
 
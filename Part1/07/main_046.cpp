@@ -29,72 +29,7 @@ public:
 };
 
 
-namespace Bytes
-{
-    class Buffer
-    {
-    public:
-        u32 size = 0;
-        u8* data = nullptr;
-    };
-
-
-    static void destroy(Buffer& buffer)
-    {
-        if (buffer.data)
-        {
-            std::free(buffer.data);
-        }
-    }
-
-
-    static bool create(Buffer& buffer, u32 size)
-    {
-        assert(!buffer.data);
-        assert(size);
-        
-        if (buffer.data || !size)
-        {
-            return false;
-        }
-
-        buffer.data = (u8*)std::malloc(size);
-        if (!buffer.data)
-        {
-            return false;
-        }
-
-        return true;
-    }
-
-
-    static Buffer read(fs::path const& path)
-    {
-        Buffer buffer;
-
-        auto size = fs::file_size(path);
-        if (size == 0 || !create(buffer, size))
-        {
-            assert(false);
-            return buffer;
-        }
-
-        std::ifstream file(path, std::ios::binary);
-        if (!file.is_open())
-        {
-            assert(false);
-            destroy(buffer);
-            return buffer;
-        }
-
-        file.read((char*)buffer.data, size);
-        buffer.size = size;
-
-        file.close();
-        return buffer;
-    }
-
-}
+#include "../lib/bytes.hpp"
 
 
 namespace REG
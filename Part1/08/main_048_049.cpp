@@ -29,72 +29,7 @@ public:
 };
 
 
-namespace Bytes
-{
-    class Buffer
-    {
-    public:
-        u32 size = 0;
-        u8* data = nullptr;
-    };
-
-
-    static void destroy(Buffer& buffer)
-    {
-        if (buffer.data)
-        {
-            std::free(buffer.data);
-        }
-    }
-
-
-    static bool create(Buffer& buffer, u32 size)
-    {
-        assert(!buffer.data);
-        assert(size);
-        
-        if (buffer.data || !size)
-        {
-            return false;
-        }
-
-        buffer.data = (u8*)std::malloc(size);
-        if (!buffer.data)
-        {
-            return false;
-        }
-
-        return true;
-    }
-
-
-    static Buffer read(fs::path const& path)
-    {
-        Buffer buffer;
-
-        auto size = fs::file_size(path);
-        if (size == 0 || !create(buffer, size))
-        {
-            assert(false);
-            return buffer;
-        }
-
-        std::ifstream file(path, std::ios::binary);
-        if (!file.is_open())
-        {
-            assert(false);
-            destroy(buffer);
-            return buffer;
-        }
-
-        file.read((char*)buffer.data, size);
-        buffer.size = size;
-
-        file.close();
-        return buffer;
-    }
-
-}
+#include "../lib/bytes.hpp"
 
 
 namespace REG
@@ -1156,6 +1091,36 @@ namespace MOV
     {
         CMD::print(cmd, "mov");
     }
+
+
+    static void rm_r(DATA::InstrData const& in_data)
+    {
+        rm_r(CMD::get_rm_r(in_data));
+    }
+
+
+    static void im_rm(DATA::InstrData const& in_data)
+    {
+        im_rm(CMD::get_im_rm(in_data));
+    }
+
+
+    static void im_r(DATA::InstrData const& in_data)
+    {
+        im_rm(CMD::get_im_r(in_data));
+    }
+
+
+    static void m_ac(DATA::InstrData const& in_data)
+    {
+        m_ac(CMD::get_m_ac(in_data));
+    }
+
+
+    static void ac_m(DATA::InstrData const& in_data)
+    {
+        ac_m(CMD::get_ac_m(in_data));
+    }
 }
 
 
@@ -1283,6 +1248,24 @@ namespace ADD
             f(val);
         }
     }
+
+
+    static void rm_r(DATA::InstrData const& in_data)
+    {
+        rm_r(CMD::get_rm_r(in_data));
+    }
+
+
+    static void im_rm(DATA::InstrData const& in_data)
+    {
+        im_rm(CMD::get_im_rm(in_data));
+    }
+
+
+    static void im_ac(DATA::InstrData const& in_data)
+    {
+        im_ac(CMD::get_im_ac(in_data));
+    }
 }
 
 
@@ -1410,6 +1393,24 @@ namespace SUB
             f(val);
         }
     }
+
+
+    static void rm_r(DATA::InstrData const& in_data)
+    {
+        rm_r(CMD::get_rm_r(in_data));
+    }
+
+
+    static void im_rm(DATA::InstrData const& in_data)
+    {
+        im_rm(CMD::get_im_rm(in_data));
+    }
+
+
+    static void im_ac(DATA::InstrData const& in_data)
+    {
+        im_ac(CMD::get_im_ac(in_data));
+    }
 }
 
 
@@ -1525,6 +1526,24 @@ namespace CMP
             f(val);
         }
     }
+
+
+    static void rm_r(DATA::InstrData const& in_data)
+    {
+        rm_r(CMD::get_rm_r(in_data));
+    }
+
+
+    static void im_rm(DATA::InstrData const& in_data)
+    {
+        im_rm(CMD::get_im_rm(in_data));
+    }
+
+
+    static void im_ac(DATA::InstrData const& in_data)
+    {
+        im_ac(CMD::get_im_ac(in_data));
+    }
 }
 
 
@@ -1542,219 +1561,137 @@ namespace JUMP
             REG::set_ip(REG::ip() + cmd.j_offset);
         }
     }
+
+
+    static void jnz(DATA::InstrData const& in_data)
+    {
+        jnz(CMD::get_jump(in_data));
+    }
 }
 
 
-static int decode_next(u8* data, int offset)
+namespace OP
 {
-    auto byte1 = data[offset];
-    auto byte2 = data[offset + 1];        
+    typedef DATA::InstrData (*decode_t)(u8*, int);
+    typedef void (*exec_t)(DATA::InstrData const&);
 
-    auto byte1_top4 = byte1 >> 4;
-    auto byte1_top6 = byte1 >> 2;
-    auto byte1_top7 = byte1 >> 1;
 
-    auto byte2_345 = (byte2 & 0b00'111'000) >> 3;
-    
-    /*auto const set_jump = [&](Op op)
+    // decoder/executor pair for an opcode
+    class OpDef
     {
-        inst.op = op;
-        inst.src_val = (int)byte2;
-        inst.offset_end = offset + 2;
-    };*/
+    public:
+        decode_t decode = nullptr;
+        exec_t exec = nullptr;
 
-    if (byte1_top6 == 0b0010'0010)
-    {
-        auto inst = DATA::get_rm_r(data, offset);
-        auto cmd = CMD::get_rm_r(inst);
-        MOV::rm_r(cmd);
-        offset = REG::ip();
-    }
-    else if (byte1_top7 == 0b0110'0011)
-    {
-        auto inst = DATA::get_im_rm(data, offset);
-        auto cmd = CMD::get_im_rm(inst);
-        MOV::im_rm(cmd);
-        offset = REG::ip();
-    }
-    else if (byte1_top4 == 0b0000'1011)
-    {
-        auto inst = DATA::get_mov_im_r(data, offset);
-        auto cmd = CMD::get_im_r(inst);
-        MOV::im_rm(cmd);
-        offset = REG::ip();
-    }
-    else if (byte1_top7 == 0b0110'0011)
-    {
-        auto inst = DATA::get_mov_m_ac(data, offset);
-        auto cmd = CMD::get_m_ac(inst);
-        MOV::m_ac(cmd);
-        offset = REG::ip();
-    }
-    else if (byte1_top7 == 0b0101'0001)
-    {
-        auto inst = DATA::get_mov_m_ac(data, offset);
-        auto cmd = CMD::get_ac_m(inst);
-        MOV::ac_m(cmd);
-        offset = REG::ip();
-    }
+        // opcode is selected by the reg field of the ModRM byte
+        bool by_reg = false;
+    };
 
-    else if (byte1_top6 == 0b0000'0000)
-    {
-        auto inst = DATA::get_rm_r(data, offset);
-        auto cmd = CMD::get_rm_r(inst);
-        ADD::rm_r(cmd);
-        offset = REG::ip();
-    }
-    else if (byte1_top6 == 0b0010'0000 && byte2_345 == 0b0000'0000)
-    {
-        auto inst = DATA::get_im_rm(data, offset);
-        auto cmd = CMD::get_im_rm(inst);
-        ADD::im_rm(cmd);
-        offset = REG::ip();
-    }
-    else if (byte1_top7 == 0b0001'0110)
-    {
-        auto inst = DATA::get_im_ac(data, offset);
-        auto cmd = CMD::get_im_ac(inst);
-        ADD::im_ac(cmd);
-        offset = REG::ip();
-    }
 
-    else if (byte1_top6 == 0b0000'1010)
-    {
-        auto inst = DATA::get_rm_r(data, offset);
-        auto cmd = CMD::get_rm_r(inst);
-        SUB::rm_r(cmd);
-        offset = REG::ip();
-    }
-    else if (byte1_top6 == 0b0010'0000 && byte2_345 == 0b0000'0101)
+    class OpTable
     {
-        auto inst = DATA::get_im_rm(data, offset);
-        auto cmd = CMD::get_im_rm(inst);
-        SUB::im_rm(cmd);
-        offset = REG::ip();
-    }
-    else if (byte1_top7 == 0b0001'0110)
-    {
-        auto inst = DATA::get_im_ac(data, offset);
-        auto cmd = CMD::get_im_ac(inst);
-        SUB::im_ac(cmd);
-        offset = REG::ip();
-    }
+    public:
+        OpDef byte1[256];
 
-    else if (byte1_top6 == 0b0000'1110)
-    {
-        auto inst = DATA::get_rm_r(data, offset);
-        auto cmd = CMD::get_rm_r(inst);
-        CMP::rm_r(cmd);
-        offset = REG::ip();
-    }
-    else if (byte1_top6 == 0b0010'0000 && byte2_345 == 0b0000'0111)
-    {
-        auto inst = DATA::get_im_rm(data, offset);
-        auto cmd = CMD::get_im_rm(inst);
-        CMP::im_rm(cmd);
-        offset = REG::ip();
-    }
-    else if (byte1_top7 == 0b0001'1110)
-    {
-        auto inst = DATA::get_im_ac(data, offset);
-        auto cmd = CMD::get_im_ac(inst);
-        CMP::im_ac(cmd);
-        offset = REG::ip();
-    }
+        // 0b1000'00sw, indexed by reg
+        OpDef im_rm[8];
+    };
 
-    else if (byte1 == 0b0111'0101)
-    {
-        auto inst = DATA::get_jump(data, offset);
-        auto cmd = CMD::get_jump(inst);
-        JUMP::jnz(cmd);
-        offset = REG::ip();
-    }
-    
 
-    /*else if (byte1 == 0b0111'0100)
-    {
-        set_jump(Op::je);
-    }
-    else if (byte1 == 0b0111'1100)
-    {
-        set_jump(Op::jl);
-    }
-    else if (byte1 == 0b0111'1110)
+    static constexpr OpTable make_op_table()
     {
-        set_jump(Op::jle);
-    }
-    else if (byte1 == 0b0111'0010)
-    {
-        set_jump(Op::jb);
-    }
-    else if (byte1 == 0b0111'0110)
-    {
-        set_jump(Op::jbe);
-    }
-    else if (byte1 == 0b0111'1010)
-    {
-        set_jump(Op::jp);
-    }
-    else if (byte1 == 0b0111'0000)
-    {
-        set_jump(Op::jo);
-    }
-    else if (byte1 == 0b0111'1000)
-    {
-        set_jump(Op::js);
-    }
-    else if (byte1 == 0b0111'0101)
-    {
-        set_jump(Op::jnz);
-    }
-    else if (byte1 == 0b0111'1101)
-    {
-        set_jump(Op::jnl);
-    }
-    else if (byte1 == 0b0111'1111)
-    {
-        set_jump(Op::jg);
-    }
-    else if (byte1 == 0b0111'0011)
-    {
-        set_jump(Op::jnb);
-    }
-    else if (byte1 == 0b0111'0111)
-    {
-        set_jump(Op::ja);
-    }
-    else if (byte1 == 0b0111'1011)
-    {
-        set_jump(Op::jnp);
-    }
-    else if (byte1 == 0b0111'0001)
-    {
-        set_jump(Op::jno);
-    }
-    else if (byte1 == 0b0111'1001)
-    {
-        set_jump(Op::jns);
-    }
-    else if (byte1 == 0b1110'0010)
-    {
-        set_jump(Op::loop);
-    }
-    else if (byte1 == 0b1110'0001)
+        OpTable table{};
+
+        auto const set = [&](int byte1, int count, decode_t decode, exec_t exec)
+        {
+            for (int i = 0; i < count; ++i)
+            {
+                auto& def = table.byte1[byte1 + i];
+                def.decode = decode;
+                def.exec = exec;
+            }
+        };
+
+        auto const set_im_rm = [&](int reg, exec_t exec)
+        {
+            auto& def = table.im_rm[reg];
+            def.decode = DATA::get_im_rm;
+            def.exec = exec;
+        };
+
+        // mov
+        set(0b1000'1000, 4, DATA::get_rm_r, MOV::rm_r);
+        set(0b1100'0110, 2, DATA::get_im_rm, MOV::im_rm);
+        set(0b1011'0000, 16, DATA::get_mov_im_r, MOV::im_r);
+        set(0b1010'0000, 2, DATA::get_mov_m_ac, MOV::m_ac);
+        set(0b1010'0010, 2, DATA::get_mov_m_ac, MOV::ac_m);
+
+        // add
+        set(0b0000'0000, 4, DATA::get_rm_r, ADD::rm_r);
+        set(0b0000'0100, 2, DATA::get_im_ac, ADD::im_ac);
+        set_im_rm(0b000, ADD::im_rm);
+
+        // sub
+        set(0b0010'1000, 4, DATA::get_rm_r, SUB::rm_r);
+        set(0b0010'1100, 2, DATA::get_im_ac, SUB::im_ac);
+        set_im_rm(0b101, SUB::im_rm);
+
+        // cmp
+        set(0b0011'1000, 4, DATA::get_rm_r, CMP::rm_r);
+        set(0b0011'1100, 2, DATA::get_im_ac, CMP::im_ac);
+        set_im_rm(0b111, CMP::im_rm);
+
+        for (int i = 0; i < 4; ++i)
+        {
+            table.byte1[0b1000'0000 + i].by_reg = true;
+        }
+
+        // jump
+        //set(0b0111'0100, 1, DATA::get_jump, JUMP::je);
+        //set(0b0111'1100, 1, DATA::get_jump, JUMP::jl);
+        //set(0b0111'1110, 1, DATA::get_jump, JUMP::jle);
+        //set(0b0111'0010, 1, DATA::get_jump, JUMP::jb);
+        //set(0b0111'0110, 1, DATA::get_jump, JUMP::jbe);
+        //set(0b0111'1010, 1, DATA::get_jump, JUMP::jp);
+        //set(0b0111'0000, 1, DATA::get_jump, JUMP::jo);
+        //set(0b0111'1000, 1, DATA::get_jump, JUMP::js);
+        set(0b0111'0101, 1, DATA::get_jump, JUMP::jnz);
+        //set(0b0111'1101, 1, DATA::get_jump, JUMP::jnl);
+        //set(0b0111'1111, 1, DATA::get_jump, JUMP::jg);
+        //set(0b0111'0011, 1, DATA::get_jump, JUMP::jnb);
+        //set(0b0111'0111, 1, DATA::get_jump, JUMP::ja);
+        //set(0b0111'1011, 1, DATA::get_jump, JUMP::jnp);
+        //set(0b0111'0001, 1, DATA::get_jump, JUMP::jno);
+        //set(0b0111'1001, 1, DATA::get_jump, JUMP::jns);
+        //set(0b1110'0010, 1, DATA::get_jump, JUMP::loop);
+        //set(0b1110'0001, 1, DATA::get_jump, JUMP::loopz);
+        //set(0b1110'0000, 1, DATA::get_jump, JUMP::loopnz);
+        //set(0b1110'0011, 1, DATA::get_jump, JUMP::jcxz);
+
+        return table;
+    }
+
+
+    static constexpr OpTable OP_TABLE = make_op_table();
+}
+
+
+static int decode_next(u8* data, int offset)
+{
+    auto def = OP::OP_TABLE.byte1[data[offset]];
+
+    if (def.by_reg)
     {
-        set_jump(Op::loopz);
+        auto reg = (data[offset + 1] & 0b00'111'000) >> 3;
+        def = OP::OP_TABLE.im_rm[reg];
     }
-    else if (byte1 == 0b1110'0000)
+
+    if (def.decode)
     {
-        set_jump(Op::loopnz);
+        auto inst = def.decode(data, offset);
+        def.exec(inst);
+        offset = REG::ip();
     }
-    else if (byte1 == 0b1110'0011)
-    {
-        set_jump(Op::jcxz);
-    }*/
-
     else
     {
         offset = -1;
@@ -0,0 +1,305 @@
+#include <thread>
+#include <atomic>
+#include <chrono>
+
+
+namespace BATCH
+{
+    constexpr u32 MAX_JOBS = 4096;
+    constexpr u32 MAX_THREADS = 256;
+
+
+    // one program run on its own machine
+    class Job
+    {
+    public:
+        char bin_file[256] = { 0 };
+
+        // shared by the copies of a program, owned by the first
+        Bytes::Buffer program;
+        bool owns_program = false;
+
+        // initial value of the general registers
+        u16 init = 0;
+
+        u64 n_instructions = 0;
+        u16 final_ip = 0;
+    };
+
+
+    class Batch
+    {
+    public:
+        Job* jobs = nullptr;
+        u32 n_jobs = 0;
+
+        std::atomic<u32> next_job = 0;
+
+        // runs on restored machines compared with a fresh machine
+        u32 n_checks = 0;
+        u32 n_mismatches = 0;
+    };
+
+
+    // machine of a thread, kept after the timed run for the restore check
+    class Worker
+    {
+    public:
+        CpuState* cpu = nullptr;
+
+        Job* last = nullptr;
+        u32 n_run = 0;
+    };
+
+
+    static void destroy(Batch& batch)
+    {
+        if (!batch.jobs)
+        {
+            return;
+        }
+
+        for (u32 i = 0; i < batch.n_jobs; ++i)
+        {
+            auto& job = batch.jobs[i];
+            if (job.owns_program)
+            {
+                Bytes::destroy(job.program);
+            }
+        }
+
+        std::free(batch.jobs);
+        batch.jobs = nullptr;
+        batch.n_jobs = 0;
+    }
+
+
+    static bool create(Batch& batch, u32 max_jobs)
+    {
+        assert(!batch.jobs);
+        assert(max_jobs);
+
+        batch.jobs = (Job*)std::calloc(max_jobs, sizeof(Job));
+        if (!batch.jobs)
+        {
+            assert(false);
+            return false;
+        }
+
+        batch.n_jobs = 0;
+
+        return true;
+    }
+
+
+    static bool add_program(Batch& batch, fs::path const& path, u32 n_copies)
+    {
+        if (batch.n_jobs + n_copies > MAX_JOBS)
+        {
+            return false;
+        }
+
+        auto program = Bytes::read(path);
+        if (!program.data)
+        {
+            return false;
+        }
+
+        for (u32 i = 0; i < n_copies; ++i)
+        {
+            auto& job = batch.jobs[batch.n_jobs++];
+
+            snprintf(job.bin_file, sizeof(job.bin_file), "%s", path.filename().c_str());
+            job.program = program;
+            job.owns_program = i == 0;
+            job.init = (u16)i;
+        }
+
+        return true;
+    }
+
+
+    // a directory runs every assembled listing in it, i.e. listing_* without an extension
+    static bool add_jobs(Batch& batch, cstr path, u32 n_copies)
+    {
+        if (!fs::is_directory(path))
+        {
+            return add_program(batch, path, n_copies);
+        }
+
+        for (auto const& entry : fs::directory_iterator(path))
+        {
+            auto& file = entry.path();
+
+            auto name = file.filename().string();
+
+            if (!entry.is_regular_file() || file.has_extension() || name.rfind("listing_", 0) != 0 || fs::file_size(file) == 0)
+            {
+                continue;
+            }
+
+            if (!add_program(batch, file, n_copies))
+            {
+                return false;
+            }
+        }
+
+        std::qsort(batch.jobs, batch.n_jobs, sizeof(Job), [](void const* a, void const* b)
+        {
+            auto& lhs = *(Job const*)a;
+            auto& rhs = *(Job const*)b;
+
+            auto res = strcmp(lhs.bin_file, rhs.bin_file);
+
+            return res ? res : (int)lhs.init - (int)rhs.init;
+        });
+
+        return batch.n_jobs > 0;
+    }
+
+
+    static void set_init(CpuState& cpu, u16 init)
+    {
+        for (int i = 0; i < REG::N_GENERAL; ++i)
+        {
+            cpu.regs[i] = init;
+        }
+    }
+
+
+    // a fresh machine must end where the restored one did
+    static bool check(CpuState const& restored, Job const& job)
+    {
+        CpuState* fresh = nullptr;
+        if (!REG::create(fresh))
+        {
+            return false;
+        }
+
+        set_init(*fresh, job.init);
+        decode_run(*fresh, job.program.data, job.program.size);
+
+        auto result = REG::equal(restored, *fresh);
+
+        REG::destroy(fresh);
+
+        return result;
+    }
+
+
+    static void work(Batch& batch, Worker& worker)
+    {
+        if (!REG::create(worker.cpu))
+        {
+            return;
+        }
+
+        auto cpu = worker.cpu;
+
+        // golden image of a reset machine, each job starts from it
+        REG::Snapshot* golden = nullptr;
+        if (!REG::create(golden, *cpu))
+        {
+            return;
+        }
+
+        for (u32 i = batch.next_job++; i < batch.n_jobs; i = batch.next_job++)
+        {
+            auto& job = batch.jobs[i];
+
+            // copies back only the pages the previous job wrote
+            REG::restore(*cpu, *golden);
+            set_init(*cpu, job.init);
+
+            job.n_instructions = decode_run(*cpu, job.program.data, job.program.size);
+            job.final_ip = cpu->IP;
+
+            worker.last = &job;
+            ++worker.n_run;
+        }
+
+        REG::destroy(golden);
+    }
+
+
+    // the last job of a worker started from memory the others had written
+    static void check(Batch& batch, Worker& worker)
+    {
+        if (worker.n_run > 1)
+        {
+            ++batch.n_checks;
+            batch.n_mismatches += !check(*worker.cpu, *worker.last);
+        }
+
+        REG::destroy(worker.cpu);
+    }
+
+
+    // copy i of a program starts with every general register set to i
+    static bool run(cstr path, u32 n_copies, u32 n_threads)
+    {
+        Batch batch{};
+        if (!create(batch, MAX_JOBS))
+        {
+            return false;
+        }
+
+        if (!add_jobs(batch, path, n_copies))
+        {
+            destroy(batch);
+            return false;
+        }
+
+        if (n_threads > batch.n_jobs)
+        {
+            n_threads = batch.n_jobs;
+        }
+
+        printf("batch: %u jobs, %u threads\n", batch.n_jobs, n_threads);
+
+        std::thread workers[MAX_THREADS];
+        Worker states[MAX_THREADS];
+
+        auto start = std::chrono::steady_clock::now();
+
+        for (u32 i = 0; i < n_threads; ++i)
+        {
+            workers[i] = std::thread(work, std::ref(batch), std::ref(states[i]));
+        }
+
+        for (u32 i = 0; i < n_threads; ++i)
+        {
+            workers[i].join();
+        }
+
+        auto end = std::chrono::steady_clock::now();
+        auto sec = std::chrono::duration<f64>(end - start).count();
+
+        // not timed
+        for (u32 i = 0; i < n_threads; ++i)
+        {
+            check(batch, states[i]);
+        }
+
+        u64 total = 0;
+
+        for (u32 i = 0; i < batch.n_jobs; ++i)
+        {
+            auto& job = batch.jobs[i];
+            printf("%s (init %u): %llu instructions, ip: 0x%04x\n", job.bin_file, job.init, (unsigned long long)job.n_instructions, job.final_ip);
+
+            total += job.n_instructions;
+        }
+
+        printf("\ninstructions: %llu\n", (unsigned long long)total);
+        printf("seconds: %f\n", sec);
+        printf("instructions/s: %.0f\n", sec > 0.0 ? total / sec : 0.0);
+        printf("restore checks: %u, mismatches: %u\n", batch.n_checks, batch.n_mismatches);
+
+        auto result = batch.n_mismatches == 0;
+
+        destroy(batch);
+
+        return result;
+    }
+}
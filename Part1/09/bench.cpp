@@ -0,0 +1,425 @@
+#include <x86intrin.h>
+
+
+namespace BENCH
+{
+    constexpr u32 MB = 1024 * 1024;
+
+    // longest instruction generated, a prefix is never followed by one
+    constexpr u32 MAX_LENGTH = 6;
+
+    // timed passes over the stream, the fastest is reported
+    constexpr int N_PASSES = 3;
+
+
+    // xorshift64*, the same stream for the same seed
+    class Rng
+    {
+    public:
+        u64 state = 1;
+    };
+
+
+    static u32 next(Rng& rng)
+    {
+        rng.state ^= rng.state >> 12;
+        rng.state ^= rng.state << 25;
+        rng.state ^= rng.state >> 27;
+
+        return (u32)((rng.state * 0x2545F4914F6CDD1Dull) >> 32);
+    }
+
+
+    static u32 next(Rng& rng, u32 n)
+    {
+        return next(rng) % n;
+    }
+
+
+    // rep prefixes and string instructions
+    constexpr u8 STRING_OPS[] = { 0xA4, 0xA5, 0xA6, 0xA7, 0xAA, 0xAB, 0xAC, 0xAD, 0xAE, 0xAF };
+
+    // 0b1000'00sw selects add, sub or cmp by reg
+    constexpr u8 IM_RM_REGS[] = { 0b000, 0b101, 0b111 };
+
+
+    static u8 pick(Rng& rng, u8 const* values, u32 n)
+    {
+        return values[next(rng, n)];
+    }
+
+
+    // writes a ModRM byte and its displacement, returns the bytes written
+    static u32 put_modrm(Rng& rng, u8* dst, int reg)
+    {
+        auto mod = (int)next(rng, 4);
+        auto rm = (int)next(rng, 8);
+
+        dst[0] = (u8)((mod << 6) | (reg << 3) | rm);
+
+        auto disp_sz = DATA::get_disp_sz(mod, rm);
+        for (int i = 0; i < disp_sz; ++i)
+        {
+            dst[1 + i] = (u8)next(rng);
+        }
+
+        return 1 + disp_sz;
+    }
+
+
+    static u32 put_bytes(Rng& rng, u8* dst, int n)
+    {
+        for (int i = 0; i < n; ++i)
+        {
+            dst[i] = (u8)next(rng);
+        }
+
+        return n;
+    }
+
+
+    // one random instruction of a form decode_next supports, returns its length
+    static u32 put_instruction(Rng& rng, u8* dst)
+    {
+        constexpr u8 RM_R[] = { 0x00, 0x28, 0x38, 0x88 };
+        constexpr u8 IM_AC[] = { 0x04, 0x2C, 0x3C };
+
+        switch (next(rng, 12))
+        {
+        case 0:
+        {
+            // mov, add, sub, cmp register/memory with register, any d and w
+            dst[0] = (u8)(pick(rng, RM_R, 4) | next(rng, 4));
+            return 1 + put_modrm(rng, dst + 1, (int)next(rng, 8));
+        }
+
+        case 1:
+        {
+            // mov to or from a segment register
+            dst[0] = next(rng, 2) ? 0x8C : 0x8E;
+            return 1 + put_modrm(rng, dst + 1, (int)next(rng, 4));
+        }
+
+        case 2:
+        {
+            // add, sub, cmp immediate to register/memory, any s and w
+            auto byte1 = (u8)(0x80 | next(rng, 4));
+            dst[0] = byte1;
+
+            auto len = 1 + put_modrm(rng, dst + 1, pick(rng, IM_RM_REGS, 3));
+            auto w = byte1 & 1;
+            auto s = (byte1 >> 1) & 1;
+
+            return len + put_bytes(rng, dst + len, DATA::get_w_sz(w && !s));
+        }
+
+        case 3:
+        {
+            // mov immediate to register/memory
+            auto byte1 = (u8)(0xC6 | next(rng, 2));
+            dst[0] = byte1;
+
+            auto len = 1 + put_modrm(rng, dst + 1, 0);
+
+            return len + put_bytes(rng, dst + len, DATA::get_w_sz(byte1 & 1));
+        }
+
+        case 4:
+        {
+            // mov immediate to register
+            auto byte1 = (u8)(0xB0 | next(rng, 16));
+            dst[0] = byte1;
+
+            return 1 + put_bytes(rng, dst + 1, DATA::get_w_sz((byte1 >> 3) & 1));
+        }
+
+        case 5:
+        {
+            // mov memory to and from the accumulator
+            dst[0] = (u8)(0xA0 | next(rng, 4));
+            return 1 + put_bytes(rng, dst + 1, 2);
+        }
+
+        case 6:
+        {
+            // add, sub, cmp immediate to the accumulator
+            auto byte1 = (u8)(pick(rng, IM_AC, 3) | next(rng, 2));
+            dst[0] = byte1;
+
+            return 1 + put_bytes(rng, dst + 1, DATA::get_w_sz(byte1 & 1));
+        }
+
+        case 7:
+        {
+            // string instruction with no prefix, rep or repne
+            auto n_prefix = next(rng, 3);
+            if (n_prefix)
+            {
+                dst[0] = (u8)(0xF1 + n_prefix);
+            }
+
+            dst[n_prefix ? 1 : 0] = pick(rng, STRING_OPS, sizeof(STRING_OPS));
+            return n_prefix ? 2 : 1;
+        }
+
+        case 8:
+        {
+            // cld, std
+            dst[0] = (u8)(0xFC | next(rng, 2));
+            return 1;
+        }
+
+        case 9:
+        {
+            // push and pop of a register or segment register, no pop cs
+            auto sr = next(rng, 4);
+            auto pop = sr != 1 && next(rng, 2);
+
+            dst[0] = next(rng, 2)
+                ? (u8)(0x50 | next(rng, 16))
+                : (u8)((sr << 3) | 0b110 | pop);
+
+            return 1;
+        }
+
+        case 10:
+        {
+            // call, ret and ret im
+            switch (next(rng, 3))
+            {
+            case 0: dst[0] = 0xE8; return 1 + put_bytes(rng, dst + 1, 2);
+            case 1: dst[0] = 0xC3; return 1;
+            default: dst[0] = 0xC2; return 1 + put_bytes(rng, dst + 1, 2);
+            }
+        }
+
+        default:
+        {
+            // jnz
+            dst[0] = 0x75;
+            return 1 + put_bytes(rng, dst + 1, 1);
+        }
+        }
+    }
+
+
+    // fills size bytes with whole instructions, cld pads the tail
+    static u32 generate(Rng& rng, u8* data, u32 size)
+    {
+        u32 n_instructions = 0;
+
+        u32 offset = 0;
+        while (offset + MAX_LENGTH <= size)
+        {
+            offset += put_instruction(rng, data + offset);
+            ++n_instructions;
+        }
+
+        for (; offset < size; ++offset)
+        {
+            data[offset] = 0xFC;
+            ++n_instructions;
+        }
+
+        return n_instructions;
+    }
+
+
+    static u32 put_u16(u8* dst, u16 value, int size)
+    {
+        for (int i = 0; i < size; ++i)
+        {
+            dst[i] = (u8)(value >> (8 * i));
+        }
+
+        return size;
+    }
+
+
+    // the bytes the decoded instruction came from, returns their count
+    static u32 encode(DATA::Instr const& in, u8* dst)
+    {
+        u32 len = 0;
+
+        if (in.rep_b2)
+        {
+            dst[len++] = (u8)(0b1111'0000 | in.rep_b2);
+        }
+
+        dst[len++] = in.opcode;
+
+        auto& def = OP::OP_TABLE.byte1[in.opcode];
+        auto modrm = (u8)((in.mod_b2 << 6) | (in.reg_b3 << 3) | in.rm_b3);
+
+        if (def.by_reg || def.decode == DATA::get_rm_r || def.decode == DATA::get_mov_sr || def.decode == DATA::get_mov_im_rm)
+        {
+            dst[len++] = modrm;
+            len += put_u16(dst + len, in.disp, in.disp_sz);
+            len += put_u16(dst + len, in.im, in.im_sz);
+        }
+        else if (def.decode == DATA::get_mov_m_ac || def.decode == DATA::get_call)
+        {
+            len += put_u16(dst + len, in.disp, 2);
+        }
+        else if (def.decode == DATA::get_jump)
+        {
+            len += put_u16(dst + len, in.disp, 1);
+        }
+        else
+        {
+            // mov im_r, im_ac, ret im, one byte, stack and string instructions
+            len += put_u16(dst + len, in.im, in.im_sz);
+        }
+
+        return len;
+    }
+
+
+    // decodes the stream and compares every instruction with its re-encode
+    static u32 fuzz(u8* data, u32 size, u32 n_expected)
+    {
+        u32 n_mismatch = 0;
+        u32 n_decoded = 0;
+
+        u32 mods[4] = { 0 };
+        u32 disp_szs[3] = { 0 };
+        u32 n_jumps = 0;
+        u32 n_calls = 0;
+        u32 n_rep = 0;
+
+        u8 bytes[16] = { 0 };
+
+        u32 offset = 0;
+        while (offset < size)
+        {
+            auto op = decode_next(data, (int)offset);
+            if (!op.exec)
+            {
+                printf("unknown opcode at %u: 0x%02x\n", offset, data[offset]);
+                ++n_mismatch;
+                break;
+            }
+
+            auto& in = op.in;
+            auto len = encode(in, bytes);
+
+            if (len != in.length || std::memcmp(bytes, data + offset, len) != 0)
+            {
+                if (n_mismatch < 8)
+                {
+                    printf("mismatch at %u: length %u, re-encoded %u\n", offset, (u32)in.length, len);
+                }
+
+                ++n_mismatch;
+            }
+
+            auto& def = OP::OP_TABLE.byte1[in.opcode];
+            if (def.by_reg || def.decode == DATA::get_rm_r || def.decode == DATA::get_mov_sr || def.decode == DATA::get_mov_im_rm)
+            {
+                ++mods[in.mod_b2];
+                ++disp_szs[in.disp_sz];
+            }
+
+            n_jumps += op.form == OP::Form::jnz;
+            n_calls += op.form == OP::Form::call || op.form == OP::Form::ret;
+            n_rep += in.rep_b2 != 0;
+
+            offset += in.length;
+            ++n_decoded;
+        }
+
+        n_mismatch += n_decoded != n_expected;
+
+        printf("mod 00/01/10/11: %u/%u/%u/%u\n", mods[0], mods[1], mods[2], mods[3]);
+        printf("disp 0/8/16: %u/%u/%u\n", disp_szs[0], disp_szs[1], disp_szs[2]);
+        printf("jnz: %u, call/ret: %u, rep: %u\n", n_jumps, n_calls, n_rep);
+        printf("re-encode mismatches: %u\n", n_mismatch);
+
+        return n_mismatch;
+    }
+
+
+    // decode only, the sum keeps the loop from being optimized away
+    static u64 decode_all(u8* data, u32 size, u32& n_decoded)
+    {
+        u64 sum = 0;
+        n_decoded = 0;
+
+        u32 offset = 0;
+        while (offset < size)
+        {
+            auto op = decode_next(data, (int)offset);
+            if (!op.exec)
+            {
+                break;
+            }
+
+            sum += (u64)op.form + op.in.disp + op.in.im;
+            offset += op.in.length;
+            ++n_decoded;
+        }
+
+        return sum;
+    }
+
+
+    static bool run(u32 n_mb, u64 seed)
+    {
+        u64 size = (u64)n_mb * MB;
+        if (!size || size > 0x7FFF'0000)
+        {
+            return false;
+        }
+
+        auto data = (u8*)std::malloc(size + MAX_LENGTH);
+        if (!data)
+        {
+            assert(false);
+            return false;
+        }
+
+        Rng rng{};
+        rng.state = seed ? seed : 1;
+
+        auto n_instructions = generate(rng, data, (u32)size);
+        std::memset(data + size, 0, MAX_LENGTH);
+
+        printf("bench: %u MB, %u instructions, seed %llu\n", n_mb, n_instructions, (unsigned long long)seed);
+
+        auto n_mismatch = fuzz(data, (u32)size, n_instructions);
+
+        u64 best_cycles = ~0ull;
+        f64 best_sec = 0.0;
+        u64 sum = 0;
+        u32 n_decoded = 0;
+
+        for (int pass = 0; pass < N_PASSES; ++pass)
+        {
+            auto start = std::chrono::steady_clock::now();
+            auto tsc_start = __rdtsc();
+
+            sum += decode_all(data, (u32)size, n_decoded);
+
+            auto tsc_end = __rdtsc();
+            auto end = std::chrono::steady_clock::now();
+
+            auto cycles = tsc_end - tsc_start;
+            if (cycles < best_cycles)
+            {
+                best_cycles = cycles;
+                best_sec = std::chrono::duration<f64>(end - start).count();
+            }
+        }
+
+        printf("\nbest of %d passes, checksum %llu\n", N_PASSES, (unsigned long long)sum);
+        printf("cycles: %llu\n", (unsigned long long)best_cycles);
+        printf("cycles/instruction: %.2f\n", n_decoded ? (f64)best_cycles / n_decoded : 0.0);
+        printf("seconds: %f\n", best_sec);
+        printf("MB/s: %.1f\n", best_sec > 0.0 ? size / (best_sec * MB) : 0.0);
+        printf("instructions/s: %.0f\n", best_sec > 0.0 ? n_decoded / best_sec : 0.0);
+
+        std::free(data);
+
+        return !n_mismatch && n_decoded == n_instructions;
+    }
+}
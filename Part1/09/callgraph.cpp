@@ -0,0 +1,449 @@
+namespace CALLGRAPH
+{
+    using F = OP::Form;
+    using R = REG::Reg;
+
+
+    // calls followed, deeper calls are charged to the deepest frame
+    constexpr u32 MAX_DEPTH = 256;
+
+    constexpr u32 MIN_NODES = 256;
+
+    // rows printed in the function table
+    constexpr u32 MAX_FUNC_ROWS = 20;
+
+
+    // a function is named by the ip it is called at, the program entry is 0
+    class Func
+    {
+    public:
+        u16 entry = 0;
+        u64 calls = 0;
+
+        u64 incl_clocks = 0;
+        u64 excl_clocks = 0;
+
+        u64 incl_instrs = 0;
+        u64 excl_instrs = 0;
+    };
+
+
+    // a function in one calling context, the parent is its caller
+    class Node
+    {
+    public:
+        int func = -1;
+        int parent = -1;
+        int first_child = -1;
+        int next_sibling = -1;
+
+        u64 calls = 0;
+
+        // exclusive, children are summed by summarize()
+        u64 clocks = 0;
+        u64 instrs = 0;
+    };
+
+
+    // shadow of a call on the guest stack
+    class Frame
+    {
+    public:
+        int caller = -1;
+
+        // where the return address is
+        u16 sp = 0;
+    };
+
+
+    class CallGraph
+    {
+    public:
+        // by first call, funcs[0] is the program entry
+        Func* funcs = nullptr;
+        u32 n_funcs = 0;
+
+        // function entered at an ip, -1 elsewhere
+        int* func_of = nullptr;
+        u32 size = 0;
+
+        // parents come before their children, nodes[0] is the entry
+        Node* nodes = nullptr;
+        u32 n_nodes = 0;
+        u32 capacity = 0;
+
+        Frame frames[MAX_DEPTH];
+        u32 depth = 0;
+        u32 max_depth = 0;
+
+        // node the next instruction is charged to
+        int current = 0;
+
+        u64 total_clocks = 0;
+        u64 total_instrs = 0;
+    };
+
+
+    static void destroy(CallGraph& cg)
+    {
+        std::free(cg.funcs);
+        std::free(cg.func_of);
+        std::free(cg.nodes);
+
+        cg.funcs = nullptr;
+        cg.func_of = nullptr;
+        cg.nodes = nullptr;
+        cg.n_funcs = 0;
+        cg.n_nodes = 0;
+        cg.capacity = 0;
+        cg.size = 0;
+    }
+
+
+    static int get_func(CallGraph& cg, int entry)
+    {
+        auto& f = cg.func_of[entry];
+        if (f < 0)
+        {
+            f = (int)cg.n_funcs++;
+            cg.funcs[f].entry = (u16)entry;
+        }
+
+        return f;
+    }
+
+
+    static int add_node(CallGraph& cg, int parent, int func)
+    {
+        if (cg.n_nodes == cg.capacity)
+        {
+            auto capacity = cg.capacity ? 2 * cg.capacity : MIN_NODES;
+            auto nodes = (Node*)std::realloc(cg.nodes, sizeof(Node) * capacity);
+            if (!nodes)
+            {
+                assert(false);
+                return -1;
+            }
+
+            cg.nodes = nodes;
+            cg.capacity = capacity;
+        }
+
+        auto id = (int)cg.n_nodes++;
+
+        auto& node = cg.nodes[id];
+        node = Node{};
+        node.func = func;
+        node.parent = parent;
+
+        if (parent >= 0)
+        {
+            node.next_sibling = cg.nodes[parent].first_child;
+            cg.nodes[parent].first_child = id;
+        }
+
+        return id;
+    }
+
+
+    // the callee under the caller, created on the first call
+    static int get_child(CallGraph& cg, int parent, int func)
+    {
+        for (auto c = cg.nodes[parent].first_child; c >= 0; c = cg.nodes[c].next_sibling)
+        {
+            if (cg.nodes[c].func == func)
+            {
+                return c;
+            }
+        }
+
+        return add_node(cg, parent, func);
+    }
+
+
+    static bool create(CallGraph& cg, u32 size)
+    {
+        assert(!cg.funcs);
+        assert(size);
+
+        // at most one function per ip
+        cg.funcs = (Func*)std::calloc(size, sizeof(Func));
+        cg.func_of = (int*)std::malloc(sizeof(int) * size);
+        if (!cg.funcs || !cg.func_of)
+        {
+            assert(false);
+            destroy(cg);
+            return false;
+        }
+
+        cg.size = size;
+        for (u32 i = 0; i < size; ++i)
+        {
+            cg.func_of[i] = -1;
+        }
+
+        auto root = add_node(cg, -1, get_func(cg, 0));
+        if (root < 0)
+        {
+            destroy(cg);
+            return false;
+        }
+
+        cg.nodes[root].calls = 1;
+        cg.funcs[0].calls = 1;
+        cg.current = root;
+
+        return true;
+    }
+
+
+    // after a call, ip is the callee and sp holds the return address
+    static void enter(CallGraph& cg, CpuState const& cpu)
+    {
+        auto ip = REG::ip(cpu);
+        if (ip >= (int)cg.size || cg.depth == MAX_DEPTH)
+        {
+            return;
+        }
+
+        auto func = get_func(cg, ip);
+        auto node = get_child(cg, cg.current, func);
+        if (node < 0)
+        {
+            return;
+        }
+
+        auto& frame = cg.frames[cg.depth++];
+        frame.caller = cg.current;
+        frame.sp = (u16)REG::get_value(cpu, R::sp);
+
+        cg.max_depth = std::max(cg.max_depth, cg.depth);
+
+        ++cg.nodes[node].calls;
+        ++cg.funcs[func].calls;
+        cg.current = node;
+    }
+
+
+    // after a ret, frames whose return address was released are gone
+    // a ret to a pushed address inside the function is a jump and leaves the frames
+    static void leave(CallGraph& cg, CpuState const& cpu)
+    {
+        auto sp = (u16)REG::get_value(cpu, R::sp);
+
+        // sp wraps at 64k
+        while (cg.depth && (i16)(sp - cg.frames[cg.depth - 1].sp) > 0)
+        {
+            cg.current = cg.frames[--cg.depth].caller;
+        }
+    }
+
+
+    static bool run(CpuState& cpu, u8* data, u32 size, CallGraph& cg)
+    {
+        CACHE::OpCache cache{};
+        if (!CACHE::create(cache, size))
+        {
+            assert(false);
+            return false;
+        }
+
+        int offset = 0;
+        while (offset >= 0 && offset < size)
+        {
+            auto& op = CACHE::get_op(cache, data, offset);
+            if (!op.exec)
+            {
+                break;
+            }
+
+            auto est = CLOCKS::estimate(cpu, op);
+
+            OP::execute(cpu, op);
+
+            CLOCKS::complete(est, cpu, op, offset);
+
+            // call and ret are charged to the caller and the callee
+            auto clocks = est.total();
+            auto& node = cg.nodes[cg.current];
+            node.clocks += clocks;
+            ++node.instrs;
+
+            cg.total_clocks += clocks;
+            ++cg.total_instrs;
+
+            if (op.form == F::call)
+            {
+                enter(cg, cpu);
+            }
+            else if (op.form == F::ret)
+            {
+                leave(cg, cpu);
+            }
+
+            REG::print_trace(cpu);
+
+            offset = REG::ip(cpu);
+        }
+
+        CACHE::destroy(cache);
+
+        return true;
+    }
+
+
+    static bool is_recursive(CallGraph const& cg, int node)
+    {
+        auto func = cg.nodes[node].func;
+        for (auto p = cg.nodes[node].parent; p >= 0; p = cg.nodes[p].parent)
+        {
+            if (cg.nodes[p].func == func)
+            {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+
+    // sums the nodes into their functions
+    // a recursive call is already inside its outermost call and adds no inclusive time
+    static bool summarize(CallGraph& cg)
+    {
+        auto clocks = (u64*)std::malloc(sizeof(u64) * cg.n_nodes);
+        auto instrs = (u64*)std::malloc(sizeof(u64) * cg.n_nodes);
+        if (!clocks || !instrs)
+        {
+            assert(false);
+            std::free(clocks);
+            std::free(instrs);
+            return false;
+        }
+
+        for (u32 i = 0; i < cg.n_nodes; ++i)
+        {
+            clocks[i] = cg.nodes[i].clocks;
+            instrs[i] = cg.nodes[i].instrs;
+        }
+
+        // children after parents
+        for (u32 i = cg.n_nodes - 1; i > 0; --i)
+        {
+            auto p = cg.nodes[i].parent;
+            clocks[p] += clocks[i];
+            instrs[p] += instrs[i];
+        }
+
+        for (u32 i = 0; i < cg.n_nodes; ++i)
+        {
+            auto& node = cg.nodes[i];
+            auto& func = cg.funcs[node.func];
+
+            func.excl_clocks += node.clocks;
+            func.excl_instrs += node.instrs;
+
+            if (!is_recursive(cg, (int)i))
+            {
+                func.incl_clocks += clocks[i];
+                func.incl_instrs += instrs[i];
+            }
+        }
+
+        std::free(clocks);
+        std::free(instrs);
+
+        return true;
+    }
+
+
+    static void print(CallGraph const& cg)
+    {
+        auto ids = (u32*)std::malloc(sizeof(u32) * cg.n_funcs);
+        auto keys = (u64*)std::malloc(sizeof(u64) * cg.n_funcs);
+        if (!ids || !keys)
+        {
+            assert(false);
+            std::free(ids);
+            std::free(keys);
+            return;
+        }
+
+        for (u32 i = 0; i < cg.n_funcs; ++i)
+        {
+            ids[i] = i;
+            keys[i] = cg.funcs[i].incl_clocks;
+        }
+
+        PROFILE::sort_desc(ids, cg.n_funcs, keys);
+
+        auto const pct = [&](u64 clocks) { return cg.total_clocks ? 100.0 * clocks / cg.total_clocks : 0.0; };
+
+        printf("\nFunctions by inclusive clocks:\n");
+        printf("  function    calls  incl clocks       %%  excl clocks       %%  incl instrs  excl instrs\n");
+
+        for (u32 i = 0; i < cg.n_funcs && i < MAX_FUNC_ROWS; ++i)
+        {
+            auto& f = cg.funcs[ids[i]];
+
+            printf("  sub_%04x %8llu %12llu %6.2f%% %12llu %6.2f%% %12llu %12llu\n",
+                f.entry, (unsigned long long)f.calls,
+                (unsigned long long)f.incl_clocks, pct(f.incl_clocks),
+                (unsigned long long)f.excl_clocks, pct(f.excl_clocks),
+                (unsigned long long)f.incl_instrs, (unsigned long long)f.excl_instrs);
+        }
+
+        if (cg.n_funcs > MAX_FUNC_ROWS)
+        {
+            printf("  ... %u more functions\n", cg.n_funcs - MAX_FUNC_ROWS);
+        }
+
+        printf("\nContexts: %u, max depth: %u\n", cg.n_nodes, cg.max_depth);
+        printf("Instructions: %llu\n", (unsigned long long)cg.total_instrs);
+        printf("Total clocks: %llu\n", (unsigned long long)cg.total_clocks);
+
+        std::free(ids);
+        std::free(keys);
+    }
+
+
+    // one line per calling context, "sub_0000;sub_0010 clocks", for flamegraph.pl
+    static bool write_folded(CallGraph const& cg, cstr out_file)
+    {
+        std::ofstream out(out_file);
+        if (!out.is_open())
+        {
+            return false;
+        }
+
+        // a context is at most the entry and MAX_DEPTH calls
+        int path[MAX_DEPTH + 1];
+        char name[16];
+
+        for (u32 i = 0; i < cg.n_nodes; ++i)
+        {
+            if (!cg.nodes[i].clocks)
+            {
+                continue;
+            }
+
+            u32 n = 0;
+            for (auto p = (int)i; p >= 0; p = cg.nodes[p].parent)
+            {
+                path[n++] = p;
+            }
+
+            while (n--)
+            {
+                snprintf(name, sizeof(name), "sub_%04x", cg.funcs[cg.nodes[path[n]].func].entry);
+                out << name << (n ? ";" : " ");
+            }
+
+            out << cg.nodes[i].clocks << "\n";
+        }
+
+        out.close();
+
+        return true;
+    }
+}
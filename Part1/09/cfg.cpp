@@ -0,0 +1,839 @@
+namespace CFG
+{
+    using F = OP::Form;
+
+
+    constexpr u32 MAGIC = 0x38474643; // "CFG8"
+
+    // rows printed in the loop table
+    constexpr u32 MAX_LOOP_ROWS = 10;
+
+
+    // straight line code [begin, end), entered only at begin
+    class Block
+    {
+    public:
+        u16 begin = 0;
+        u16 end = 0;
+        u16 n_ops = 0;
+
+        bool is_header = false;
+
+        // ends in a call, succ[1] is the callee
+        bool is_call = false;
+
+        // fall through and taken jump, -1 leaves the program
+        int succ[2] = { -1, -1 };
+
+        // immediate dominator, the entry is its own
+        int idom = -1;
+
+        // CLOCKS::estimate of one pass, jumps as not taken
+        u32 clocks = 0;
+
+        // times entered, see count_blocks()
+        u64 count = 0;
+    };
+
+
+    // natural loop, its blocks are loop_blocks[first, first + n_blocks)
+    class Loop
+    {
+    public:
+        int header = -1;
+        u32 first = 0;
+        u32 n_blocks = 0;
+
+        u64 clocks = 0;
+    };
+
+
+    class Graph
+    {
+    public:
+        Block* blocks = nullptr;
+        u32 n_blocks = 0;
+
+        // block starting at an ip, -1 elsewhere
+        int* block_of = nullptr;
+        u32 size = 0;
+
+        // predecessors of block b are preds[pred_first[b], pred_first[b + 1])
+        int* preds = nullptr;
+        u32* pred_first = nullptr;
+
+        Loop* loops = nullptr;
+        u32 n_loops = 0;
+
+        int* loop_blocks = nullptr;
+        u32 n_loop_blocks = 0;
+    };
+
+
+    static void destroy(Graph& g)
+    {
+        std::free(g.blocks);
+        std::free(g.block_of);
+        std::free(g.preds);
+        std::free(g.pred_first);
+        std::free(g.loops);
+        std::free(g.loop_blocks);
+
+        g = Graph{};
+    }
+
+
+    // calls are edges to the callee and to the return address
+    static bool is_branch(OP::Op const& op)
+    {
+        return op.form == F::jnz || op.form == F::call;
+    }
+
+
+    // walks from entry with RECOMP::find_blocks and cuts the program at its leaders
+    static bool find_blocks(Graph& g, CACHE::OpCache& cache, u8* data, u32 size)
+    {
+        auto sites = (RECOMP::Site*)std::calloc(size, sizeof(RECOMP::Site));
+        auto fall_in = (u8*)std::calloc(size, 1);
+        g.block_of = (int*)std::malloc(sizeof(int) * size);
+
+        if (!sites || !fall_in || !g.block_of || !RECOMP::find_blocks(cache, data, size, sites))
+        {
+            assert(false);
+            std::free(sites);
+            std::free(fall_in);
+            return false;
+        }
+
+        // two instruction streams that fall into the same ip join there
+        for (u32 offset = 0; offset < size; ++offset)
+        {
+            auto next = offset + CACHE::get_op(cache, data, offset).in.length;
+            if (sites[offset].is_instr && next < size && fall_in[next] < 2)
+            {
+                ++fall_in[next];
+            }
+        }
+
+        u32 n_leaders = 0;
+        for (u32 offset = 0; offset < size; ++offset)
+        {
+            auto& site = sites[offset];
+            site.is_leader = site.is_instr && (site.is_leader || fall_in[offset] > 1);
+
+            n_leaders += site.is_leader;
+        }
+
+        g.size = size;
+        g.blocks = (Block*)std::calloc(n_leaders, sizeof(Block));
+        if (!g.blocks)
+        {
+            assert(false);
+            std::free(sites);
+            std::free(fall_in);
+            return false;
+        }
+
+        for (u32 offset = 0; offset < size; ++offset)
+        {
+            g.block_of[offset] = -1;
+
+            if (sites[offset].is_leader)
+            {
+                g.block_of[offset] = (int)g.n_blocks;
+
+                auto& block = g.blocks[g.n_blocks++];
+                block = Block{};
+                block.begin = (u16)offset;
+            }
+        }
+
+        auto const get_block = [&](int ip)
+        {
+            return ip >= 0 && ip < (int)size ? g.block_of[ip] : -1;
+        };
+
+        // clocks do not depend on the machine without odd address penalties
+        CpuState* cpu = nullptr;
+        if (!REG::create(cpu))
+        {
+            std::free(sites);
+            std::free(fall_in);
+            return false;
+        }
+
+        for (u32 b = 0; b < g.n_blocks; ++b)
+        {
+            auto& block = g.blocks[b];
+
+            int offset = block.begin;
+            while (true)
+            {
+                auto& op = CACHE::get_op(cache, data, offset);
+                auto next = offset + (int)op.in.length;
+
+                ++block.n_ops;
+
+                auto est = CLOCKS::estimate(*cpu, op);
+                block.clocks += est.base + est.ea;
+
+                offset = next;
+
+                if (is_branch(op))
+                {
+                    block.succ[0] = get_block(next);
+                    block.succ[1] = get_block(next - (int)op.in.length + CMD::get_jump(op.in).j_offset);
+                    block.is_call = op.form == F::call;
+                    break;
+                }
+
+                // successors are the return addresses of the callers
+                if (op.form == F::ret)
+                {
+                    break;
+                }
+
+                if (next >= (int)size || !sites[next].is_instr || sites[next].is_leader)
+                {
+                    block.succ[0] = get_block(next);
+                    break;
+                }
+            }
+
+            block.end = (u16)offset;
+        }
+
+        REG::destroy(cpu);
+        std::free(sites);
+        std::free(fall_in);
+
+        return true;
+    }
+
+
+    static bool find_preds(Graph& g)
+    {
+        auto n = g.n_blocks;
+
+        g.pred_first = (u32*)std::calloc(n + 1, sizeof(u32));
+        g.preds = (int*)std::malloc(sizeof(int) * (2 * n + 1));
+        if (!g.pred_first || !g.preds)
+        {
+            assert(false);
+            return false;
+        }
+
+        // counts at s + 1, prefix sums, then each list is filled from its end
+        for (u32 b = 0; b < n; ++b)
+        {
+            for (auto s : g.blocks[b].succ)
+            {
+                if (s >= 0)
+                {
+                    ++g.pred_first[s + 1];
+                }
+            }
+        }
+
+        for (u32 b = 0; b < n; ++b)
+        {
+            g.pred_first[b + 1] += g.pred_first[b];
+        }
+
+        auto total = g.pred_first[n];
+
+        for (u32 b = n; b-- > 0;)
+        {
+            for (auto s : g.blocks[b].succ)
+            {
+                if (s >= 0)
+                {
+                    g.preds[--g.pred_first[s + 1]] = (int)b;
+                }
+            }
+        }
+
+        // pred_first[s + 1] is now the start of the list of s
+        for (u32 b = 0; b < n; ++b)
+        {
+            g.pred_first[b] = g.pred_first[b + 1];
+        }
+
+        g.pred_first[n] = total;
+
+        return true;
+    }
+
+
+    // postorder from the entry, blocks that cannot be reached are left out
+    static u32 get_postorder(Graph const& g, int* order)
+    {
+        auto n = g.n_blocks;
+
+        auto stack = (int*)std::malloc(sizeof(int) * n);
+        auto next_succ = (u8*)std::calloc(n, 1);
+        if (!stack || !next_succ)
+        {
+            assert(false);
+            std::free(stack);
+            std::free(next_succ);
+            return 0;
+        }
+
+        u32 n_order = 0;
+        int top = 0;
+
+        stack[top++] = 0;
+        next_succ[0] = 1;
+
+        while (top > 0)
+        {
+            auto b = stack[top - 1];
+            auto& i = next_succ[b];
+
+            // next_succ is 1 + the successor to visit
+            if (i <= 2)
+            {
+                auto s = g.blocks[b].succ[i - 1];
+                ++i;
+
+                if (s >= 0 && !next_succ[s])
+                {
+                    next_succ[s] = 1;
+                    stack[top++] = s;
+                }
+
+                continue;
+            }
+
+            order[n_order++] = b;
+            --top;
+        }
+
+        std::free(stack);
+        std::free(next_succ);
+
+        return n_order;
+    }
+
+
+    // Cooper, Harvey, Kennedy: iterate idom to a fixed point in reverse postorder
+    static bool find_dominators(Graph& g)
+    {
+        auto n = g.n_blocks;
+
+        auto order = (int*)std::malloc(sizeof(int) * n);
+        auto rank = (int*)std::malloc(sizeof(int) * n);
+        if (!order || !rank)
+        {
+            assert(false);
+            std::free(order);
+            std::free(rank);
+            return false;
+        }
+
+        auto n_order = get_postorder(g, order);
+
+        for (u32 i = 0; i < n_order; ++i)
+        {
+            rank[order[i]] = (int)i;
+        }
+
+        auto const intersect = [&](int a, int b)
+        {
+            while (a != b)
+            {
+                while (rank[a] < rank[b]) { a = g.blocks[a].idom; }
+                while (rank[b] < rank[a]) { b = g.blocks[b].idom; }
+            }
+
+            return a;
+        };
+
+        g.blocks[0].idom = 0;
+
+        bool changed = n_order > 0;
+        while (changed)
+        {
+            changed = false;
+
+            for (u32 i = n_order - 1; i-- > 0;)
+            {
+                auto b = order[i];
+
+                int idom = -1;
+                for (auto p = g.pred_first[b]; p < g.pred_first[b + 1]; ++p)
+                {
+                    auto pred = g.preds[p];
+                    if (g.blocks[pred].idom < 0)
+                    {
+                        continue;
+                    }
+
+                    idom = idom < 0 ? pred : intersect(pred, idom);
+                }
+
+                if (g.blocks[b].idom != idom)
+                {
+                    g.blocks[b].idom = idom;
+                    changed = true;
+                }
+            }
+        }
+
+        std::free(order);
+        std::free(rank);
+
+        return true;
+    }
+
+
+    static bool dominates(Graph const& g, int a, int b)
+    {
+        while (b != a && b != 0 && b >= 0)
+        {
+            b = g.blocks[b].idom;
+        }
+
+        return b == a;
+    }
+
+
+    // blocks of the natural loop of header h, the ones that reach a back edge without passing h
+    static u32 get_loop_body(Graph const& g, int h, int* stack, u8* in_loop, int* body)
+    {
+        u32 n_body = 0;
+        int top = 0;
+
+        in_loop[h] = 1;
+        body[n_body++] = h;
+
+        auto const add = [&](int b)
+        {
+            if (!in_loop[b])
+            {
+                in_loop[b] = 1;
+                body[n_body++] = b;
+                stack[top++] = b;
+            }
+        };
+
+        for (auto p = g.pred_first[h]; p < g.pred_first[h + 1]; ++p)
+        {
+            auto pred = g.preds[p];
+            if (dominates(g, h, pred))
+            {
+                add(pred);
+            }
+        }
+
+        while (top > 0)
+        {
+            auto b = stack[--top];
+            for (auto p = g.pred_first[b]; p < g.pred_first[b + 1]; ++p)
+            {
+                add(g.preds[p]);
+            }
+        }
+
+        // clear only what was set
+        for (u32 i = 0; i < n_body; ++i)
+        {
+            in_loop[body[i]] = 0;
+        }
+
+        return n_body;
+    }
+
+
+    static bool find_loops(Graph& g)
+    {
+        auto n = g.n_blocks;
+
+        for (u32 b = 0; b < n; ++b)
+        {
+            // the target of a back edge
+            auto& block = g.blocks[b];
+            for (auto p = g.pred_first[b]; p < g.pred_first[b + 1] && block.idom >= 0; ++p)
+            {
+                block.is_header |= dominates(g, (int)b, g.preds[p]);
+            }
+
+            g.n_loops += block.is_header;
+        }
+
+        auto stack = (int*)std::malloc(sizeof(int) * n);
+        auto in_loop = (u8*)std::calloc(n, 1);
+        auto body = (int*)std::malloc(sizeof(int) * n);
+        g.loops = (Loop*)std::calloc(g.n_loops + 1, sizeof(Loop));
+        if (!stack || !in_loop || !body || !g.loops)
+        {
+            assert(false);
+            std::free(stack);
+            std::free(in_loop);
+            std::free(body);
+            return false;
+        }
+
+        // sizes first, nested loops share blocks
+        u32 n_loop = 0;
+        for (u32 b = 0; b < n; ++b)
+        {
+            if (!g.blocks[b].is_header)
+            {
+                continue;
+            }
+
+            auto& loop = g.loops[n_loop++];
+            loop.header = (int)b;
+            loop.first = g.n_loop_blocks;
+            loop.n_blocks = get_loop_body(g, (int)b, stack, in_loop, body);
+
+            g.n_loop_blocks += loop.n_blocks;
+        }
+
+        g.loop_blocks = (int*)std::malloc(sizeof(int) * (g.n_loop_blocks + 1));
+        if (!g.loop_blocks)
+        {
+            assert(false);
+            std::free(stack);
+            std::free(in_loop);
+            std::free(body);
+            return false;
+        }
+
+        for (u32 i = 0; i < g.n_loops; ++i)
+        {
+            auto& loop = g.loops[i];
+            get_loop_body(g, loop.header, stack, in_loop, g.loop_blocks + loop.first);
+        }
+
+        std::free(stack);
+        std::free(in_loop);
+        std::free(body);
+
+        return true;
+    }
+
+
+    static bool create(Graph& g, CACHE::OpCache& cache, u8* data, u32 size)
+    {
+        assert(!g.blocks);
+
+        auto result =
+            find_blocks(g, cache, data, size) &&
+            find_preds(g) &&
+            find_dominators(g) &&
+            find_loops(g);
+
+        if (!result)
+        {
+            destroy(g);
+        }
+
+        return result;
+    }
+
+
+    // runs a block at a time, ops are only looked up at block starts
+    static void count_blocks(CpuState& cpu, Graph& g, CACHE::OpCache& cache, u8* data)
+    {
+        int offset = 0;
+        while (offset >= 0 && offset < (int)g.size)
+        {
+            auto b = g.block_of[offset];
+
+            // the walk did not see this ip, e.g. it ended on bytes that do not decode
+            if (b < 0)
+            {
+                break;
+            }
+
+            auto& block = g.blocks[b];
+            ++block.count;
+
+            for (u32 i = 0; i < block.n_ops; ++i)
+            {
+                OP::execute(cpu, CACHE::get_op(cache, data, offset));
+                REG::print_trace(cpu);
+
+                offset = REG::ip(cpu);
+            }
+        }
+
+        for (u32 i = 0; i < g.n_loops; ++i)
+        {
+            auto& loop = g.loops[i];
+
+            loop.clocks = 0;
+            for (u32 j = 0; j < loop.n_blocks; ++j)
+            {
+                auto& block = g.blocks[g.loop_blocks[loop.first + j]];
+                loop.clocks += block.count * block.clocks;
+            }
+        }
+    }
+}
+
+
+/* reports */
+
+namespace CFG
+{
+    static void print(Graph const& g)
+    {
+        printf("blocks: %u\n", g.n_blocks);
+        printf("     block        ip  ops  clocks      count  idom  succ        preds\n");
+
+        for (u32 b = 0; b < g.n_blocks; ++b)
+        {
+            auto& block = g.blocks[b];
+
+            printf("  %c %5u  0x%04x %4u %7u %10llu %5d  %5d %5d ", block.is_header ? '*' : ' ', b, block.begin, block.n_ops, block.clocks, (unsigned long long)block.count, block.idom, block.succ[0], block.succ[1]);
+
+            for (auto p = g.pred_first[b]; p < g.pred_first[b + 1]; ++p)
+            {
+                printf(" %d", g.preds[p]);
+            }
+
+            printf("\n");
+        }
+
+        auto ids = (u32*)std::malloc(sizeof(u32) * (g.n_loops + 1));
+        auto clocks = (u64*)std::malloc(sizeof(u64) * (g.n_loops + 1));
+        if (!ids || !clocks)
+        {
+            assert(false);
+            std::free(ids);
+            std::free(clocks);
+            return;
+        }
+
+        u64 total = 0;
+        for (u32 b = 0; b < g.n_blocks; ++b)
+        {
+            total += g.blocks[b].count * g.blocks[b].clocks;
+        }
+
+        for (u32 i = 0; i < g.n_loops; ++i)
+        {
+            ids[i] = i;
+            clocks[i] = g.loops[i].clocks;
+        }
+
+        PROFILE::sort_desc(ids, g.n_loops, clocks);
+
+        printf("\nLoops by clocks:\n");
+        printf("   header        ip  blocks      iters     clocks       %%\n");
+
+        for (u32 i = 0; i < g.n_loops && i < MAX_LOOP_ROWS; ++i)
+        {
+            auto& loop = g.loops[ids[i]];
+            auto& header = g.blocks[loop.header];
+            auto pct = total ? 100.0 * loop.clocks / total : 0.0;
+
+            printf("  %7d  0x%04x %7u %10llu %10llu %6.2f%%\n", loop.header, header.begin, loop.n_blocks, (unsigned long long)header.count, (unsigned long long)loop.clocks, pct);
+        }
+
+        printf("\nEstimated clocks: %llu\n", (unsigned long long)total);
+
+        std::free(ids);
+        std::free(clocks);
+    }
+
+
+    static bool write_dot(Graph const& g, cstr out_file)
+    {
+        std::ofstream out(out_file, std::ios::out);
+        if (!out.is_open())
+        {
+            return false;
+        }
+
+        out << "digraph cfg {\n"
+            << "    node [shape=box fontname=\"monospace\"];\n";
+
+        char label[64];
+
+        for (u32 b = 0; b < g.n_blocks; ++b)
+        {
+            auto& block = g.blocks[b];
+            snprintf(label, sizeof(label), "0x%04x-0x%04x\\n%u ops, %u clocks", block.begin, block.end, block.n_ops, block.clocks);
+
+            out << "    b" << b << " [label=\"" << label;
+            if (block.count)
+            {
+                out << "\\nx" << block.count;
+            }
+
+            out << "\"" << (block.is_header ? " peripheries=2" : "") << "];\n";
+        }
+
+        for (u32 b = 0; b < g.n_blocks; ++b)
+        {
+            auto& block = g.blocks[b];
+            for (int i = 0; i < 2; ++i)
+            {
+                auto s = block.succ[i];
+                if (s < 0)
+                {
+                    continue;
+                }
+
+                out << "    b" << b << " -> b" << s;
+
+                // back edges dashed, taken jumps and calls labelled
+                auto name = block.is_call ? "call" : "jnz";
+                if (dominates(g, s, (int)b))
+                {
+                    out << " [style=dashed";
+                    if (i)
+                    {
+                        out << " label=\"" << name << "\"";
+                    }
+
+                    out << "]";
+                }
+                else if (i)
+                {
+                    out << " [label=\"" << name << "\"]";
+                }
+
+                out << ";\n";
+            }
+        }
+
+        out << "}\n";
+        out.close();
+
+        return true;
+    }
+
+
+    // MAGIC, n_blocks, n_loops, n_loop_blocks
+    // then TableBlock by block, TableLoop by loop and loop_blocks as i32
+    class TableBlock
+    {
+    public:
+        u16 begin = 0;
+        u16 end = 0;
+        u16 n_ops = 0;
+        u16 is_header = 0;
+
+        i32 succ[2] = { -1, -1 };
+        i32 idom = -1;
+        u32 clocks = 0;
+
+        u64 count = 0;
+    };
+
+    static_assert(sizeof(TableBlock) == 32);
+
+
+    class TableLoop
+    {
+    public:
+        i32 header = -1;
+        u32 first = 0;
+        u32 n_blocks = 0;
+        u32 pad = 0;
+
+        u64 clocks = 0;
+    };
+
+    static_assert(sizeof(TableLoop) == 24);
+
+
+    static bool write_table(Graph const& g, cstr out_file)
+    {
+        std::ofstream out(out_file, std::ios::out | std::ios::binary);
+        if (!out.is_open())
+        {
+            return false;
+        }
+
+        u32 header[] = { MAGIC, g.n_blocks, g.n_loops, g.n_loop_blocks };
+        out.write((char*)header, sizeof(header));
+
+        for (u32 b = 0; b < g.n_blocks; ++b)
+        {
+            auto& block = g.blocks[b];
+
+            TableBlock row{};
+            row.begin = block.begin;
+            row.end = block.end;
+            row.n_ops = block.n_ops;
+            row.is_header = block.is_header;
+            row.succ[0] = block.succ[0];
+            row.succ[1] = block.succ[1];
+            row.idom = block.idom;
+            row.clocks = block.clocks;
+            row.count = block.count;
+
+            out.write((char*)&row, sizeof(row));
+        }
+
+        for (u32 i = 0; i < g.n_loops; ++i)
+        {
+            auto& loop = g.loops[i];
+
+            TableLoop row{};
+            row.header = loop.header;
+            row.first = loop.first;
+            row.n_blocks = loop.n_blocks;
+            row.clocks = loop.clocks;
+
+            out.write((char*)&row, sizeof(row));
+        }
+
+        out.write((char*)g.loop_blocks, sizeof(int) * g.n_loop_blocks);
+
+        auto result = out.good();
+        out.close();
+
+        return result;
+    }
+
+
+    // writes out_name.dot and out_name.cfg
+    static bool run(CpuState& cpu, cstr bin_file, cstr out_name)
+    {
+        auto buffer = Bytes::read(bin_file);
+        if (!buffer.data)
+        {
+            return false;
+        }
+
+        CACHE::OpCache cache{};
+        if (!CACHE::create(cache, buffer.size))
+        {
+            assert(false);
+            Bytes::destroy(buffer);
+            return false;
+        }
+
+        Graph g{};
+        auto result = create(g, cache, buffer.data, buffer.size);
+        if (result)
+        {
+            count_blocks(cpu, g, cache, buffer.data);
+            print(g);
+
+            auto dot_file = std::string(out_name) + ".dot";
+            auto table_file = std::string(out_name) + ".cfg";
+
+            result = write_dot(g, dot_file.c_str()) && write_table(g, table_file.c_str());
+            if (result)
+            {
+                printf("%s -> %s, %s\n", bin_file, dot_file.c_str(), table_file.c_str());
+            }
+
+            destroy(g);
+        }
+
+        CACHE::destroy(cache);
+        Bytes::destroy(buffer);
+
+        return result;
+    }
+}
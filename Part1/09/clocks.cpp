@@ -0,0 +1,494 @@
+namespace CLOCKS
+{
+    using MR = REG::MemReg;
+    using R = REG::Reg;
+
+
+    // memory operand of an instruction
+    // string ops access count elements from addr, downwards when down is set
+    class Access
+    {
+    public:
+        int addr = -1;
+        int size = 0;
+        u32 count = 1;
+        bool down = false;
+
+        bool read = false;
+        bool write = false;
+    };
+
+
+    // 8086 clocks for one executed instruction
+    class Estimate
+    {
+    public:
+        int base = 0;
+        int ea = 0;
+
+        // odd address word transfers
+        int penalty = 0;
+
+        Access access;
+
+        // ds:si of movs and cmps, access is es:di
+        Access src;
+
+        // cx of a repeated string op, -1 otherwise
+        int reps = -1;
+        int rep_clocks = 0;
+
+        int total() const { return base + ea + penalty; }
+    };
+
+
+    class Profile
+    {
+    public:
+        u64 total = 0;
+
+        // indexed by ip
+        u64* clocks = nullptr;
+        u32* counts = nullptr;
+        u32 size = 0;
+    };
+
+
+    static void destroy(Profile& prof)
+    {
+        if (prof.clocks)
+        {
+            std::free(prof.clocks);
+            prof.clocks = nullptr;
+        }
+
+        if (prof.counts)
+        {
+            std::free(prof.counts);
+            prof.counts = nullptr;
+        }
+    }
+
+
+    static bool create(Profile& prof, u32 size)
+    {
+        assert(!prof.clocks);
+        assert(size);
+
+        prof.clocks = (u64*)std::calloc(size, sizeof(u64));
+        prof.counts = (u32*)std::calloc(size, sizeof(u32));
+        if (!prof.clocks || !prof.counts)
+        {
+            destroy(prof);
+            return false;
+        }
+
+        prof.size = size;
+        prof.total = 0;
+
+        return true;
+    }
+
+
+    // effective address calculation
+    static int get_ea_clocks(DATA::Instr const& in)
+    {
+        if (in.mod_b2 == 0b00 && in.rm_b3 == 0b110)
+        {
+            // direct address
+            return 6;
+        }
+
+        bool disp = in.disp_sz > 0;
+
+        switch ((MR)in.rm_b3)
+        {
+        case MR::m_bx_si:
+        case MR::m_bp_di: return disp ? 11 : 7;
+
+        case MR::m_bx_di:
+        case MR::m_bp_si: return disp ? 12 : 8;
+
+        case MR::m_si:
+        case MR::m_di:
+        case MR::m_bp:
+        case MR::m_bx: return disp ? 9 : 5;
+
+        default: return 0;
+        }
+    }
+
+
+    // physical address of the memory operand
+    static int get_address(CpuState const& cpu, DATA::Instr const& in)
+    {
+        if (in.mod_b2 == 0b00 && in.rm_b3 == 0b110)
+        {
+            return REG::get_address(cpu, R::ds, in.disp);
+        }
+
+        return REG::get_address(cpu, (MR)in.rm_b3, in.disp);
+    }
+
+
+    enum class Kind : int
+    {
+        mov,
+        alu,
+        cmp,
+        other
+    };
+
+
+    // reg, reg / reg, mem / mem, reg / reg, imm / mem, imm
+    class Costs
+    {
+    public:
+        int r_r = 0;
+        int r_m = 0;
+        int m_r = 0;
+        int r_im = 0;
+        int m_im = 0;
+
+        // word transfers when the destination is memory
+        int m_transfers = 1;
+    };
+
+
+    static Costs get_costs(Kind kind)
+    {
+        switch (kind)
+        {
+        case Kind::mov: return { 2, 8, 9, 4, 10, 1 };
+        case Kind::alu: return { 3, 9, 16, 4, 17, 2 };
+        case Kind::cmp: return { 3, 9, 9, 4, 10, 1 };
+        default: return {};
+        }
+    }
+
+
+    // 0b1000'00sw selects the operation by reg
+    static Kind get_im_rm_kind(int reg_b3)
+    {
+        switch (reg_b3)
+        {
+        case 0b000:
+        case 0b101: return Kind::alu;
+        case 0b111: return Kind::cmp;
+        }
+
+        return Kind::other;
+    }
+
+
+    // charges the documented clocks of the 8086 manual, before the op runs
+    // conditional jumps are charged as not taken, see complete()
+    static Estimate estimate(CpuState const& cpu, OP::Op const& op)
+    {
+        Estimate est{};
+
+        auto& in = op.in;
+        if (!in.length)
+        {
+            return est;
+        }
+
+        int byte1 = in.opcode;
+
+        auto const is_word = in.w_b1 == 1;
+
+        auto const mem = [&](int base, int transfers, bool read, bool write)
+        {
+            auto addr = get_address(cpu, in);
+
+            est.base = base;
+            est.ea = get_ea_clocks(in);
+
+            if (is_word && (addr & 1))
+            {
+                est.penalty = 4 * transfers;
+            }
+
+            est.access.addr = addr;
+            est.access.size = is_word ? 2 : 1;
+            est.access.read = read;
+            est.access.write = write;
+        };
+
+        // memory destination: mov writes, alu reads and writes, cmp reads
+        auto const mem_dst = [&](Kind kind, int base, int transfers)
+        {
+            mem(base, transfers, kind != Kind::mov, kind != Kind::cmp);
+        };
+
+        // reg/mem with reg
+        auto const rm_r = [&](Kind kind)
+        {
+            auto costs = get_costs(kind);
+
+            if (in.mod_b2 == 0b11)
+            {
+                est.base = costs.r_r;
+            }
+            else if (in.d_b1)
+            {
+                mem(costs.r_m, 1, true, false);
+            }
+            else
+            {
+                mem_dst(kind, costs.m_r, costs.m_transfers);
+            }
+        };
+
+        // reg/mem with immediate
+        auto const im_rm = [&](Kind kind)
+        {
+            auto costs = get_costs(kind);
+
+            if (in.mod_b2 == 0b11)
+            {
+                est.base = costs.r_im;
+            }
+            else
+            {
+                mem_dst(kind, costs.m_im, costs.m_transfers);
+            }
+        };
+
+        // a word at ss:sp, pushes write below sp
+        auto const stack = [&](int base, bool push)
+        {
+            auto addr = REG::get_address(cpu, R::ss, REG::get_value(cpu, R::sp) - (push ? 2 : 0));
+
+            est.base = base;
+            if (addr & 1)
+            {
+                est.penalty = 4;
+            }
+
+            est.access.addr = addr;
+            est.access.size = 2;
+            est.access.read = !push;
+            est.access.write = push;
+        };
+
+        // a repeated op is charged for cx iterations, see complete()
+        auto const string = [&](int once, int per_rep, bool si, bool di_read, bool di_write)
+        {
+            auto s = STRING::load(cpu, in);
+
+            est.base = s.rep ? 9 + per_rep * (int)s.count : once;
+            if (s.rep)
+            {
+                est.reps = (int)s.count;
+                est.rep_clocks = per_rep;
+            }
+
+            auto const range = [&](Access& a, R seg, u16 addr, bool read, bool write)
+            {
+                a.addr = REG::get_address(cpu, seg, addr);
+                a.size = s.size;
+                a.count = s.count;
+                a.down = s.step < 0;
+                a.read = read;
+                a.write = write;
+
+                if (is_word && (addr & 1))
+                {
+                    est.penalty += 4 * (int)s.count;
+                }
+            };
+
+            auto has_di = di_read || di_write;
+            if (si)
+            {
+                range(has_di ? est.src : est.access, R::ds, s.si, true, false);
+            }
+
+            if (has_di)
+            {
+                range(est.access, R::es, s.di, di_read, di_write);
+            }
+        };
+
+        if (byte1 >= 0x88 && byte1 <= 0x8B) { rm_r(Kind::mov); }
+        else if (byte1 == 0x8C || byte1 == 0x8E) { rm_r(Kind::mov); }
+        else if (byte1 == 0xC6 || byte1 == 0xC7) { im_rm(Kind::mov); }
+        else if (byte1 >= 0xB0 && byte1 <= 0xBF) { est.base = 4; }
+        else if (byte1 >= 0xA0 && byte1 <= 0xA3)
+        {
+            // accumulator and direct address
+            est.base = 10;
+            int addr = REG::get_address(cpu, R::ds, in.disp);
+            if ((byte1 & 1) && (addr & 1))
+            {
+                est.penalty = 4;
+            }
+
+            est.access.addr = addr;
+            est.access.size = (byte1 & 1) ? 2 : 1;
+            est.access.read = byte1 <= 0xA1;
+            est.access.write = byte1 >= 0xA2;
+        }
+        else if (byte1 <= 0x03 || (byte1 >= 0x28 && byte1 <= 0x2B)) { rm_r(Kind::alu); }
+        else if (byte1 >= 0x38 && byte1 <= 0x3B) { rm_r(Kind::cmp); }
+        else if (byte1 == 0x04 || byte1 == 0x05 || byte1 == 0x2C || byte1 == 0x2D || byte1 == 0x3C || byte1 == 0x3D) { est.base = 4; }
+        else if (byte1 >= 0x80 && byte1 <= 0x83) { im_rm(get_im_rm_kind(in.reg_b3)); }
+        else if (byte1 >= 0x70 && byte1 <= 0x7F) { est.base = 4; }
+        else if (byte1 >= 0x50 && byte1 <= 0x57) { stack(11, true); }
+        else if (byte1 >= 0x58 && byte1 <= 0x5F) { stack(8, false); }
+        else if ((byte1 & 0b1110'0111) == 0b0000'0110) { stack(10, true); }
+        else if ((byte1 & 0b1110'0111) == 0b0000'0111) { stack(8, false); }
+        else if (byte1 == 0xE8) { stack(19, true); }
+        else if (byte1 == 0xC3) { stack(8, false); }
+        else if (byte1 == 0xC2) { stack(12, false); }
+        else if (byte1 == 0xA4 || byte1 == 0xA5) { string(18, 17, true, false, true); }
+        else if (byte1 == 0xA6 || byte1 == 0xA7) { string(22, 22, true, true, false); }
+        else if (byte1 == 0xAA || byte1 == 0xAB) { string(11, 10, false, false, true); }
+        else if (byte1 == 0xAC || byte1 == 0xAD) { string(12, 13, true, false, false); }
+        else if (byte1 == 0xAE || byte1 == 0xAF) { string(15, 15, false, true, false); }
+        else if (byte1 == 0xFC || byte1 == 0xFD) { est.base = 2; }
+
+        return est;
+    }
+
+
+    // adds what is known after the op ran
+    // a taken conditional jump costs 16 instead of 4, call and ret always cost the same
+    // repe and repne stop early, they are charged for the iterations that ran
+    static void complete(Estimate& est, CpuState const& cpu, OP::Op const& op, int offset)
+    {
+        auto is_jcc = op.in.opcode >= 0x70 && op.in.opcode <= 0x7F;
+
+        if (is_jcc && cpu.IP != offset + op.in.length)
+        {
+            est.base = 16;
+        }
+
+        if (est.reps > 0)
+        {
+            auto n = est.reps - REG::get_value(cpu, R::cx);
+
+            est.base = 9 + est.rep_clocks * n;
+            est.penalty = est.penalty / est.reps * n;
+            est.access.count = (u32)n;
+            if (est.src.addr >= 0)
+            {
+                est.src.count = (u32)n;
+            }
+        }
+    }
+
+
+    static void set_trace(CpuState& cpu, Estimate const& est, u64 total)
+    {
+        if constexpr (!TRACE)
+        {
+            return;
+        }
+
+        auto& str = cpu.trace_clocks;
+        auto len = snprintf(str, sizeof(str), "Clocks: +%d = %llu", est.total(), (unsigned long long)total);
+
+        if (est.ea)
+        {
+            if (est.penalty)
+            {
+                snprintf(str + len, sizeof(str) - len, " (%d + %dea + %dp)", est.base, est.ea, est.penalty);
+            }
+            else
+            {
+                snprintf(str + len, sizeof(str) - len, " (%d + %dea)", est.base, est.ea);
+            }
+        }
+    }
+
+
+    static bool run(CpuState& cpu, u8* data, u32 size, Profile& prof)
+    {
+        CACHE::OpCache cache{};
+        if (!CACHE::create(cache, size))
+        {
+            assert(false);
+            return false;
+        }
+
+        int offset = 0;
+        while (offset >= 0 && offset < size)
+        {
+            auto& op = CACHE::get_op(cache, data, offset);
+            if (!op.exec)
+            {
+                break;
+            }
+
+            auto est = estimate(cpu, op);
+
+            OP::execute(cpu, op);
+
+            complete(est, cpu, op, offset);
+
+            auto clocks = est.total();
+            prof.total += clocks;
+            prof.clocks[offset] += clocks;
+            prof.counts[offset]++;
+
+            set_trace(cpu, est, prof.total);
+            REG::print_trace(cpu);
+
+            offset = REG::ip(cpu);
+        }
+
+        CACHE::destroy(cache);
+
+        return true;
+    }
+
+
+    static void print(Profile const& prof, u8* data)
+    {
+        printf("\nTotal clocks: %llu\n", (unsigned long long)prof.total);
+
+        printf("\nClocks by ip:\n");
+        printf("      ip    count     clocks\n");
+
+        for (u32 ip = 0; ip < prof.size; ++ip)
+        {
+            if (prof.counts[ip])
+            {
+                printf("  0x%04x %8u %10llu\n", ip, prof.counts[ip], (unsigned long long)prof.clocks[ip]);
+            }
+        }
+
+        // a taken backward jump closes a loop over [target, jump]
+        bool first = true;
+
+        for (u32 ip = 0; ip < prof.size; ++ip)
+        {
+            if (!prof.counts[ip] || data[ip] < 0x70 || data[ip] > 0x7F || ip + 1 >= prof.size)
+            {
+                continue;
+            }
+
+            int target = ip + 2 + (i8)data[ip + 1];
+            if (target < 0 || target > (int)ip)
+            {
+                continue;
+            }
+
+            u64 clocks = 0;
+            for (u32 i = target; i <= ip; ++i)
+            {
+                clocks += prof.clocks[i];
+            }
+
+            if (first)
+            {
+                printf("\nClocks by loop:\n");
+                first = false;
+            }
+
+            printf("  0x%04x-0x%04x %10llu\n", target, ip, (unsigned long long)clocks);
+        }
+    }
+}
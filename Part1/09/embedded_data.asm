@@ -0,0 +1,15 @@
+; code reached by jumping over bytes that do not decode
+; assembled to embedded_data, the final registers of every engine must match
+
+bits 16
+
+mov cx, 1
+add cx, 0
+jnz code
+
+; not an 8086 instruction
+db 0x0F, 0x0F
+
+code:
+mov bx, 5
+add bx, cx
@@ -0,0 +1,464 @@
+namespace ENSEMBLE
+{
+    using Reg = REG::Reg;
+    using Alu = REG::Alu;
+    using F = OP::Form;
+
+
+    constexpr int LANES = 16;
+
+    // u16 per lane, one AVX2 register with -mavx2
+    using V = u16 __attribute__((vector_size(LANES * sizeof(u16))));
+
+    // result of a lane comparison, all bits set where it holds
+    using M = i16 __attribute__((vector_size(LANES * sizeof(u16))));
+
+
+    // machines running the same program, lane i in element i
+    class Lanes
+    {
+    public:
+        // as CpuState::regs
+        V regs[12] = { 0 };
+        V ip = { 0 };
+
+        // lazy flags as in CpuState
+        V flags = { 0 };
+        V alu = { 0 };
+        V alu_w = { 0 };
+        V alu_dst = { 0 };
+        V alu_src = { 0 };
+        V alu_res = { 0 };
+
+        // memory, and the state of instructions run one lane at a time
+        CpuState* cpus[LANES] = { 0 };
+
+        u64 n_instructions[LANES] = { 0 };
+    };
+
+
+    static void destroy(Lanes& s)
+    {
+        for (int i = 0; i < LANES; ++i)
+        {
+            REG::destroy(s.cpus[i]);
+        }
+    }
+
+
+    static bool create(Lanes& s)
+    {
+        for (int i = 0; i < LANES; ++i)
+        {
+            if (!REG::create(s.cpus[i]))
+            {
+                destroy(s);
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+
+    static V splat(int v)
+    {
+        return V{} + (u16)v;
+    }
+
+
+    // a where m holds, b elsewhere
+    static V blend(M m, V a, V b)
+    {
+        return ((V)m & a) | (~(V)m & b);
+    }
+
+
+    static u32 get_bits(M m)
+    {
+        u32 bits = 0;
+        for (int i = 0; i < LANES; ++i)
+        {
+            bits |= (m[i] ? 1u : 0u) << i;
+        }
+
+        return bits;
+    }
+
+
+    static V get_value(Lanes const& s, Reg r)
+    {
+        auto& reg = s.regs[REG::get_index(r)];
+
+        if (REG::is_wide(r))
+        {
+            return reg;
+        }
+
+        // ah, ch, dh, bh
+        return ((int)r & 0b100) ? reg >> 8 : reg & 0xFF;
+    }
+
+
+    static void set_value(Lanes& s, M m, Reg r, V v)
+    {
+        auto& reg = s.regs[REG::get_index(r)];
+
+        V res = v;
+        if (!REG::is_wide(r))
+        {
+            res = ((int)r & 0b100) ? (reg & 0x00FF) | (v << 8) : (reg & 0xFF00) | (v & 0xFF);
+        }
+
+        reg = blend(m, res, reg);
+    }
+
+
+    // as REG::set_alu
+    static V set_alu(Lanes& s, M m, Alu alu, int w, V dst, V src)
+    {
+        auto mask = REG::get_mask(w);
+
+        dst &= mask;
+        src &= mask;
+        V res = (alu == Alu::add ? dst + src : dst - src) & mask;
+
+        s.alu = blend(m, splat((int)alu), s.alu);
+        s.alu_w = blend(m, splat(w), s.alu_w);
+        s.alu_dst = blend(m, dst, s.alu_dst);
+        s.alu_src = blend(m, src, s.alu_src);
+        s.alu_res = blend(m, res, s.alu_res);
+
+        return res;
+    }
+
+
+    // lanes with ZF clear, as REG::zf
+    static M get_nz(Lanes const& s)
+    {
+        auto lazy = s.alu != 0;
+        auto mask = blend(s.alu_w != 0, splat(0xFFFF), splat(0xFF));
+
+        auto nz_lazy = (s.alu_res & mask) != 0;
+        auto nz_flags = (s.flags & REG::ZF) == 0;
+
+        return (lazy & nz_lazy) | (~lazy & nz_flags);
+    }
+
+
+    static void to_cpu(Lanes const& s, int lane, CpuState& cpu)
+    {
+        for (int r = 0; r < 12; ++r)
+        {
+            cpu.regs[r] = s.regs[r][lane];
+        }
+
+        cpu.IP = s.ip[lane];
+        cpu.FLAGS = s.flags[lane];
+        cpu.alu = (Alu)s.alu[lane];
+        cpu.alu_w = (u8)s.alu_w[lane];
+        cpu.alu_dst = s.alu_dst[lane];
+        cpu.alu_src = s.alu_src[lane];
+        cpu.alu_res = s.alu_res[lane];
+    }
+
+
+    static void from_cpu(Lanes& s, int lane, CpuState const& cpu)
+    {
+        for (int r = 0; r < 12; ++r)
+        {
+            s.regs[r][lane] = cpu.regs[r];
+        }
+
+        s.ip[lane] = cpu.IP;
+        s.flags[lane] = cpu.FLAGS;
+        s.alu[lane] = (u16)cpu.alu;
+        s.alu_w[lane] = cpu.alu_w;
+        s.alu_dst[lane] = cpu.alu_dst;
+        s.alu_src[lane] = cpu.alu_src;
+        s.alu_res[lane] = cpu.alu_res;
+    }
+
+
+    // every lane starts with its general registers set to its init
+    static void reset(Lanes& s, u16 const* inits, int n_lanes)
+    {
+        for (int i = 0; i < LANES; ++i)
+        {
+            REG::reset(*s.cpus[i]);
+
+            if (i < n_lanes)
+            {
+                BATCH::set_init(*s.cpus[i], inits[i]);
+            }
+
+            from_cpu(s, i, *s.cpus[i]);
+
+            s.n_instructions[i] = 0;
+        }
+    }
+
+
+    // register forms run on all active lanes at once, the rest one lane at a time
+    static void execute(Lanes& s, M m, OP::Op const& op)
+    {
+        auto& in = op.in;
+
+        auto next = s.ip + (u16)in.length;
+
+        switch (op.form)
+        {
+        case F::mov_r_r:
+        {
+            auto cmd = CMD::get_r_r(in);
+            set_value(s, m, cmd.dst, get_value(s, cmd.src));
+        } break;
+
+        case F::mov_im_r:
+        {
+            auto cmd = CMD::get_mov_im_r(in);
+            set_value(s, m, cmd.dst, splat(cmd.src));
+        } break;
+
+        case F::add_r_r:
+        case F::sub_r_r:
+        {
+            auto cmd = CMD::get_r_r(in);
+            auto alu = op.form == F::add_r_r ? Alu::add : Alu::sub;
+            auto res = set_alu(s, m, alu, REG::is_wide(cmd.dst), get_value(s, cmd.dst), get_value(s, cmd.src));
+            set_value(s, m, cmd.dst, res);
+        } break;
+
+        case F::add_im_r:
+        case F::sub_im_r:
+        {
+            auto cmd = CMD::get_im_r(in);
+            auto alu = op.form == F::add_im_r ? Alu::add : Alu::sub;
+            auto res = set_alu(s, m, alu, REG::is_wide(cmd.dst), get_value(s, cmd.dst), splat(cmd.src));
+            set_value(s, m, cmd.dst, res);
+        } break;
+
+        case F::cmp_r_r:
+        {
+            auto cmd = CMD::get_r_r(in);
+            set_alu(s, m, Alu::sub, REG::is_wide(cmd.dst), get_value(s, cmd.dst), get_value(s, cmd.src));
+        } break;
+
+        case F::jnz:
+        {
+            // lanes diverge here
+            auto cmd = CMD::get_jump(in);
+            next = blend(get_nz(s), s.ip + (u16)cmd.j_offset, next);
+        } break;
+
+        default:
+        {
+            // memory is per lane
+            auto bits = get_bits(m);
+            while (bits)
+            {
+                auto lane = __builtin_ctz(bits);
+                bits &= bits - 1;
+
+                auto& cpu = *s.cpus[lane];
+                to_cpu(s, lane, cpu);
+                OP::execute(cpu, op);
+                from_cpu(s, lane, cpu);
+            }
+        } return;
+        }
+
+        s.ip = blend(m, next, s.ip);
+    }
+
+
+    static M get_lanes(u32 bits)
+    {
+        M m = { 0 };
+        for (int i = 0; i < LANES; ++i)
+        {
+            m[i] = ((bits >> i) & 1) ? -1 : 0;
+        }
+
+        return m;
+    }
+
+
+    // the lanes at the lowest ip step together until every lane has left the program
+    // lanes that took a different branch wait and join again at the same ip
+    static void run(Lanes& s, u8* data, u32 size, CACHE::OpCache& cache, int n_lanes)
+    {
+        u32 running = (1u << n_lanes) - 1;
+
+        while (running)
+        {
+            int pc = (int)size;
+            for (int i = 0; i < LANES; ++i)
+            {
+                if ((running >> i) & 1)
+                {
+                    pc = std::min(pc, (int)s.ip[i]);
+                }
+            }
+
+            M m = (s.ip == (u16)pc) & get_lanes(running);
+            auto bits = get_bits(m);
+
+            auto& op = CACHE::get_op(cache, data, pc);
+            if (!op.exec)
+            {
+                running &= ~bits;
+                continue;
+            }
+
+            execute(s, m, op);
+
+            for (; bits; bits &= bits - 1)
+            {
+                ++s.n_instructions[__builtin_ctz(bits)];
+            }
+
+            for (int i = 0; i < LANES; ++i)
+            {
+                if (s.ip[i] >= size)
+                {
+                    running &= ~(1u << i);
+                }
+            }
+        }
+    }
+
+
+    // the state of one input once all of its lanes have left the program
+    class Final
+    {
+    public:
+        u64 n_instructions = 0;
+
+        u16 regs[12] = { 0 };
+        u16 ip = 0;
+        u16 flags = 0;
+    };
+
+
+    static Final get_final(Lanes const& s, int lane)
+    {
+        auto& cpu = *s.cpus[lane];
+        to_cpu(s, lane, cpu);
+
+        Final res{};
+        res.n_instructions = s.n_instructions[lane];
+
+        for (int r = 0; r < 12; ++r)
+        {
+            res.regs[r] = cpu.regs[r];
+        }
+
+        res.ip = cpu.IP;
+        res.flags = REG::get_flags(cpu);
+
+        return res;
+    }
+
+
+    // one line per input in the order of REG::print_all
+    static void print(Final const& f)
+    {
+        for (auto r : REG::PRINT_ORDER)
+        {
+            printf(" %s: 0x%04x", REG::get_str(r), f.regs[REG::get_index(r)]);
+        }
+
+        for (auto r : REG::SEG_ORDER)
+        {
+            auto v = f.regs[REG::get_index(r)];
+            if (v)
+            {
+                printf(" %s: 0x%04x", REG::get_str(r), v);
+            }
+        }
+
+        printf(" ip: 0x%04x flags: %s\n", f.ip, REG::get_flags_str(f.flags).str);
+    }
+
+
+    // input i starts with every general register set to i, as the copies of BATCH::run
+    static bool run(cstr bin_file, u32 n_inputs)
+    {
+        auto program = Bytes::read(bin_file);
+        if (!program.data)
+        {
+            return false;
+        }
+
+        CACHE::OpCache cache{};
+        if (!CACHE::create(cache, program.size))
+        {
+            assert(false);
+            Bytes::destroy(program);
+            return false;
+        }
+
+        auto finals = (Final*)std::malloc(sizeof(Final) * n_inputs);
+
+        Lanes s{};
+        if (!finals || !create(s))
+        {
+            assert(false);
+            std::free(finals);
+            CACHE::destroy(cache);
+            Bytes::destroy(program);
+            return false;
+        }
+
+        printf("ensemble: %u inputs, %d lanes\n", n_inputs, LANES);
+
+        auto start = std::chrono::steady_clock::now();
+
+        u16 inits[LANES] = { 0 };
+
+        for (u32 first = 0; first < n_inputs; first += LANES)
+        {
+            int n_lanes = (int)std::min(n_inputs - first, (u32)LANES);
+            for (int i = 0; i < n_lanes; ++i)
+            {
+                inits[i] = (u16)(first + i);
+            }
+
+            reset(s, inits, n_lanes);
+            run(s, program.data, program.size, cache, n_lanes);
+
+            for (int i = 0; i < n_lanes; ++i)
+            {
+                finals[first + i] = get_final(s, i);
+            }
+        }
+
+        auto end = std::chrono::steady_clock::now();
+        auto sec = std::chrono::duration<f64>(end - start).count();
+
+        auto name = fs::path(bin_file).filename().string();
+
+        u64 total = 0;
+
+        for (u32 i = 0; i < n_inputs; ++i)
+        {
+            auto& f = finals[i];
+            printf("%s (init %u): %llu instructions,", name.c_str(), i, (unsigned long long)f.n_instructions);
+            print(f);
+
+            total += f.n_instructions;
+        }
+
+        printf("\ninstructions: %llu\n", (unsigned long long)total);
+        printf("seconds: %f\n", sec);
+        printf("instructions/s: %.0f\n", sec > 0.0 ? total / sec : 0.0);
+
+        destroy(s);
+        std::free(finals);
+        CACHE::destroy(cache);
+        Bytes::destroy(program);
+
+        return true;
+    }
+}
@@ -0,0 +1,602 @@
+namespace FFWD
+{
+    using Reg = REG::Reg;
+    using MR = REG::MemReg;
+    using F = OP::Form;
+
+
+    constexpr u32 MAX_BODY = 16;
+
+    // no register written
+    constexpr int NO_DST = -1;
+
+
+    // a loop of one block ending in a jnz to its first instruction
+    class Plan
+    {
+    public:
+        OP::Op ops[MAX_BODY];
+        u32 n_ops = 0;
+
+        // general register written by each op
+        int dst[MAX_BODY] = { 0 };
+
+        // the op adds a constant or a register the body does not write to dst
+        bool is_step[MAX_BODY] = { 0 };
+
+        // written by an op that is not a step
+        bool varies[REG::N_GENERAL] = { 0 };
+        bool written[REG::N_GENERAL] = { 0 };
+
+        // the op whose flags the jnz tests, it compares x with y
+        int flags_op = -1;
+        int x = NO_DST;
+        int y = NO_DST;
+
+        // loaded by a mov r, [ea] and only added to accumulators
+        bool loaded[REG::N_GENERAL] = { 0 };
+
+        // written by adding or subtracting a loaded register
+        bool accumulates[REG::N_GENERAL] = { 0 };
+
+        u32 n_loads = 0;
+        u32 n_stores = 0;
+
+        // steps and affine memory ops, skipped iterations are a multiply and a strided read or write
+        bool closed_form = false;
+    };
+
+
+    static int get_dst(OP::Op const& op)
+    {
+        auto& in = op.in;
+
+        switch (op.form)
+        {
+        case F::mov_r_r:
+        case F::add_r_r:
+        case F::sub_r_r: return REG::get_index(CMD::get_r_r(in).dst);
+
+        case F::mov_m_r: return REG::get_index(CMD::get_m_r(in).dst);
+        case F::mov_rm_r: return REG::get_index(CMD::get_rm_r(in).dst);
+        case F::mov_im_r: return REG::get_index(CMD::get_mov_im_r(in).dst);
+
+        case F::add_im_r:
+        case F::sub_im_r: return REG::get_index(CMD::get_im_r(in).dst);
+
+        default: return NO_DST;
+        }
+    }
+
+
+    static bool is_alu(F form)
+    {
+        switch (form)
+        {
+        case F::add_r_r:
+        case F::add_im_r:
+        case F::sub_r_r:
+        case F::sub_im_r:
+        case F::cmp_r_r: return true;
+
+        default: return false;
+        }
+    }
+
+
+    // instructions the body may hold, jnz only at the end
+    // stores cannot alias code, it is fetched from the program and not from guest memory
+    static bool is_supported(F form)
+    {
+        return form < F::jnz;
+    }
+
+
+    static void get_regs(MR mr, int& a, int& b)
+    {
+        auto const index = [](Reg r) { return REG::get_index(r); };
+
+        a = NO_DST;
+        b = NO_DST;
+
+        switch (mr)
+        {
+        case MR::m_bx_si: a = index(Reg::bx); b = index(Reg::si); break;
+        case MR::m_bx_di: a = index(Reg::bx); b = index(Reg::di); break;
+        case MR::m_bp_si: a = index(Reg::bp); b = index(Reg::si); break;
+        case MR::m_bp_di: a = index(Reg::bp); b = index(Reg::di); break;
+        case MR::m_si: a = index(Reg::si); break;
+        case MR::m_di: a = index(Reg::di); break;
+        case MR::m_bp: a = index(Reg::bp); break;
+        case MR::m_bx: a = index(Reg::bx); break;
+        default: break;
+        }
+    }
+
+
+    // the address moves by a constant each pass
+    static bool is_affine(Plan const& plan, MR mr)
+    {
+        int a, b;
+        get_regs(mr, a, b);
+
+        return (a == NO_DST || !plan.varies[a]) && (b == NO_DST || !plan.varies[b]);
+    }
+
+
+    // every op is a step, a cmp, an affine load, an accumulation of a value loaded earlier in the pass
+    // or the one affine store of a body without loads
+    static bool is_closed(Plan& plan)
+    {
+        int writers[REG::N_GENERAL] = { 0 };
+
+        for (u32 i = 0; i + 1 < plan.n_ops; ++i)
+        {
+            auto& in = plan.ops[i].in;
+            auto dst = plan.dst[i];
+
+            if (dst != NO_DST)
+            {
+                ++writers[dst];
+            }
+
+            switch (plan.ops[i].form)
+            {
+            case F::cmp_r_r: break;
+
+            case F::mov_rm_r:
+                if (!is_affine(plan, CMD::get_rm_r(in).src))
+                {
+                    return false;
+                }
+                [[fallthrough]];
+
+            case F::mov_m_r:
+                plan.loaded[dst] = true;
+                ++plan.n_loads;
+                break;
+
+            case F::mov_r_rm:
+            {
+                auto cmd = CMD::get_r_mr(in);
+                if (!is_affine(plan, cmd.dst) || plan.varies[REG::get_index(cmd.src)])
+                {
+                    return false;
+                }
+
+                ++plan.n_stores;
+            } break;
+
+            case F::mov_im_rmd:
+                if (!is_affine(plan, CMD::get_im_rmd(in).dst))
+                {
+                    return false;
+                }
+                [[fallthrough]];
+
+            case F::mov_im_m:
+                ++plan.n_stores;
+                break;
+
+            case F::add_r_r:
+            case F::sub_r_r:
+                if (!plan.is_step[i])
+                {
+                    if (!in.w_b1 || !plan.loaded[REG::get_index(CMD::get_r_r(in).src)])
+                    {
+                        return false;
+                    }
+
+                    plan.accumulates[dst] = true;
+                }
+                break;
+
+            case F::add_im_r:
+            case F::sub_im_r:
+                if (!plan.is_step[i])
+                {
+                    return false;
+                }
+                break;
+
+            default: return false;
+            }
+        }
+
+        for (int r = 0; r < REG::N_GENERAL; ++r)
+        {
+            if (plan.loaded[r] && (writers[r] != 1 || plan.accumulates[r]))
+            {
+                return false;
+            }
+        }
+
+        // a load could see a store of an earlier pass, stores could overwrite each other
+        return plan.n_stores == 0 || (plan.n_stores == 1 && plan.n_loads == 0);
+    }
+
+
+    static bool create(Plan& plan, CACHE::OpCache& cache, u8* data, CFG::Block const& block)
+    {
+        plan = Plan{};
+
+        if (block.n_ops > MAX_BODY)
+        {
+            return false;
+        }
+
+        int offset = block.begin;
+        for (u32 i = 0; i < block.n_ops; ++i)
+        {
+            auto& op = CACHE::get_op(cache, data, offset);
+
+            auto last = i + 1 == block.n_ops;
+            if (last ? op.form != F::jnz : !is_supported(op.form))
+            {
+                return false;
+            }
+
+            plan.ops[plan.n_ops++] = op;
+            offset += op.in.length;
+        }
+
+        // the jnz goes back to the first instruction
+        auto& jnz = plan.ops[plan.n_ops - 1];
+        if (offset - (int)jnz.in.length + CMD::get_jump(jnz.in).j_offset != block.begin)
+        {
+            return false;
+        }
+
+        for (u32 i = 0; i + 1 < plan.n_ops; ++i)
+        {
+            auto& op = plan.ops[i];
+
+            plan.dst[i] = get_dst(op);
+            if (plan.dst[i] != NO_DST)
+            {
+                plan.written[plan.dst[i]] = true;
+            }
+
+            if (is_alu(op.form))
+            {
+                plan.flags_op = (int)i;
+            }
+        }
+
+        // a step adds what the body does not change
+        for (u32 i = 0; i + 1 < plan.n_ops; ++i)
+        {
+            auto& op = plan.ops[i];
+            auto& in = op.in;
+
+            if (op.form == F::add_im_r || op.form == F::sub_im_r)
+            {
+                plan.is_step[i] = in.w_b1;
+            }
+            else if (op.form == F::add_r_r || op.form == F::sub_r_r)
+            {
+                auto src = CMD::get_r_r(in).src;
+                plan.is_step[i] = in.w_b1 && !plan.written[REG::get_index(src)];
+            }
+
+            if (plan.dst[i] != NO_DST && !plan.is_step[i])
+            {
+                plan.varies[plan.dst[i]] = true;
+            }
+        }
+
+        if (plan.flags_op < 0)
+        {
+            return false;
+        }
+
+        auto& flags = plan.ops[plan.flags_op];
+        if (!flags.in.w_b1)
+        {
+            return false;
+        }
+
+        // cmp x, y or the result of add/sub against 0
+        if (flags.form == F::cmp_r_r)
+        {
+            auto cmd = CMD::get_r_r(flags.in);
+            plan.x = REG::get_index(cmd.dst);
+            plan.y = REG::get_index(cmd.src);
+        }
+        else
+        {
+            plan.x = plan.dst[plan.flags_op];
+        }
+
+        if (plan.varies[plan.x] || (plan.y != NO_DST && plan.varies[plan.y]))
+        {
+            return false;
+        }
+
+        plan.closed_form = is_closed(plan);
+
+        return true;
+    }
+
+
+    // what ops [0, last] add to register r in one pass
+    static u16 get_step(Plan const& plan, CpuState const& cpu, int r, int last)
+    {
+        u16 step = 0;
+
+        for (int i = 0; i <= last && r != NO_DST; ++i)
+        {
+            if (plan.dst[i] != r || !plan.is_step[i])
+            {
+                continue;
+            }
+
+            auto& op = plan.ops[i];
+
+            u16 v = 0;
+            if (op.form == F::add_im_r || op.form == F::sub_im_r)
+            {
+                v = (u16)CMD::get_im_r(op.in).src;
+            }
+            else
+            {
+                v = (u16)REG::get_value(cpu, CMD::get_r_r(op.in).src);
+            }
+
+            auto sub = op.form == F::sub_im_r || op.form == F::sub_r_r;
+            step += sub ? -v : v;
+        }
+
+        return step;
+    }
+
+
+    // passes through the body before the one that exits, 0 when it does not exit
+    static u32 get_skip(Plan const& plan, CpuState const& cpu)
+    {
+        auto const value = [&](int r)
+        {
+            return r == NO_DST ? (u16)0 : (u16)(cpu.regs[r] + get_step(plan, cpu, r, plan.flags_op));
+        };
+
+        auto const step = [&](int r)
+        {
+            return get_step(plan, cpu, r, (int)plan.n_ops - 2);
+        };
+
+        // pass k + 1 exits when d + k * delta == 0 mod 2^16
+        u16 d = value(plan.x) - value(plan.y);
+        u16 delta = step(plan.x) - step(plan.y);
+
+        if (!d || !delta)
+        {
+            return 0;
+        }
+
+        // delta = odd * 2^t, k = (-d / 2^t) * odd^-1 mod 2^(16 - t)
+        int t = __builtin_ctz(delta);
+
+        u32 neg_d = (u16)-d;
+        if (neg_d & ((1u << t) - 1))
+        {
+            // never exits
+            return 0;
+        }
+
+        u32 odd = delta >> t;
+        u32 inv = odd;
+        for (int i = 0; i < 4; ++i)
+        {
+            inv *= 2 - odd * inv;
+        }
+
+        u32 mask = (1u << (16 - t)) - 1;
+
+        return ((neg_d >> t) * inv) & mask;
+    }
+
+
+    // runs all but the last pass of the loop at the current ip, the interpreter runs the last one
+    // bodies that are not closed form run their executors once per skipped pass
+    // returns the instructions skipped
+    static u64 fast_forward(CpuState& cpu, Plan const& plan)
+    {
+        auto skip = get_skip(plan, cpu);
+        if (!skip)
+        {
+            return 0;
+        }
+
+        if (plan.closed_form)
+        {
+            u16 steps[REG::N_GENERAL] = { 0 };
+            for (int r = 0; r < REG::N_GENERAL; ++r)
+            {
+                steps[r] = plan.written[r] ? get_step(plan, cpu, r, (int)plan.n_ops - 2) : 0;
+            }
+
+            // register r as op i sees it in the first skipped pass
+            auto const at = [&](int r, int i)
+            {
+                return r == NO_DST ? (u16)0 : (u16)(cpu.regs[r] + get_step(plan, cpu, r, i - 1));
+            };
+
+            // seg:offset of the first pass, stride is added each pass
+            auto const get_ea = [&](MR mr, int i, int disp, u32& seg, u16& offset, u16& stride)
+            {
+                int a, b;
+                get_regs(mr, a, b);
+
+                seg = REG::get_address(cpu, mr == MR::none ? Reg::ds : REG::get_seg(mr), 0);
+                offset = (u16)(disp + at(a, i) + at(b, i));
+                stride = (u16)((a == NO_DST ? 0 : steps[a]) + (b == NO_DST ? 0 : steps[b]));
+            };
+
+            u16 sums[REG::N_GENERAL] = { 0 };
+            u16 last[REG::N_GENERAL] = { 0 };
+            u16 added[REG::N_GENERAL] = { 0 };
+
+            auto& mem = cpu.MEM;
+
+            for (int i = 0; i + 1 < (int)plan.n_ops; ++i)
+            {
+                auto& op = plan.ops[i];
+                auto& in = op.in;
+                auto dst = plan.dst[i];
+
+                u32 seg = 0;
+                u16 offset = 0;
+                u16 stride = 0;
+
+                switch (op.form)
+                {
+                case F::mov_m_r:
+                    get_ea(MR::none, i, CMD::get_m_r(in).src, seg, offset, stride);
+                    sums[dst] = MEMORY::sum_strided(mem, seg, offset, stride, 1, skip, last[dst]);
+                    break;
+
+                case F::mov_rm_r:
+                    get_ea(CMD::get_rm_r(in).src, i, 0, seg, offset, stride);
+                    sums[dst] = MEMORY::sum_strided(mem, seg, offset, stride, 1, skip, last[dst]);
+                    break;
+
+                case F::mov_r_rm:
+                {
+                    auto cmd = CMD::get_r_mr(in);
+                    auto src = REG::get_index(cmd.src);
+
+                    get_ea(cmd.dst, i, 0, seg, offset, stride);
+                    MEMORY::write_strided(mem, seg, offset, stride, 1, at(src, i), steps[src], skip);
+                } break;
+
+                case F::mov_im_m:
+                {
+                    auto cmd = CMD::get_im_m(in);
+
+                    get_ea(MR::none, i, cmd.dst, seg, offset, stride);
+                    MEMORY::write_strided(mem, seg, offset, stride, cmd.im_size == 2, (u16)cmd.src, 0, skip);
+                } break;
+
+                case F::mov_im_rmd:
+                {
+                    auto cmd = CMD::get_im_rmd(in);
+
+                    get_ea(cmd.dst, i, cmd.disp, seg, offset, stride);
+                    MEMORY::write_strided(mem, seg, offset, stride, cmd.im_size == 2, (u16)cmd.src, 0, skip);
+                } break;
+
+                case F::add_r_r:
+                case F::sub_r_r:
+                    if (plan.accumulates[dst] && !plan.is_step[i])
+                    {
+                        auto sum = sums[REG::get_index(CMD::get_r_r(in).src)];
+                        added[dst] += op.form == F::add_r_r ? sum : (u16)-sum;
+                    }
+                    break;
+
+                default: break;
+                }
+            }
+
+            for (int r = 0; r < REG::N_GENERAL; ++r)
+            {
+                cpu.regs[r] = plan.loaded[r] ? last[r] : (u16)(cpu.regs[r] + skip * steps[r] + added[r]);
+            }
+        }
+        else
+        {
+            // no fetch, decode, ip or jump per instruction
+            auto n = plan.n_ops - 1;
+            for (u32 k = 0; k < skip; ++k)
+            {
+                for (u32 i = 0; i < n; ++i)
+                {
+                    plan.ops[i].exec(cpu, plan.ops[i].in);
+                }
+            }
+        }
+
+        return (u64)skip * plan.n_ops;
+    }
+
+
+    // as decode_run with loops found by CFG fast forwarded, the trace build steps through them
+    static u64 run(CpuState& cpu, u8* data, u32 size)
+    {
+        CACHE::OpCache cache{};
+        if (!CACHE::create(cache, size))
+        {
+            assert(false);
+            return 0;
+        }
+
+        CFG::Graph g{};
+        Plan* plans = nullptr;
+        int* plan_of = nullptr;
+
+        if constexpr (!TRACE)
+        {
+            if (CFG::create(g, cache, data, size))
+            {
+                plans = (Plan*)std::malloc(sizeof(Plan) * (g.n_loops + 1));
+                plan_of = (int*)std::malloc(sizeof(int) * g.n_blocks);
+            }
+
+            if (!plans || !plan_of)
+            {
+                std::free(plans);
+                std::free(plan_of);
+                plans = nullptr;
+                plan_of = nullptr;
+            }
+        }
+
+        u32 n_plans = 0;
+
+        for (u32 b = 0; plan_of && b < g.n_blocks; ++b)
+        {
+            plan_of[b] = -1;
+
+            auto& block = g.blocks[b];
+            if (block.is_header && block.succ[1] == (int)b && create(plans[n_plans], cache, data, block))
+            {
+                plan_of[b] = (int)n_plans++;
+            }
+        }
+
+        u64 count = 0;
+
+        int offset = 0;
+        while (offset >= 0 && offset < size)
+        {
+            if (n_plans)
+            {
+                auto b = g.block_of[offset];
+                if (b >= 0 && plan_of[b] >= 0)
+                {
+                    count += fast_forward(cpu, plans[plan_of[b]]);
+                }
+            }
+
+            auto& op = CACHE::get_op(cache, data, offset);
+            if (!op.exec)
+            {
+                break;
+            }
+
+            OP::execute(cpu, op);
+            ++count;
+
+            REG::print_trace(cpu);
+
+            offset = REG::ip(cpu);
+        }
+
+        std::free(plans);
+        std::free(plan_of);
+        CFG::destroy(g);
+        CACHE::destroy(cache);
+
+        return count;
+    }
+}
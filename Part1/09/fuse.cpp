@@ -0,0 +1,232 @@
+namespace FUSE
+{
+    using F = OP::Form;
+
+
+    constexpr int N_FORMS = (int)F::other + 1;
+
+    // rows printed in each table
+    constexpr u32 MAX_ROWS = 10;
+
+
+    // executed sequences of operand forms
+    class Stats
+    {
+    public:
+        u64 n_instructions = 0;
+        u32 n_programs = 0;
+
+        u64 pairs[N_FORMS][N_FORMS] = { 0 };
+        u64 triples[N_FORMS][N_FORMS][N_FORMS] = { 0 };
+    };
+
+
+    static cstr get_str(F form)
+    {
+        switch (form)
+        {
+        case F::mov_r_r: return "mov r, r";
+        case F::mov_m_r: return "mov r, [m]";
+        case F::mov_r_rm: return "mov [rm], r";
+        case F::mov_rm_r: return "mov r, [rm]";
+        case F::mov_im_m: return "mov [m], im";
+        case F::mov_im_rmd: return "mov [rm+d], im";
+        case F::mov_im_r: return "mov r, im";
+        case F::add_r_r: return "add r, r";
+        case F::add_im_r: return "add r, im";
+        case F::sub_r_r: return "sub r, r";
+        case F::sub_im_r: return "sub r, im";
+        case F::cmp_r_r: return "cmp r, r";
+        case F::jnz: return "jnz";
+        case F::call: return "call";
+        case F::ret: return "ret";
+        default: return "other";
+        }
+    }
+
+
+    // sequences are counted as executed, across taken jumps
+    static void count(CpuState& cpu, u8* data, u32 size, Stats& stats)
+    {
+        CACHE::OpCache cache{};
+        if (!CACHE::create(cache, size))
+        {
+            assert(false);
+            return;
+        }
+
+        int f1 = -1;
+        int f2 = -1;
+
+        int offset = 0;
+        while (offset >= 0 && offset < size)
+        {
+            auto& op = CACHE::get_op(cache, data, offset);
+            if (!op.exec)
+            {
+                break;
+            }
+
+            OP::execute(cpu, op);
+
+            int f3 = (int)op.form;
+
+            if (f2 >= 0)
+            {
+                stats.pairs[f2][f3]++;
+            }
+
+            if (f1 >= 0)
+            {
+                stats.triples[f1][f2][f3]++;
+            }
+
+            f1 = f2;
+            f2 = f3;
+
+            ++stats.n_instructions;
+
+            offset = REG::ip(cpu);
+        }
+
+        stats.n_programs++;
+
+        CACHE::destroy(cache);
+    }
+
+
+    static void print_row(u64 n, u64 total, F const* forms, int n_forms)
+    {
+        auto pct = total ? 100.0 * n / total : 0.0;
+
+        printf("  %10llu %6.2f%%  ", (unsigned long long)n, pct);
+
+        for (int i = 0; i < n_forms; ++i)
+        {
+            printf("%s%s", i ? "; " : "", get_str(forms[i]));
+        }
+
+        // sequences the threaded engine runs with one handler
+        auto fused = n_forms == 3
+            ? THREAD::get_fused(forms[0], forms[1], forms[2]) == THREAD::Fused::add_cmp_jnz
+            : THREAD::get_fused(forms[0], forms[1], F::other) != THREAD::Fused::none;
+
+        if (fused)
+        {
+            printf("  (fused)");
+        }
+
+        printf("\n");
+    }
+
+
+    static void print(Stats const& stats)
+    {
+        constexpr u32 N_PAIRS = N_FORMS * N_FORMS;
+        constexpr u32 N_TRIPLES = N_PAIRS * N_FORMS;
+
+        // pairs and triples as flat arrays
+        auto pairs = &stats.pairs[0][0];
+        auto triples = &stats.triples[0][0][0];
+
+        u32 ids[N_TRIPLES];
+
+        printf("programs: %u\n", stats.n_programs);
+        printf("instructions: %llu\n", (unsigned long long)stats.n_instructions);
+
+        u32 n = 0;
+        u64 total = 0;
+        for (u32 i = 0; i < N_PAIRS; ++i)
+        {
+            if (pairs[i])
+            {
+                ids[n++] = i;
+                total += pairs[i];
+            }
+        }
+
+        PROFILE::sort_desc(ids, n, pairs);
+
+        printf("\nPairs:\n");
+        printf("       count       %%  sequence\n");
+
+        for (u32 i = 0; i < n && i < MAX_ROWS; ++i)
+        {
+            auto id = ids[i];
+            F forms[] = { (F)(id / N_FORMS), (F)(id % N_FORMS) };
+            print_row(pairs[id], total, forms, 2);
+        }
+
+        n = 0;
+        total = 0;
+        for (u32 i = 0; i < N_TRIPLES; ++i)
+        {
+            if (triples[i])
+            {
+                ids[n++] = i;
+                total += triples[i];
+            }
+        }
+
+        PROFILE::sort_desc(ids, n, triples);
+
+        printf("\nTriples:\n");
+        printf("       count       %%  sequence\n");
+
+        for (u32 i = 0; i < n && i < MAX_ROWS; ++i)
+        {
+            auto id = ids[i];
+            F forms[] = { (F)(id / N_PAIRS), (F)(id / N_FORMS % N_FORMS), (F)(id % N_FORMS) };
+            print_row(triples[id], total, forms, 3);
+        }
+    }
+
+
+    // runs every program once, see BATCH::add_jobs
+    static bool run(cstr path)
+    {
+        BATCH::Batch batch{};
+        if (!BATCH::create(batch, BATCH::MAX_JOBS))
+        {
+            return false;
+        }
+
+        if (!BATCH::add_jobs(batch, path, 1))
+        {
+            BATCH::destroy(batch);
+            return false;
+        }
+
+        auto stats = (Stats*)std::calloc(1, sizeof(Stats));
+        if (!stats)
+        {
+            assert(false);
+            BATCH::destroy(batch);
+            return false;
+        }
+
+        CpuState* cpu = nullptr;
+        if (!REG::create(cpu))
+        {
+            std::free(stats);
+            BATCH::destroy(batch);
+            return false;
+        }
+
+        for (u32 i = 0; i < batch.n_jobs; ++i)
+        {
+            auto& job = batch.jobs[i];
+
+            REG::reset(*cpu);
+            count(*cpu, job.program.data, job.program.size, *stats);
+        }
+
+        print(*stats);
+
+        REG::destroy(cpu);
+        std::free(stats);
+        BATCH::destroy(batch);
+
+        return true;
+    }
+}
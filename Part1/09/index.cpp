@@ -0,0 +1,391 @@
+#include <immintrin.h>
+
+
+namespace INDEX
+{
+    // bytes classified per step, one AVX2 register
+    constexpr u32 STEP = 32;
+
+    // opcode class, the low bits are the length without displacement, 0 when unknown
+    constexpr u8 LENGTH_MASK = 0b0000'1111;
+    constexpr u8 MODRM = 0b0001'0000;
+    constexpr u8 BY_REG = 0b0010'0000;
+    constexpr u8 PREFIX = 0b0100'0000;
+    constexpr u8 STRING = 0b1000'0000;
+
+
+    class ClassTable
+    {
+    public:
+        // by the first byte
+        u8 opcode[256] = { 0 };
+
+        // pshufb tables by the high nibble of the ModRM byte, rm != 110 and rm == 110
+        u8 disp[16] = { 0 };
+        u8 disp_rm6[16] = { 0 };
+
+        // pshufb table by reg, known when the opcode is selected by reg
+        u8 reg_ok[16] = { 0 };
+    };
+
+
+    // the same size rules as the DATA decoders
+    static constexpr ClassTable make_class_table()
+    {
+        ClassTable table{};
+
+        for (int b = 0; b < 256; ++b)
+        {
+            auto& def = OP::OP_TABLE.byte1[b];
+            auto w = b & 1;
+            auto s = (b >> 1) & 1;
+
+            u8 c = 0;
+
+            if (def.by_reg)
+            {
+                c = (u8)(2 + DATA::get_w_sz(w && !s)) | MODRM | BY_REG;
+            }
+            else if (def.prefix)
+            {
+                c = 2 | PREFIX;
+            }
+            else if (def.decode == DATA::get_rm_r || def.decode == DATA::get_mov_sr)
+            {
+                c = 2 | MODRM;
+            }
+            else if (def.decode == DATA::get_mov_im_rm)
+            {
+                c = (u8)(2 + DATA::get_w_sz(w)) | MODRM;
+            }
+            else if (def.decode == DATA::get_mov_im_r)
+            {
+                c = (u8)(1 + DATA::get_w_sz((b >> 3) & 1));
+            }
+            else if (def.decode == DATA::get_mov_m_ac)
+            {
+                c = 3;
+            }
+            else if (def.decode == DATA::get_im_ac)
+            {
+                c = (u8)(1 + DATA::get_w_sz(w));
+            }
+            else if (def.decode == DATA::get_string)
+            {
+                c = 1 | STRING;
+            }
+            else if (def.decode == DATA::get_op1 || def.decode == DATA::get_stack_r || def.decode == DATA::get_stack_sr)
+            {
+                c = 1;
+            }
+            else if (def.decode == DATA::get_jump)
+            {
+                c = 2;
+            }
+            else if (def.decode == DATA::get_call || def.decode == DATA::get_ret_im)
+            {
+                c = 3;
+            }
+
+            table.opcode[b] = c;
+        }
+
+        for (int hi = 0; hi < 16; ++hi)
+        {
+            table.disp[hi] = (u8)DATA::get_disp_sz(hi >> 2, 0);
+            table.disp_rm6[hi] = (u8)DATA::get_disp_sz(hi >> 2, 0b110);
+        }
+
+        for (int reg = 0; reg < 8; ++reg)
+        {
+            table.reg_ok[reg] = OP::OP_TABLE.im_rm[reg].decode ? 0xFF : 0;
+        }
+
+        return table;
+    }
+
+
+    static constexpr ClassTable CLASS_TABLE = make_class_table();
+
+
+    // instructions on the path from offset 0
+    class Index
+    {
+    public:
+        // start of instruction n
+        u32* offsets = nullptr;
+        u32 n_instructions = 0;
+
+        // one bit per byte, set where an instruction starts
+        u64* starts = nullptr;
+        u32 size = 0;
+    };
+
+
+    static void destroy(Index& index)
+    {
+        std::free(index.offsets);
+        std::free(index.starts);
+        index.offsets = nullptr;
+        index.starts = nullptr;
+        index.n_instructions = 0;
+        index.size = 0;
+    }
+
+
+    static __m256i load_table(u8 const* table16)
+    {
+        return _mm256_broadcastsi128_si256(_mm_loadu_si128((__m128i const*)table16));
+    }
+
+
+    // class of 32 opcodes, a pshufb per high nibble that holds a known opcode
+    static __m256i get_classes(__m256i bytes, __m256i const* rows, u32 row_mask)
+    {
+        auto lo = _mm256_and_si256(bytes, _mm256_set1_epi8(0x0F));
+        auto hi = _mm256_and_si256(_mm256_srli_epi16(bytes, 4), _mm256_set1_epi8(0x0F));
+
+        auto res = _mm256_setzero_si256();
+        for (; row_mask; row_mask &= row_mask - 1)
+        {
+            auto h = __builtin_ctz(row_mask);
+            auto in_row = _mm256_cmpeq_epi8(hi, _mm256_set1_epi8((char)h));
+            res = _mm256_or_si256(res, _mm256_and_si256(in_row, _mm256_shuffle_epi8(rows[h], lo)));
+        }
+
+        return res;
+    }
+
+
+    // length of an instruction starting at a byte of class c followed by byte2
+    static u8 get_length(u8 c, u8 byte2, u8 c2)
+    {
+        auto& t = CLASS_TABLE;
+
+        if ((c & BY_REG) && !t.reg_ok[(byte2 >> 3) & 0b111])
+        {
+            return 0;
+        }
+
+        if ((c & PREFIX) && !(c2 & STRING))
+        {
+            return 0;
+        }
+
+        u8 disp = 0;
+        if (c & MODRM)
+        {
+            disp = (byte2 & 0b111) == 0b110 ? t.disp_rm6[byte2 >> 4] : t.disp[byte2 >> 4];
+        }
+
+        return (c & LENGTH_MASK) ? (c & LENGTH_MASK) + disp : 0;
+    }
+
+
+    // the length an instruction would have at every offset, 0 where none decodes
+    static void get_lengths(u8* data, u32 size, u8* classes, u8* lengths)
+    {
+        auto& t = CLASS_TABLE;
+
+        __m256i rows[16];
+        u32 row_mask = 0;
+        for (int h = 0; h < 16; ++h)
+        {
+            rows[h] = load_table(t.opcode + h * 16);
+
+            for (int l = 0; l < 16; ++l)
+            {
+                row_mask |= (t.opcode[h * 16 + l] ? 1u : 0u) << h;
+            }
+        }
+
+        // classify every byte as an opcode
+        u32 i = 0;
+        for (; i + STEP <= size; i += STEP)
+        {
+            auto bytes = _mm256_loadu_si256((__m256i const*)(data + i));
+            _mm256_storeu_si256((__m256i*)(classes + i), get_classes(bytes, rows, row_mask));
+        }
+
+        for (; i < size; ++i)
+        {
+            classes[i] = t.opcode[data[i]];
+        }
+
+        classes[size] = 0;
+
+        auto const disp = load_table(t.disp);
+        auto const disp_rm6 = load_table(t.disp_rm6);
+        auto const reg_ok = load_table(t.reg_ok);
+
+        auto const nibble = _mm256_set1_epi8(0x0F);
+        auto const zero = _mm256_setzero_si256();
+
+        // classify the byte after each one as ModRM or as the opcode after a prefix
+        i = 0;
+        for (; i + STEP < size; i += STEP)
+        {
+            auto c = _mm256_loadu_si256((__m256i const*)(classes + i));
+            auto c2 = _mm256_loadu_si256((__m256i const*)(classes + i + 1));
+            auto b2 = _mm256_loadu_si256((__m256i const*)(data + i + 1));
+
+            auto hi = _mm256_and_si256(_mm256_srli_epi16(b2, 4), nibble);
+            auto reg = _mm256_and_si256(_mm256_srli_epi16(b2, 3), _mm256_set1_epi8(0b111));
+            auto rm6 = _mm256_cmpeq_epi8(_mm256_and_si256(b2, _mm256_set1_epi8(0b111)), _mm256_set1_epi8(0b110));
+
+            auto has = [&](__m256i v, u8 bits)
+            {
+                return _mm256_xor_si256(_mm256_cmpeq_epi8(_mm256_and_si256(v, _mm256_set1_epi8((char)bits)), zero), _mm256_set1_epi8(-1));
+            };
+
+            auto d = _mm256_blendv_epi8(_mm256_shuffle_epi8(disp, hi), _mm256_shuffle_epi8(disp_rm6, hi), rm6);
+            d = _mm256_and_si256(d, has(c, MODRM));
+
+            auto len = _mm256_and_si256(c, _mm256_set1_epi8(LENGTH_MASK));
+            auto bad = _mm256_cmpeq_epi8(len, zero);
+
+            bad = _mm256_or_si256(bad, _mm256_andnot_si256(_mm256_shuffle_epi8(reg_ok, reg), has(c, BY_REG)));
+            bad = _mm256_or_si256(bad, _mm256_andnot_si256(has(c2, STRING), has(c, PREFIX)));
+
+            len = _mm256_andnot_si256(bad, _mm256_add_epi8(len, d));
+            _mm256_storeu_si256((__m256i*)(lengths + i), len);
+        }
+
+        for (; i < size; ++i)
+        {
+            auto byte2 = i + 1 < size ? data[i + 1] : (u8)0;
+            lengths[i] = get_length(classes[i], byte2, classes[i + 1]);
+        }
+    }
+
+
+    static bool create(Index& index, u8* data, u32 size)
+    {
+        assert(!index.offsets);
+
+        auto n_words = (size + 63) / 64;
+
+        // instructions are at least one byte
+        index.offsets = (u32*)std::malloc(sizeof(u32) * size);
+        index.starts = (u64*)std::calloc(n_words, sizeof(u64));
+
+        auto classes = (u8*)std::malloc(size + 1);
+        auto lengths = (u8*)std::malloc(size);
+
+        if (!index.offsets || !index.starts || !classes || !lengths)
+        {
+            assert(false);
+            std::free(classes);
+            std::free(lengths);
+            destroy(index);
+            return false;
+        }
+
+        index.size = size;
+
+        get_lengths(data, size, classes, lengths);
+
+        // follow the lengths, the decoder stops at the first unknown opcode
+        u32 offset = 0;
+        while (offset < size && lengths[offset] && offset + lengths[offset] <= size)
+        {
+            index.offsets[index.n_instructions++] = offset;
+            index.starts[offset / 64] |= 1ull << (offset % 64);
+
+            offset += lengths[offset];
+        }
+
+        std::free(classes);
+        std::free(lengths);
+
+        return true;
+    }
+
+
+    static bool is_start(Index const& index, int offset)
+    {
+        if (offset < 0 || (u32)offset >= index.size)
+        {
+            return false;
+        }
+
+        return (index.starts[offset / 64] >> (offset % 64)) & 1;
+    }
+
+
+    // offset of instruction n, -1 past the last one
+    static int get_offset(Index const& index, u32 n)
+    {
+        return n < index.n_instructions ? (int)index.offsets[n] : -1;
+    }
+
+
+    // compares the index with decoding one instruction after another
+    static bool run(cstr bin_file)
+    {
+        auto buffer = Bytes::read(bin_file);
+        if (!buffer.data)
+        {
+            return false;
+        }
+
+        auto start = std::chrono::steady_clock::now();
+
+        Index index{};
+        if (!create(index, buffer.data, buffer.size))
+        {
+            Bytes::destroy(buffer);
+            return false;
+        }
+
+        auto mid = std::chrono::steady_clock::now();
+
+        u32 n_decoded = 0;
+        u32 n_mismatch = 0;
+        u32 n_bad_jumps = 0;
+
+        int offset = 0;
+        while (offset >= 0 && (u32)offset < buffer.size)
+        {
+            auto op = decode_next(buffer.data, offset);
+            if (!op.exec || offset + op.in.length > buffer.size)
+            {
+                break;
+            }
+
+            n_mismatch += get_offset(index, n_decoded++) != offset;
+            offset += op.in.length;
+        }
+
+        auto end = std::chrono::steady_clock::now();
+
+        n_mismatch += n_decoded != index.n_instructions;
+
+        // a jump lands on an instruction or leaves the program
+        for (u32 n = 0; n < index.n_instructions; ++n)
+        {
+            auto ip = get_offset(index, n);
+            if (buffer.data[ip] != 0b0111'0101)
+            {
+                continue;
+            }
+
+            auto target = ip + 2 + (int)(i8)buffer.data[ip + 1];
+            n_bad_jumps += target >= 0 && (u32)target < buffer.size && !is_start(index, target);
+        }
+
+        auto scan_sec = std::chrono::duration<f64>(mid - start).count();
+        auto decode_sec = std::chrono::duration<f64>(end - mid).count();
+
+        printf("%s: %llu bytes, %u instructions\n", bin_file, (unsigned long long)buffer.size, index.n_instructions);
+        printf("pre-scan seconds: %f\n", scan_sec);
+        printf("decode seconds:   %f\n", decode_sec);
+        printf("mismatches: %u\n", n_mismatch);
+        printf("bad jump targets: %u\n", n_bad_jumps);
+
+        destroy(index);
+        Bytes::destroy(buffer);
+
+        return !n_mismatch;
+    }
+}
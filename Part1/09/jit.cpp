@@ -0,0 +1,733 @@
+#include <sys/mman.h>
+#include <cstddef>
+#include <initializer_list>
+
+
+namespace JIT
+{
+    using Reg = REG::Reg;
+    using MR = REG::MemReg;
+
+
+    // block entries before it gets translated
+    constexpr int HOT_COUNT = 2;
+
+    constexpr u32 CODE_SIZE = 64 * 1024;
+    constexpr u32 MAX_EXITS = 1024;
+
+    // set in the ip a block returns when a memory access missed
+    constexpr int MISS = 0x10000;
+
+    // worst case bytes emitted for one guest instruction
+    constexpr u32 MAX_OP_BYTES = 128;
+
+
+    // guest registers pinned for the generated code
+    // rdi holds a pointer to it and rsi holds mem
+    class GuestState
+    {
+    public:
+        // as CpuState::regs
+        u16 regs[12] = { 0 };
+
+        // lazy flags as in CpuState
+        u16 flags = 0;
+        u16 alu = 0;
+        u16 alu_w = 0;
+        u16 alu_dst = 0;
+        u16 alu_src = 0;
+        u16 alu_res = 0;
+
+        MEMORY::Memory* mem = nullptr;
+    };
+
+
+    typedef int (*block_f)(GuestState*);
+
+
+    class Block
+    {
+    public:
+        u8* code = nullptr;
+
+        int count = 0;
+        bool no_jit = false;
+    };
+
+
+    // "mov eax, ip; ret" stub that can be patched into "jmp block"
+    class Exit
+    {
+    public:
+        u8* stub = nullptr;
+        int target_ip = -1;
+    };
+
+
+    class Jit
+    {
+    public:
+        u8* code = nullptr;
+        u32 code_capacity = 0;
+        u32 code_size = 0;
+
+        // indexed by ip
+        Block* blocks = nullptr;
+        u32 n_blocks = 0;
+
+        Exit exits[MAX_EXITS];
+        u32 n_exits = 0;
+
+        u32 n_compiled = 0;
+    };
+
+
+    static void destroy(Jit& jit)
+    {
+        if (jit.code)
+        {
+            munmap(jit.code, jit.code_capacity);
+            jit.code = nullptr;
+        }
+
+        if (jit.blocks)
+        {
+            std::free(jit.blocks);
+            jit.blocks = nullptr;
+        }
+    }
+
+
+    static bool create(Jit& jit, u32 n_blocks)
+    {
+        assert(!jit.code);
+        assert(!jit.blocks);
+
+        auto code = mmap(0, CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (code == MAP_FAILED)
+        {
+            return false;
+        }
+
+        jit.code = (u8*)code;
+        jit.code_capacity = CODE_SIZE;
+        jit.code_size = 0;
+
+        jit.blocks = (Block*)std::calloc(n_blocks, sizeof(Block));
+        if (!jit.blocks)
+        {
+            destroy(jit);
+            return false;
+        }
+
+        jit.n_blocks = n_blocks;
+
+        return true;
+    }
+
+
+    static void to_guest(CpuState& cpu, GuestState& state)
+    {
+        memcpy(state.regs, cpu.regs, sizeof(state.regs));
+
+        state.flags = cpu.FLAGS;
+        state.alu = (u16)cpu.alu;
+        state.alu_w = cpu.alu_w;
+        state.alu_dst = cpu.alu_dst;
+        state.alu_src = cpu.alu_src;
+        state.alu_res = cpu.alu_res;
+
+        state.mem = &cpu.MEM;
+    }
+
+
+    static void from_guest(CpuState& cpu, GuestState const& state)
+    {
+        memcpy(cpu.regs, state.regs, sizeof(cpu.regs));
+
+        cpu.FLAGS = state.flags;
+        cpu.alu = (REG::Alu)state.alu;
+        cpu.alu_w = (u8)state.alu_w;
+        cpu.alu_dst = state.alu_dst;
+        cpu.alu_src = state.alu_src;
+        cpu.alu_res = state.alu_res;
+    }
+}
+
+
+namespace JIT
+{
+    class Emitter
+    {
+    public:
+        u8* begin = nullptr;
+        u8* end = nullptr;
+        u8* cursor = nullptr;
+    };
+
+
+    static void emit(Emitter& e, u8 b)
+    {
+        assert(e.cursor < e.end);
+
+        *e.cursor++ = b;
+    }
+
+
+    static void emit(Emitter& e, std::initializer_list<u8> bytes)
+    {
+        for (auto b : bytes)
+        {
+            emit(e, b);
+        }
+    }
+
+
+    static void emit_u16(Emitter& e, int v)
+    {
+        emit(e, (u8)(v & 0xFF));
+        emit(e, (u8)((v >> 8) & 0xFF));
+    }
+
+
+    static void emit_u32(Emitter& e, int v)
+    {
+        emit_u16(e, v & 0xFFFF);
+        emit_u16(e, (v >> 16) & 0xFFFF);
+    }
+
+
+    static u8 reg_disp(Reg r)
+    {
+        return (u8)(offsetof(GuestState, regs) + 2 * ((int)r - (int)Reg::ax));
+    }
+
+
+    static bool is_reg16(Reg r)
+    {
+        return (int)r >= (int)Reg::ax && (int)r <= (int)Reg::di;
+    }
+
+
+    constexpr u8 ALU_DISP = (u8)offsetof(GuestState, alu);
+    constexpr u8 ALU_W_DISP = (u8)offsetof(GuestState, alu_w);
+    constexpr u8 ALU_DST_DISP = (u8)offsetof(GuestState, alu_dst);
+    constexpr u8 ALU_SRC_DISP = (u8)offsetof(GuestState, alu_src);
+    constexpr u8 ALU_RES_DISP = (u8)offsetof(GuestState, alu_res);
+    constexpr u8 MEM_DISP = (u8)offsetof(GuestState, mem);
+
+    // from rsi
+    static_assert(offsetof(MEMORY::Memory, pages) == 0);
+    constexpr u32 DIRTY_DISP = (u32)offsetof(MEMORY::Memory, dirty);
+
+
+    // movzx eax, word [rdi + reg]
+    static void load_eax(Emitter& e, Reg r) { emit(e, { 0x0F, 0xB7, 0x47, reg_disp(r) }); }
+
+    // movzx ecx, word [rdi + reg]
+    static void load_ecx(Emitter& e, Reg r) { emit(e, { 0x0F, 0xB7, 0x4F, reg_disp(r) }); }
+
+    // movzx edx, word [rdi + reg]
+    static void load_edx(Emitter& e, Reg r) { emit(e, { 0x0F, 0xB7, 0x57, reg_disp(r) }); }
+
+    // mov [rdi + reg], ax
+    static void store_ax(Emitter& e, Reg r) { emit(e, { 0x66, 0x89, 0x47, reg_disp(r) }); }
+
+
+    // mov word [rdi + disp], imm16
+    static void store_im(Emitter& e, u8 disp, int v)
+    {
+        emit(e, { 0x66, 0xC7, 0x47, disp });
+        emit_u16(e, v);
+    }
+
+
+    static void store_im(Emitter& e, Reg r, int v) { store_im(e, reg_disp(r), v); }
+
+
+    // REG::get_value(MemReg) into edx
+    static void load_ea(Emitter& e, MR mr)
+    {
+        auto const add_ecx = [&](Reg r)
+        {
+            load_ecx(e, r);
+            emit(e, { 0x01, 0xCA }); // add edx, ecx
+        };
+
+        switch (mr)
+        {
+        case MR::m_bx_si: load_edx(e, Reg::bx); add_ecx(Reg::si); break;
+        case MR::m_bx_di: load_edx(e, Reg::bx); add_ecx(Reg::di); break;
+        case MR::m_bp_si: load_edx(e, Reg::bp); add_ecx(Reg::si); break;
+        case MR::m_bp_di: load_edx(e, Reg::bp); add_ecx(Reg::di); break;
+        case MR::m_si: load_edx(e, Reg::si); break;
+        case MR::m_di: load_edx(e, Reg::di); break;
+        case MR::m_bp: load_edx(e, Reg::bp); break;
+        case MR::m_bx: load_edx(e, Reg::bx); break;
+        default: assert(false);
+        }
+    }
+
+
+    // REG::set_alu on ax and cx, the result is left in ax
+    static void set_alu(Emitter& e, REG::Alu alu)
+    {
+        auto opcode = alu == REG::Alu::add ? 0x01 : 0x29;
+
+        emit(e, { 0x66, 0x89, 0x47, ALU_DST_DISP }); // mov [rdi + alu_dst], ax
+        emit(e, { 0x66, 0x89, 0x4F, ALU_SRC_DISP }); // mov [rdi + alu_src], cx
+        emit(e, { (u8)opcode, 0xC8 });               // add/sub eax, ecx
+        emit(e, { 0x66, 0x89, 0x47, ALU_RES_DISP }); // mov [rdi + alu_res], ax
+        store_im(e, ALU_DISP, (int)alu);
+        store_im(e, ALU_W_DISP, 1);
+    }
+
+
+    static bool is_alu(OP::Form form)
+    {
+        using F = OP::Form;
+
+        return form == F::add_r_r || form == F::add_im_r || form == F::sub_r_r || form == F::sub_im_r || form == F::cmp_r_r;
+    }
+
+
+    // 6 bytes
+    static void emit_ret(Emitter& e, int target_ip)
+    {
+        emit(e, 0xB8); // mov eax, imm32
+        emit_u32(e, target_ip);
+        emit(e, 0xC3); // ret
+    }
+
+
+    static void emit_exit(Jit& jit, Emitter& e, int target_ip)
+    {
+        if (jit.n_exits < MAX_EXITS)
+        {
+            auto& exit = jit.exits[jit.n_exits++];
+            exit.stub = e.cursor;
+            exit.target_ip = target_ip;
+        }
+
+        emit_ret(e, target_ip);
+    }
+
+
+    // seg:edx into a page in r8 and an offset in edx, as REG::get_address
+    // returns ip | MISS to the interpreter when the page is not committed or a word straddles two pages
+    // the exit is never chained, the block would miss again
+    static void load_page(Emitter& e, Reg seg, bool word, int ip)
+    {
+        emit(e, { 0x0F, 0xB7, 0xD2 });                   // movzx edx, dx
+        emit(e, { 0x0F, 0xB7, 0x4F, reg_disp(seg) });    // movzx ecx, word [rdi + seg]
+        emit(e, { 0xC1, 0xE1, 0x04 });                   // shl ecx, 4
+        emit(e, { 0x01, 0xCA });                         // add edx, ecx
+        emit(e, { 0x81, 0xE2 });                         // and edx, imm32
+        emit_u32(e, MEMORY::ADDR_MASK);
+        emit(e, { 0x89, 0xD1 });                         // mov ecx, edx
+        emit(e, { 0xC1, 0xE9, (u8)MEMORY::PAGE_SHIFT }); // shr ecx, 12
+        emit(e, { 0x4C, 0x8B, 0x04, 0xCE });             // mov r8, [rsi + rcx * 8]
+        emit(e, { 0x81, 0xE2 });                         // and edx, imm32
+        emit_u32(e, MEMORY::PAGE_MASK);
+        emit(e, { 0x4D, 0x85, 0xC0 });                   // test r8, r8
+
+        if (word)
+        {
+            emit(e, { 0x74, 0x08 });                     // jz to the exit
+            emit(e, { 0x81, 0xFA });                     // cmp edx, imm32
+            emit_u32(e, MEMORY::PAGE_MASK);
+            emit(e, { 0x75, 0x06 });                     // jne over the exit
+        }
+        else
+        {
+            emit(e, { 0x75, 0x06 });                     // jnz over the exit
+        }
+
+        emit_ret(e, ip | MISS);
+    }
+
+
+    // sets the bit of the page in rcx, as MEMORY::commit
+    static void mark_dirty(Emitter& e)
+    {
+        emit(e, { 0x48, 0x0F, 0xAB, 0x8E }); // bts [rsi + dirty], rcx
+        emit_u32(e, DIRTY_DISP);
+    }
+
+
+    // movzx eax, word [r8 + rdx]
+    static void load_eax_page(Emitter& e) { emit(e, { 0x41, 0x0F, 0xB7, 0x04, 0x10 }); }
+
+    // mov [r8 + rdx], ax
+    static void store_ax_page(Emitter& e) { emit(e, { 0x66, 0x41, 0x89, 0x04, 0x10 }); }
+
+
+    // mov byte/word [r8 + rdx], imm
+    static void store_im_page(Emitter& e, int im_size, int v)
+    {
+        if (im_size == 1)
+        {
+            emit(e, { 0x41, 0xC6, 0x04, 0x10 });
+            emit(e, (u8)v);
+        }
+        else
+        {
+            emit(e, { 0x66, 0x41, 0xC7, 0x04, 0x10 });
+            emit_u16(e, v);
+        }
+    }
+
+
+    // chain exits straight to compiled blocks
+    static void patch_exits(Jit& jit)
+    {
+        for (u32 i = 0; i < jit.n_exits; ++i)
+        {
+            auto& exit = jit.exits[i];
+            if (!exit.stub || exit.target_ip < 0 || exit.target_ip >= (int)jit.n_blocks)
+            {
+                continue;
+            }
+
+            auto target = jit.blocks[exit.target_ip].code;
+            if (!target)
+            {
+                continue;
+            }
+
+            auto rel = (int)(target - (exit.stub + 5));
+
+            Emitter e{};
+            e.begin = exit.stub;
+            e.cursor = exit.stub;
+            e.end = exit.stub + 5;
+
+            emit(e, 0xE9); // jmp rel32
+            emit_u32(e, rel);
+
+            exit.stub = nullptr;
+        }
+    }
+
+
+    // emits an instruction if its semantics are supported
+    static bool emit_op(Emitter& e, OP::Op const& op, int ip)
+    {
+        using F = OP::Form;
+
+        auto& in = op.in;
+
+        switch (OP::get_form(op))
+        {
+        case F::mov_r_r:
+        {
+            auto cmd = CMD::get_r_r(in);
+            if (!is_reg16(cmd.src) || !is_reg16(cmd.dst))
+            {
+                return false;
+            }
+
+            load_eax(e, cmd.src);
+            store_ax(e, cmd.dst);
+        } return true;
+
+        case F::mov_m_r:
+        {
+            auto cmd = CMD::get_m_r(in);
+            if (!is_reg16(cmd.dst))
+            {
+                return false;
+            }
+
+            emit(e, 0xBA); // mov edx, imm32
+            emit_u32(e, cmd.src);
+            load_page(e, Reg::ds, true, ip);
+            load_eax_page(e);
+            store_ax(e, cmd.dst);
+        } return true;
+
+        case F::mov_r_rm:
+        {
+            auto cmd = CMD::get_r_mr(in);
+            if (in.mod_b2 != 0b00 || cmd.dst == MR::none || !is_reg16(cmd.src))
+            {
+                return false;
+            }
+
+            load_ea(e, cmd.dst);
+            load_page(e, REG::get_seg(cmd.dst), true, ip);
+            mark_dirty(e);
+            load_eax(e, cmd.src);
+            store_ax_page(e);
+        } return true;
+
+        case F::mov_rm_r:
+        {
+            auto cmd = CMD::get_rm_r(in);
+            if (in.mod_b2 != 0b00 || cmd.src == MR::none || !is_reg16(cmd.dst))
+            {
+                return false;
+            }
+
+            load_ea(e, cmd.src);
+            load_page(e, REG::get_seg(cmd.src), true, ip);
+            load_eax_page(e);
+            store_ax(e, cmd.dst);
+        } return true;
+
+        case F::mov_im_m:
+        {
+            auto cmd = CMD::get_im_m(in);
+            if (cmd.im_size != 1 && cmd.im_size != 2)
+            {
+                return false;
+            }
+
+            emit(e, 0xBA); // mov edx, imm32
+            emit_u32(e, cmd.dst);
+            load_page(e, Reg::ds, cmd.im_size == 2, ip);
+            mark_dirty(e);
+            store_im_page(e, cmd.im_size, cmd.src);
+        } return true;
+
+        case F::mov_im_rmd:
+        {
+            auto cmd = CMD::get_im_rmd(in);
+
+            if (cmd.dst == MR::none || (cmd.im_size != 1 && cmd.im_size != 2))
+            {
+                return false;
+            }
+
+            load_ea(e, cmd.dst);
+            emit(e, { 0x81, 0xC2 }); // add edx, imm32
+            emit_u32(e, cmd.disp);
+            load_page(e, REG::get_seg(cmd.dst), cmd.im_size == 2, ip);
+            mark_dirty(e);
+            store_im_page(e, cmd.im_size, cmd.src);
+        } return true;
+
+        case F::mov_im_r:
+        {
+            auto cmd = CMD::get_mov_im_r(in);
+            if (!is_reg16(cmd.dst))
+            {
+                return false;
+            }
+
+            store_im(e, cmd.dst, cmd.src);
+        } return true;
+
+        case F::add_r_r:
+        case F::sub_r_r:
+        {
+            auto cmd = CMD::get_r_r(in);
+            if (!is_reg16(cmd.src) || !is_reg16(cmd.dst))
+            {
+                return false;
+            }
+
+            auto alu = OP::get_form(op) == F::add_r_r ? REG::Alu::add : REG::Alu::sub;
+
+            load_eax(e, cmd.dst);
+            load_ecx(e, cmd.src);
+            set_alu(e, alu);
+            store_ax(e, cmd.dst);
+        } return true;
+
+        case F::add_im_r:
+        case F::sub_im_r:
+        {
+            auto cmd = CMD::get_im_r(in);
+            if (!is_reg16(cmd.dst))
+            {
+                return false;
+            }
+
+            auto alu = OP::get_form(op) == F::add_im_r ? REG::Alu::add : REG::Alu::sub;
+
+            load_eax(e, cmd.dst);
+            emit(e, 0xB9); // mov ecx, imm32
+            emit_u32(e, cmd.src & 0xFFFF);
+            set_alu(e, alu);
+            store_ax(e, cmd.dst);
+        } return true;
+
+        case F::cmp_r_r:
+        {
+            auto cmd = CMD::get_r_r(in);
+            if (!is_reg16(cmd.src) || !is_reg16(cmd.dst))
+            {
+                return false;
+            }
+
+            load_eax(e, cmd.dst);
+            load_ecx(e, cmd.src);
+            set_alu(e, REG::Alu::sub);
+        } return true;
+
+        default:
+            return false;
+        }
+    }
+
+
+    // translates the basic block starting at ip
+    // the block ends at a jump or at the first unsupported instruction
+    static bool compile(Jit& jit, CACHE::OpCache& cache, u8* data, u32 size, int ip)
+    {
+        auto& block = jit.blocks[ip];
+
+        Emitter e{};
+        e.begin = jit.code + jit.code_size;
+        e.cursor = e.begin;
+        e.end = jit.code + jit.code_capacity;
+
+        auto const has_room = [&](){ return e.end - e.cursor >= (long)MAX_OP_BYTES; };
+
+        if (!has_room())
+        {
+            return false;
+        }
+
+        emit(e, { 0x48, 0x8B, 0x77, MEM_DISP }); // mov rsi, [rdi + mem]
+
+        int n_ops = 0;
+        int offset = ip;
+
+        // ZF can be read from alu_res once the block has set it
+        bool alu_set = false;
+
+        while (true)
+        {
+            if (offset >= size || !has_room())
+            {
+                emit_exit(jit, e, offset);
+                break;
+            }
+
+            auto& op = CACHE::get_op(cache, data, offset);
+
+            if (op.exec && OP::get_form(op) == OP::Form::jnz && alu_set)
+            {
+                auto cmd = CMD::get_jump(op.in);
+
+                emit(e, { 0x66, 0x83, 0x7F, ALU_RES_DISP, 0x00 }); // cmp word [rdi + alu_res], 0
+                emit(e, { 0x74, 0x06 }); // je over the taken exit
+                emit_exit(jit, e, offset + cmd.j_offset);
+                emit_exit(jit, e, offset + op.in.length);
+                ++n_ops;
+                break;
+            }
+
+            auto cursor = e.cursor;
+
+            if (!op.exec || !emit_op(e, op, offset))
+            {
+                // leave the instruction to the interpreter
+                e.cursor = cursor;
+                if (!n_ops)
+                {
+                    return false;
+                }
+
+                emit_exit(jit, e, offset);
+                break;
+            }
+
+            ++n_ops;
+            alu_set |= is_alu(OP::get_form(op));
+            offset = offset + op.in.length;
+        }
+
+        block.code = e.begin;
+        jit.code_size = (u32)(e.cursor - jit.code);
+        ++jit.n_compiled;
+
+        patch_exits(jit);
+
+        return true;
+    }
+
+
+    static void run(CpuState& cpu, u8* data, u32 size)
+    {
+        CACHE::OpCache cache{};
+        if (!CACHE::create(cache, size))
+        {
+            assert(false);
+            return;
+        }
+
+        Jit jit{};
+        if (!create(jit, size))
+        {
+            assert(false);
+            CACHE::destroy(cache);
+            return;
+        }
+
+        GuestState state{};
+
+        bool block_start = true;
+        int offset = 0;
+
+        while (offset >= 0 && offset < size)
+        {
+            if (block_start)
+            {
+                auto& block = jit.blocks[offset];
+
+                if (!block.code && !block.no_jit && ++block.count >= HOT_COUNT)
+                {
+                    block.no_jit = !compile(jit, cache, data, size, offset);
+                }
+
+                if (block.code)
+                {
+                    to_guest(cpu, state);
+                    auto next = ((block_f)block.code)(&state);
+                    from_guest(cpu, state);
+
+                    // the interpreter runs the instruction that missed, up to the next jump
+                    // a block entered at that ip would miss again
+                    if (next & MISS)
+                    {
+                        next &= ~MISS;
+                        block_start = false;
+                    }
+
+                    if constexpr (TRACE)
+                    {
+                        printf("jit 0x%x -> 0x%x\n", offset, next);
+                    }
+
+                    cpu.IP = (u16)next;
+                    offset = next;
+                    continue;
+                }
+            }
+
+            auto& op = CACHE::get_op(cache, data, offset);
+            if (!op.exec)
+            {
+                break;
+            }
+
+            OP::execute(cpu, op);
+
+            REG::print_trace(cpu);
+
+            block_start = op.sets_ip;
+            offset = REG::ip(cpu);
+        }
+
+        if constexpr (TRACE)
+        {
+            printf("\njit blocks: %u (%u bytes)\n", jit.n_compiled, jit.code_size);
+        }
+
+        destroy(jit);
+        CACHE::destroy(cache);
+    }
+}
@@ -0,0 +1,19 @@
+; a hot loop whose loads miss in compiled code
+; assembled to jit_miss, the final registers of every engine must match
+
+bits 16
+
+; commits pages 0 and 1, [0x0FFF] straddles them
+mov word [0x0FFE], 1
+mov word [0x1000], 2
+
+mov cx, 3
+mov bx, 0x0FFF
+
+; the word at bx straddles two pages and page 3 is never committed
+loop:
+mov ax, [bx]
+mov dx, [0x3000]
+add si, 1
+sub cx, 1
+jnz loop
@@ -3,6 +3,8 @@
 #include <cassert>
 #include <cstdlib>
 #include <cstring>
+#include <algorithm>
+#include <atomic>
 
 namespace fs = std::filesystem;
 
@@ -21,1951 +23,3947 @@ using f64 = double;
 using cstr = const char*;
 
 
-namespace Bytes
+// build with -DSIM_SILENT to strip the per-instruction trace and disassembly
+#ifdef SIM_SILENT
+constexpr bool TRACE = false;
+#else
+constexpr bool TRACE = true;
+#endif
+
+
+#include "../lib/bytes.hpp"
+
+
+namespace MEMORY
 {
-    class Buffer
+    constexpr u32 SIZE = 1024 * 1024;
+    constexpr u32 ADDR_MASK = SIZE - 1;
+
+    constexpr u32 PAGE_SIZE = 4 * 1024;
+    constexpr u32 PAGE_MASK = PAGE_SIZE - 1;
+    constexpr u32 PAGE_SHIFT = 12;
+    constexpr u32 N_PAGES = SIZE / PAGE_SIZE;
+    constexpr u32 N_DIRTY = N_PAGES / 64;
+
+
+    // 1 MB of physical addresses
+    // a page is allocated on its first write, reads from the others are 0
+    class Memory
     {
     public:
-        u32 size = 0;
-        u8* data = nullptr;
+        u8* pages[N_PAGES] = { 0 };
+        u32 n_pages = 0;
+
+        // snapshot the clean pages match, 0 when they are all zero
+        u32 base_id = 0;
+
+        // bit per page written since the last reset, snapshot or restore
+        u64 dirty[N_DIRTY] = { 0 };
+    };
+
+
+    // copy of the committed pages of a Memory
+    class Snapshot
+    {
+    public:
+        u8* pages[N_PAGES] = { 0 };
+        u32 n_pages = 0;
+
+        u32 id = 0;
     };
 
 
-    static void destroy(Buffer& buffer)
+    static void free_pages(u8** pages, u32& n_pages)
     {
-        if (buffer.data)
+        for (u32 i = 0; i < N_PAGES; ++i)
         {
-            std::free(buffer.data);
+            if (pages[i])
+            {
+                std::free(pages[i]);
+                pages[i] = nullptr;
+            }
         }
+
+        n_pages = 0;
     }
 
 
-    static bool create(Buffer& buffer, u32 size)
+    static void destroy(Memory& mem)
     {
-        assert(!buffer.data);
-        assert(size);
-        
-        if (buffer.data || !size)
-        {
-            return false;
-        }
+        free_pages(mem.pages, mem.n_pages);
+
+        memset(mem.dirty, 0, sizeof(mem.dirty));
+        mem.base_id = 0;
+    }
+
+
+    static void destroy(Snapshot& snap)
+    {
+        free_pages(snap.pages, snap.n_pages);
+
+        snap.id = 0;
+    }
+
 
-        buffer.data = (u8*)std::malloc(size);
-        if (!buffer.data)
+    static u8* get_page(Memory const& mem, u32 addr)
+    {
+        return mem.pages[(addr & ADDR_MASK) >> PAGE_SHIFT];
+    }
+
+
+    // the page of a write
+    static u8* commit(Memory& mem, u32 addr)
+    {
+        auto id = (addr & ADDR_MASK) >> PAGE_SHIFT;
+
+        auto& page = mem.pages[id];
+        if (!page)
         {
-            return false;
+            page = (u8*)std::calloc(PAGE_SIZE, 1);
+            assert(page);
+
+            mem.n_pages += page != nullptr;
         }
 
-        return true;
+        mem.dirty[id / 64] |= 1ull << (id % 64);
+
+        return page;
     }
 
 
-    static Buffer read(fs::path const& path)
+    static u8 read8(Memory const& mem, u32 addr)
     {
-        Buffer buffer;
+        auto page = get_page(mem, addr);
+
+        return page ? page[addr & PAGE_MASK] : 0;
+    }
 
-        auto size = fs::file_size(path);
-        if (size == 0 || !create(buffer, size))
+
+    static void write8(Memory& mem, u32 addr, u8 v)
+    {
+        auto page = commit(mem, addr);
+        if (page)
         {
-            assert(false);
-            return buffer;
+            page[addr & PAGE_MASK] = v;
         }
+    }
 
-        std::ifstream file(path, std::ios::binary);
-        if (!file.is_open())
+
+    // little endian, a word can straddle two pages
+    static int read(Memory const& mem, u32 addr, int w)
+    {
+        if (!w)
         {
-            assert(false);
-            destroy(buffer);
-            return buffer;
+            return read8(mem, addr);
         }
 
-        file.read((char*)buffer.data, size);
-        buffer.size = size;
+        auto page = get_page(mem, addr);
+        if (page && (addr & PAGE_MASK) != PAGE_MASK)
+        {
+            return *(u16*)(page + (addr & PAGE_MASK));
+        }
 
-        file.close();
-        return buffer;
+        return read8(mem, addr) | (read8(mem, addr + 1) << 8);
     }
 
-}
 
+    static void write(Memory& mem, u32 addr, int w, int v)
+    {
+        if (!w)
+        {
+            write8(mem, addr, (u8)v);
+            return;
+        }
 
-namespace REG
-{
-    constexpr int HI_8 = 0b1111'1111'0000'0000;
-    constexpr int LOW_8 = 0b0000'0000'1111'1111;
-    constexpr int ZF = 0b0000'0000'0000'0001;
-    constexpr int SF = 0b0000'0000'0000'0010;
-    constexpr int PF = 0b0000'0000'0000'0100;
-    constexpr int CF = 0b0000'0000'0000'1000;
+        auto page = commit(mem, addr);
+        if (page && (addr & PAGE_MASK) != PAGE_MASK)
+        {
+            *(u16*)(page + (addr & PAGE_MASK)) = (u16)v;
+            return;
+        }
 
-    static u16 AX = 0;
-    static u16 BX = 0;
-    static u16 CX = 0;
-    static u16 DX = 0;
-    static u16 SP = 0;
-    static u16 BP = 0;
-    static u16 SI = 0;
-    static u16 DI = 0;
-    static u16 IP = 0;
+        write8(mem, addr, (u8)v);
+        write8(mem, addr + 1, (u8)(v >> 8));
+    }
+
+
+    // bytes to the end of the page
+    static u32 get_room(u32 addr)
+    {
+        return PAGE_SIZE - (addr & PAGE_MASK);
+    }
 
-    static u16 ERR = 0;
 
-    static u16 FLAGS = 0;
+    // memmove in page sized chunks, ranges must not wrap around 1 MB
+    static void copy(Memory& mem, u32 dst, u32 src, u32 n)
+    {
+        assert(src + n <= SIZE && dst + n <= SIZE);
 
-    static u8 MEM[100000] = { 0 };
+        auto const move = [&](u32 d, u32 s, u32 len)
+        {
+            auto src_page = get_page(mem, s);
+            if (!src_page && !get_page(mem, d))
+            {
+                return;
+            }
 
-    static char trace_reg[20] = { 0 };
-    static char trace_ip[20] = { 0 };
-    static char trace_flags[20] = { 0 };
+            auto dst_page = commit(mem, d);
+            if (!dst_page)
+            {
+                return;
+            }
 
+            if (src_page)
+            {
+                memmove(dst_page + (d & PAGE_MASK), src_page + (s & PAGE_MASK), len);
+            }
+            else
+            {
+                memset(dst_page + (d & PAGE_MASK), 0, len);
+            }
+        };
 
-    static int ax() { return (int)AX; }
-    static int bx() { return (int)BX; }
-    static int cx() { return (int)CX; }
-    static int dx() { return (int)DX; }    
+        if (dst <= src)
+        {
+            while (n)
+            {
+                auto len = std::min({ n, get_room(src), get_room(dst) });
+                move(dst, src, len);
+                dst += len;
+                src += len;
+                n -= len;
+            }
+        }
+        else
+        {
+            // chunks from the end, each one ends at a page boundary or at the end
+            while (n)
+            {
+                auto len = std::min({ n, ((src + n - 1) & PAGE_MASK) + 1, ((dst + n - 1) & PAGE_MASK) + 1 });
+                n -= len;
+                move(dst + n, src + n, len);
+            }
+        }
+    }
 
-    static int ah() { return AX >> 8; }
-    static int bh() { return BX >> 8; }
-    static int ch() { return CX >> 8; }
-    static int dh() { return DX >> 8; }
 
-    static int al() { return AX & LOW_8; }
-    static int bl() { return BX & LOW_8; }
-    static int cl() { return CX & LOW_8; }
-    static int dl() { return DX & LOW_8; }
+    static void fill(Memory& mem, u32 dst, u8 v, u32 n)
+    {
+        assert(dst + n <= SIZE);
 
-    static int sp() { return (int)SP; }
-    static int bp() { return (int)BP; }
-    static int si() { return (int)SI; }
-    static int di() { return (int)DI; }
+        while (n)
+        {
+            auto len = std::min(n, get_room(dst));
 
-    static int ip() { return (int)IP; }
+            // zeros only touch committed pages
+            auto page = (v || get_page(mem, dst)) ? commit(mem, dst) : nullptr;
+            if (page)
+            {
+                memset(page + (dst & PAGE_MASK), v, len);
+            }
 
-    static int zf() { return FLAGS & ZF; }
+            dst += len;
+            n -= len;
+        }
+    }
 
 
-    static cstr get_flags_str()
+    // index of the first byte equal to v, -1 when there is none
+    static int find(Memory const& mem, u32 addr, u8 v, u32 n)
     {
-        switch (FLAGS)
+        assert(addr + n <= SIZE);
+
+        u32 i = 0;
+        while (i < n)
         {
-        case 0: return " ";
-        case ZF: return "Z";
-        case SF: return "S";
-        case PF: return "P";
-        case ZF | SF: return "ZS";
-        case ZF | PF: return "PZ";
-        case SF | PF: return "PS";
-        case ZF | SF | PF: return "PZS"; 
+            auto len = std::min(n - i, get_room(addr + i));
+
+            auto page = get_page(mem, addr + i);
+            if (!page)
+            {
+                if (!v)
+                {
+                    return (int)i;
+                }
+            }
+            else
+            {
+                auto begin = page + ((addr + i) & PAGE_MASK);
+                auto found = (u8 const*)memchr(begin, v, len);
+                if (found)
+                {
+                    return (int)(i + (found - begin));
+                }
+            }
+
+            i += len;
         }
 
-        return " ";
+        return -1;
     }
 
 
-    static void set_flags(u16 reg)
+    // n values at seg + (u16)(offset + i * stride), offsets wrap at 64k
+    // value i is v + i * v_step
+    static void write_strided(Memory& mem, u32 seg, u16 offset, u16 stride, int w, u16 v, u16 v_step, u32 n)
     {
-        auto old = get_flags_str();
-
-        FLAGS = 0;
+        u32 size = w ? 2 : 1;
+        u32 bytes = n * size;
 
-        if (reg == 0)
+        // a repeated byte over contiguous bytes is a fill
+        if (!v_step && stride == size && (!w || (v & 0xFF) == (v >> 8)) && offset + bytes <= 0x10000 && seg + offset + bytes <= SIZE)
         {
-            FLAGS |= ZF;
+            fill(mem, seg + offset, (u8)v, bytes);
+            return;
         }
-        else if (reg & 0b1000'0000'0000'0000)
+
+        for (u32 i = 0; i < n; ++i)
         {
-            FLAGS |= SF;
+            write(mem, (seg + offset) & ADDR_MASK, w, v);
+            offset += stride;
+            v += v_step;
         }
-        
-        snprintf(trace_flags, sizeof(trace_flags), "flags:%s->%s", old, get_flags_str());
     }
 
 
-    static void set_z_flag(u16 diff) 
+    // sum of n values at seg + (u16)(offset + i * stride), last is value n - 1
+    static u16 sum_strided(Memory const& mem, u32 seg, u16 offset, u16 stride, int w, u32 n, u16& last)
     {
-        auto old = get_flags_str();
+        u16 sum = 0;
+        last = 0;
 
-        if (!diff)
+        for (u32 i = 0; i < n; ++i)
         {
-            FLAGS |= ZF;
+            last = (u16)read(mem, (seg + offset) & ADDR_MASK, w);
+            sum += last;
+            offset += stride;
         }
 
-        snprintf(trace_flags, sizeof(trace_flags), "flags:%s->%s", old, get_flags_str());
+        return sum;
     }
 
 
-    static void print_trace()
+    // calls func(page id) for every dirty page and clears the bitmap
+    template <class FUNC>
+    static void for_each_dirty(Memory& mem, FUNC const& func)
     {
-        if (strlen(trace_reg))
+        for (u32 i = 0; i < N_DIRTY; ++i)
         {
-            printf(" ; %s", trace_reg);
-            memset(trace_reg, 0, sizeof(trace_reg));
+            auto bits = mem.dirty[i];
+            while (bits)
+            {
+                func(i * 64 + (u32)__builtin_ctzll(bits));
+                bits &= bits - 1;
+            }
+
+            mem.dirty[i] = 0;
         }
+    }
 
-        if (strlen(trace_ip))
+
+    // all zero, touching only the pages written since the last reset
+    static void reset(Memory& mem)
+    {
+        if (mem.base_id)
         {
-            printf(" %s", trace_ip);
-            memset(trace_ip, 0, sizeof(trace_ip));
+            // clean pages hold a snapshot
+            destroy(mem);
+            return;
         }
 
-        if (strlen(trace_flags))
+        for_each_dirty(mem, [&](u32 id)
         {
-            printf(" %s", trace_flags);
-            memset(trace_flags, 0, sizeof(trace_flags));
-        }
+            memset(mem.pages[id], 0, PAGE_SIZE);
+        });
     }
 
 
-    static void print_all()
+    // pages that were never written compare as zero
+    static bool equal(Memory const& a, Memory const& b)
     {
-        auto const print = [](cstr str, int val){ printf("%s: 0x%04x (%d)\n", str, val, val); };
+        static u8 const zero[PAGE_SIZE] = { 0 };
+
+        for (u32 i = 0; i < N_PAGES; ++i)
+        {
+            auto pa = a.pages[i] ? a.pages[i] : zero;
+            auto pb = b.pages[i] ? b.pages[i] : zero;
 
-        print("ax", ax());
-        print("bx", bx());
-        print("cx", cx());
-        print("dx", dx());
-        print("sp", sp());
-        print("bp", bp());
-        print("si", si());
-        print("di", di());
-        print("ip", ip());
+            if (pa != pb && memcmp(pa, pb, PAGE_SIZE) != 0)
+            {
+                return false;
+            }
+        }
 
-        printf("flags: %s\n", get_flags_str());
+        return true;
     }
-    
-    
-    static void set_ip(int v)
+
+
+    static u32 next_snapshot_id()
     {
-        int old = IP;
-        IP = (u16)v;
-        
-        snprintf(trace_ip, sizeof(trace_ip), "ip:0x%x->0x%x", old, v);
+        static std::atomic<u32> id = 0;
+
+        return ++id;
+    }
+
+
+    // mem becomes the base of its snapshot
+    static bool snapshot(Snapshot& snap, Memory& mem)
+    {
+        for (u32 i = 0; i < N_PAGES; ++i)
+        {
+            auto& page = snap.pages[i];
+
+            if (!mem.pages[i])
+            {
+                if (page)
+                {
+                    std::free(page);
+                    page = nullptr;
+                    --snap.n_pages;
+                }
+
+                continue;
+            }
+
+            if (!page)
+            {
+                page = (u8*)std::malloc(PAGE_SIZE);
+                if (!page)
+                {
+                    assert(false);
+                    destroy(snap);
+                    return false;
+                }
+
+                ++snap.n_pages;
+            }
+
+            memcpy(page, mem.pages[i], PAGE_SIZE);
+        }
+
+        snap.id = next_snapshot_id();
+
+        memset(mem.dirty, 0, sizeof(mem.dirty));
+        mem.base_id = snap.id;
+
+        return true;
     }
 
 
-    static void reset()
+    // copies back only the dirty pages when mem was last based on snap
+    static void restore(Memory& mem, Snapshot const& snap)
     {
-        AX = 0;
-        BX = 0;
-        CX = 0;
-        DX = 0;
-        SP = 0;
-        BP = 0;
-        SI = 0;
-        DI = 0;
-        IP = 0;
+        assert(snap.id);
+
+        if (mem.base_id == snap.id)
+        {
+            for_each_dirty(mem, [&](u32 id)
+            {
+                if (snap.pages[id])
+                {
+                    memcpy(mem.pages[id], snap.pages[id], PAGE_SIZE);
+                }
+                else
+                {
+                    memset(mem.pages[id], 0, PAGE_SIZE);
+                }
+            });
+
+            return;
+        }
+
+        reset(mem);
+
+        for (u32 i = 0; i < N_PAGES; ++i)
+        {
+            if (!snap.pages[i])
+            {
+                continue;
+            }
+
+            auto page = commit(mem, i << PAGE_SHIFT);
+            if (page)
+            {
+                memcpy(page, snap.pages[i], PAGE_SIZE);
+            }
+        }
 
-        memset(MEM, 0, sizeof(MEM));
+        memset(mem.dirty, 0, sizeof(mem.dirty));
+        mem.base_id = snap.id;
     }
+}
+
+
+namespace REG
+{
+    constexpr int HI_8 = 0b1111'1111'0000'0000;
+    constexpr int LOW_8 = 0b0000'0000'1111'1111;
+    constexpr int CF = 0b0000'0000'0000'0001;
+    constexpr int PF = 0b0000'0000'0000'0100;
+    constexpr int AF = 0b0000'0000'0001'0000;
+    constexpr int ZF = 0b0000'0000'0100'0000;
+    constexpr int SF = 0b0000'0000'1000'0000;
+    constexpr int DF = 0b0000'0100'0000'0000;
+    constexpr int OF = 0b0000'1000'0000'0000;
 
 
+    // ordered by w and reg_b3
     enum class Reg : int
     {
         al,
-        bl,
         cl,
         dl,
+        bl,
 
         ah,
-        bh,
         ch,
         dh,
+        bh,
 
         ax,
-        bx,
         cx,
         dx,
+        bx,
         
         sp,
         bp,
         si,
         di,
 
+        // ordered by sr
+        es,
+        cs,
+        ss,
+        ds,
+
         ip,
 
         none = -1
     };
 
 
-    Reg get_reg(int reg_b3, int w)
+    // last flag setting operation
+    enum class Alu : u8
     {
-        using R = REG::Reg;
-
-        if (w)
-        {
-            switch (reg_b3)
-            {
-            case 0: return R::ax;
-            case 1: return R::cx;
-            case 2: return R::dx;
-            case 3: return R::bx;
-            case 4: return R::sp;
-            case 5: return R::bp;
-            case 6: return R::si;
-            case 7: return R::di;
-            }
-        }
-        else
-        {
-            switch (reg_b3)
-            {
-            case 0: return R::al;
-            case 1: return R::cl;
-            case 2: return R::dl;
-            case 3: return R::bl;
-            case 4: return R::ah;
-            case 5: return R::ch;
-            case 6: return R::dh;
-            case 7: return R::bh;
-            }
-        }
-
-        return R::none;
-    }
+        none,
+        add,
+        sub
+    };
 
 
-    static cstr get_str(Reg r)
+    // one simulated machine, passed to every decoder and executor
+    class CpuState
     {
-        using R = REG::Reg;
+    public:
+        // ax, cx, dx, bx, sp, bp, si, di as indexed by reg_b3
+        // then es, cs, ss, ds as indexed by sr
+        u16 regs[12] = { 0 };
+        u16 IP = 0;
+
+        // flags are computed from the last ALU op when read
+        // FLAGS only holds them when alu is none, DF is always in FLAGS
+        u16 FLAGS = 0;
+        Alu alu = Alu::none;
+        u8 alu_w = 0;
+        u16 alu_dst = 0;
+        u16 alu_src = 0;
+        u16 alu_res = 0;
+
+        MEMORY::Memory MEM;
+
+        char trace_reg[20] = { 0 };
+        char trace_ip[20] = { 0 };
+        char trace_flags[24] = { 0 };
+        char trace_clocks[48] = { 0 };
+
+        // last register write, for RECORD
+        Reg written_reg = Reg::none;
+        u16 written_old = 0;
+        u16 written_new = 0;
+    };
 
-        switch (r)
-        {
-        case R::ax: return "ax";
-        case R::bx: return "bx";
-        case R::cx: return "cx";
-        case R::dx: return "dx";
-        
-        case R::ah: return "ah";
-        case R::bh: return "bh";
-        case R::ch: return "ch";
-        case R::dh: return "dh";
 
-        case R::al: return "al";
-        case R::bl: return "bl";
-        case R::cl: return "cl";
-        case R::dl: return "dl";
+    // registers in the order they are printed
+    constexpr Reg PRINT_ORDER[8] = { Reg::ax, Reg::bx, Reg::cx, Reg::dx, Reg::sp, Reg::bp, Reg::si, Reg::di };
+    constexpr Reg SEG_ORDER[4] = { Reg::es, Reg::cs, Reg::ss, Reg::ds };
 
-        case R::sp: return "sp";
-        case R::bp: return "bp";
-        case R::si: return "si";
-        case R::di: return "di";
+    constexpr int N_GENERAL = 8;
 
-        case R::ip: return "ip";
-        }
 
-        return "err";
+    static Reg get_reg(int reg_b3, int w)
+    {
+        return (Reg)((w ? (int)Reg::ax : 0) + reg_b3);
     }
 
 
-    static int get_value(Reg r)
+    static cstr get_str(Reg r)
     {
-        using R = REG::Reg;
-
-        switch (r)
+        constexpr cstr names[] = 
         {
-        case R::ax: return ax();
-        case R::bx: return bx();
-        case R::cx: return cx();
-        case R::dx: return dx();
-        
-        case R::ah: return ah();
-        case R::bh: return bh();
-        case R::ch: return ch();
-        case R::dh: return dh();
+            "al", "cl", "dl", "bl", "ah", "ch", "dh", "bh",
+            "ax", "cx", "dx", "bx", "sp", "bp", "si", "di",
+            "es", "cs", "ss", "ds",
+            "ip"
+        };
 
-        case R::al: return al();
-        case R::bl: return bl();
-        case R::cl: return cl();
-        case R::dl: return dl();
-
-        case R::sp: return sp();
-        case R::bp: return bp();
-        case R::si: return si();
-        case R::di: return di();
+        if ((int)r < 0 || (int)r > (int)Reg::ip)
+        {
+            return "err";
         }
 
-        return -1;
+        return names[(int)r];
     }
 
 
-    static u16& get_ref(Reg r)
+    static constexpr bool is_wide(Reg r) { return (int)r >= (int)Reg::ax; }
+
+    // index into regs of a 16 bit register or of the one holding an 8 bit register
+    static constexpr int get_index(Reg r) { return is_wide(r) ? (int)r - (int)Reg::ax : (int)r & 0b11; }
+
+    // where a register sits in regs, every width is read and written the same way
+    class Slot
     {
-        using R = REG::Reg;
+    public:
+        u8 index = 0;
+        u8 shift = 0;
+        u16 mask = 0;
+    };
 
-        switch (r)
-        {
-        case R::ax: return AX;
-        case R::bx: return BX;
-        case R::cx: return CX;
-        case R::dx: return DX;
 
-        case R::sp: return SP;
-        case R::bp: return BP;
-        case R::si: return SI;
-        case R::di: return DI;
-        }
+    // al, cl, dl, bl are the low bytes of ax, cx, dx, bx and ah, ch, dh, bh the high bytes
+    static constexpr Slot make_slot(int r)
+    {
+        Slot slot{};
+        slot.index = (u8)get_index((Reg)r);
+        slot.shift = is_wide((Reg)r) ? 0 : (u8)((r >> 2) * 8);
+        slot.mask = is_wide((Reg)r) ? 0xFFFF : 0xFF;
 
-        return ERR;
+        return slot;
     }
 
 
-    static void mov_reg_value(u16& reg, Reg name, int v)
+    static constexpr Slot SLOTS[(int)Reg::ip] =
     {
-        auto old = reg;
-        reg = (u16)v;        
-        snprintf(trace_reg, sizeof(trace_reg), "%s:0x%x->0x%x", get_str(name), old, reg);
-    }
+        make_slot(0), make_slot(1), make_slot(2), make_slot(3), make_slot(4), make_slot(5), make_slot(6), make_slot(7),
+        make_slot(8), make_slot(9), make_slot(10), make_slot(11), make_slot(12), make_slot(13), make_slot(14), make_slot(15),
+        make_slot(16), make_slot(17), make_slot(18), make_slot(19)
+    };
 
 
-    static void set_reg_value(u16& reg, Reg name, int v)
+    static int get_value(CpuState const& cpu, Reg r)
     {
-        mov_reg_value(reg, name, v);
-        set_flags(reg);
+        auto slot = SLOTS[(int)r];
+
+        return (cpu.regs[slot.index] >> slot.shift) & slot.mask;
     }
 
 
-    static void set_reg_value(Reg name, int v)
+    static int ip(CpuState const& cpu) { return (int)cpu.IP; }
+
+
+    static u16 get_mask(int w) { return w ? 0xFFFF : 0xFF; }
+
+
+    static bool is_even_parity(u16 v)
     {
-        set_reg_value(get_ref(name), name, v);
+        v &= LOW_8;
+        v ^= v >> 4;
+        v ^= v >> 2;
+        v ^= v >> 1;
+
+        return !(v & 1);
     }
-    
 
-    enum class MemReg : int
+
+    static u16 get_alu_flags(Alu alu, int w, u16 dst, u16 src, u16 res)
     {
-        m_bx_si,
-        m_bx_di,
-        m_bp_si,
-        m_bp_di,
-        m_si,
-        m_di,
-        m_bp,
-        m_bx,
+        u16 mask = get_mask(w);
+        u16 sign = w ? 0x8000 : 0x80;
 
-        none = -1
-    };
+        u16 flags = 0;
 
+        if (!(res & mask)) { flags |= ZF; }
+        if (res & sign) { flags |= SF; }
+        if (is_even_parity(res)) { flags |= PF; }
+        if ((dst ^ src ^ res) & 0x10) { flags |= AF; }
 
-    static cstr get_str(MemReg mr)
-    {
-        switch(mr)
+        switch (alu)
         {
-        case MemReg::m_bx_si: return "bx + si";
-        case MemReg::m_bx_di: return "bx + di";
-        case MemReg::m_bp_si: return "bp + si";
-        case MemReg::m_bp_di: return "bp + di";
-        case MemReg::m_si: return "si";
-        case MemReg::m_di: return "di";
-        case MemReg::m_bp: return "bp";
-        case MemReg::m_bx: return "bx";
+        case Alu::add:
+            if ((u32)dst + src > mask) { flags |= CF; }
+            if ((dst ^ res) & (src ^ res) & sign) { flags |= OF; }
+            break;
+
+        case Alu::sub:
+            if (src > dst) { flags |= CF; }
+            if ((dst ^ src) & (dst ^ res) & sign) { flags |= OF; }
+            break;
+
+        default:
+            break;
         }
 
-        return "err";
+        return flags;
     }
 
 
-    static MemReg get_mem_reg(int rm_b3, int mod_b2)
+    static u16 get_flags(CpuState const& cpu)
     {
-        if(rm_b3 == 0b110 && mod_b2 == 0b00)
+        if (cpu.alu == Alu::none)
         {
-            return MemReg::none;
+            return cpu.FLAGS;
         }
 
-        return (MemReg)rm_b3;
+        return get_alu_flags(cpu.alu, cpu.alu_w, cpu.alu_dst, cpu.alu_src, cpu.alu_res) | (cpu.FLAGS & DF);
     }
 
 
-    static int get_value(MemReg mr)
+    // string instructions only need DF
+    static bool df(CpuState const& cpu)
     {
-        switch(mr)
+        return cpu.FLAGS & DF;
+    }
+
+
+    // jumps only need ZF
+    static int zf(CpuState const& cpu)
+    {
+        if (cpu.alu == Alu::none)
         {
-        case MemReg::m_bx_si: return BX + SI;
-        case MemReg::m_bx_di: return BX + DI;
-        case MemReg::m_bp_si: return BP + SI;
-        case MemReg::m_bp_di: return BP + DI;
-        case MemReg::m_si: return SI;
-        case MemReg::m_di: return DI;
-        case MemReg::m_bp: return BP;
-        case MemReg::m_bx: return BX;
+            return cpu.FLAGS & ZF;
         }
 
-        return -1;
+        return (cpu.alu_res & get_mask(cpu.alu_w)) ? 0 : ZF;
     }
 
-    
-}
 
-
-namespace DATA
-{
-    class ByteArray
+    class FlagsStr
     {
     public:
-        u8* data = 0;
-        u32 length = 0;
+        char str[8] = { 0 };
     };
 
 
-    void print_binary(u8 value) 
+    // letters in the order of the listing_*.txt references
+    static FlagsStr get_flags_str(u16 flags)
     {
-        printf("[");
-        for (int i = 7; i >= 4; --i) 
-        {
-            printf("%d", (value >> i) & 1);
-        }
+        constexpr int n_flags = 7;
+        constexpr int bits[n_flags] = { CF, PF, AF, ZF, SF, OF, DF };
+        constexpr char letters[n_flags] = { 'C', 'P', 'A', 'Z', 'S', 'O', 'D' };
 
-        printf(" ");
+        FlagsStr res{};
 
-        for (int i = 3; i >= 0; --i) 
+        int len = 0;
+        for (int i = 0; i < n_flags; ++i)
         {
-            printf("%d", (value >> i) & 1);
+            if (flags & bits[i])
+            {
+                res.str[len++] = letters[i];
+            }
         }
-        printf("]");
+
+        return res;
+    }
+
+
+    static FlagsStr get_flags_str(CpuState const& cpu)
+    {
+        return get_flags_str(get_flags(cpu));
     }
 
 
-    static void print(ByteArray const& arr)
+    // records dst alu src and returns the result, flags wait until they are read
+    static u16 set_alu(CpuState& cpu, Alu alu, int w, int dst, int src)
     {
-        for (u32 i = 0; i < arr.length; ++i)
+        u16 old = 0;
+        if constexpr (TRACE)
         {
-            print_binary(arr.data[i]);
+            old = get_flags(cpu);
         }
 
-        printf(" ");
-    }
+        auto mask = get_mask(w);
 
+        cpu.alu = alu;
+        cpu.alu_w = (u8)w;
+        cpu.alu_dst = (u16)(dst & mask);
+        cpu.alu_src = (u16)(src & mask);
+        cpu.alu_res = (u16)((alu == Alu::add ? dst + src : dst - src) & mask);
 
-    class InstrData
-    {
-    public:
-        int opcode = -1;
-        int mod_b2 = -1;
-        int reg_b3 = -1;
-        int rm_b3 = -1;
-        int d_b1 = -1;
-        int w_b1 = -1;
-        int s_b1 = -1;
-        int displo_b8 = -1;
-        int disphi_b8 = -1;
-        int imlo_b8 = -1;
-        int imhi_b8 = -1;
-        int addrlo_b8 = -1;
-        int addrhi_b8 = -1;
-        int j_b8 = -1;
-
-        int disp_sz = 0;
-        int im_sz = 0;
-        int addr_sz = 0;
-
-        int offset_begin = 0;
-        int offset_end = 0;
+        if constexpr (TRACE)
+        {
+            auto flags = get_flags(cpu);
+            if (flags != old)
+            {
+                snprintf(cpu.trace_flags, sizeof(cpu.trace_flags), "flags:%s->%s", get_flags_str(old).str, get_flags_str(flags).str);
+            }
+        }
 
-        ByteArray bytes;
-    };
+        return cpu.alu_res;
+    }
 
 
-    static int get_disp_sz(int mod_b2, int rm_b3)
+    static void set_df(CpuState& cpu, bool df)
     {
-        if (mod_b2 == 0b00 && rm_b3 == 0b110)
+        u16 old = 0;
+        if constexpr (TRACE)
         {
-            return 2;
+            old = get_flags(cpu);
         }
 
-        switch (mod_b2)
+        if (df)
         {
-        case 0b00: return 0;
-        case 0b01: return 1;
-        case 0b10: return 2;
-        case 0b11: return 0;
+            cpu.FLAGS |= DF;
+        }
+        else
+        {
+            cpu.FLAGS &= ~DF;
         }
 
-        return 0;
+        if constexpr (TRACE)
+        {
+            auto flags = get_flags(cpu);
+            if (flags != old)
+            {
+                snprintf(cpu.trace_flags, sizeof(cpu.trace_flags), "flags:%s->%s", get_flags_str(old).str, get_flags_str(flags).str);
+            }
+        }
     }
 
 
-    static int get_w_sz(int w_b1)
+    static void print_trace(CpuState& cpu)
     {
-        if (w_b1)
+        if constexpr (!TRACE)
         {
-            return 2;
+            return;
         }
 
-        return 1;
-    }
+        auto sep = " ; ";
 
+        if (strlen(cpu.trace_clocks))
+        {
+            printf(" ; %s |", cpu.trace_clocks);
+            memset(cpu.trace_clocks, 0, sizeof(cpu.trace_clocks));
+            sep = " ";
+        }
 
-    static int get_disp_val(u8* disp, int disp_sz)
-    {
-        switch (disp_sz)
+        if (strlen(cpu.trace_reg))
         {
-        case 1: return (int)(*disp);            
-        case 2: return (int)(*disp) + (*(disp + 1) << 8);            
+            printf("%s%s", sep, cpu.trace_reg);
+            memset(cpu.trace_reg, 0, sizeof(cpu.trace_reg));
         }
 
-        return 0;
+        if (strlen(cpu.trace_ip))
+        {
+            printf(" %s", cpu.trace_ip);
+            memset(cpu.trace_ip, 0, sizeof(cpu.trace_ip));
+        }
+
+        if (strlen(cpu.trace_flags))
+        {
+            printf(" %s", cpu.trace_flags);
+            memset(cpu.trace_flags, 0, sizeof(cpu.trace_flags));
+        }
+
+        printf("\n");
     }
 
 
-    static void set_disp(InstrData& in, u8* disp, int disp_sz)
+    static void print_all(CpuState const& cpu)
     {
-        in.disp_sz = disp_sz;
-        in.displo_b8 = *disp;
+        auto const print = [](cstr str, int val){ printf("%s: 0x%04x (%d)\n", str, val, val); };
 
-        if (disp_sz == 2)
+        for (auto r : PRINT_ORDER)
         {
-            in.disphi_b8 = *(disp + 1);
+            print(get_str(r), get_value(cpu, r));
+        }
+
+        // segments are only printed once a program sets them
+        for (auto r : SEG_ORDER)
+        {
+            if (get_value(cpu, r))
+            {
+                print(get_str(r), get_value(cpu, r));
+            }
         }
-    }
 
+        print("ip", ip(cpu));
 
-    static void set_im_data(InstrData& in, u8* im, int im_sz)
+        printf("flags: %s\n", get_flags_str(cpu).str);
+    }
+    
+    
+    static void set_ip(CpuState& cpu, int v)
     {
-        in.im_sz = im_sz;
-        in.imlo_b8 = *im;
-
-        if (im_sz == 2)
+        int old = cpu.IP;
+        cpu.IP = (u16)v;
+        
+        if constexpr (TRACE)
         {
-            in.imhi_b8 = *(im + 1);
+            snprintf(cpu.trace_ip, sizeof(cpu.trace_ip), "ip:0x%x->0x%x", old, v);
         }
     }
 
 
-    static void set_addr(InstrData& in, u8* addr, int addr_sz)
+    // registers, flags and trace, memory is left as it is
+    static void reset_regs(CpuState& cpu)
     {
-        in.addr_sz = addr_sz;
-        in.addrlo_b8 = *addr;
+        memset(cpu.regs, 0, sizeof(cpu.regs));
+        cpu.IP = 0;
+        cpu.FLAGS = 0;
+        cpu.alu = Alu::none;
+        cpu.alu_w = 0;
+        cpu.alu_dst = 0;
+        cpu.alu_src = 0;
+        cpu.alu_res = 0;
 
-        if (addr_sz == 2)
-        {
-            in.imhi_b8 = *(addr + 1);
-        }
+        memset(cpu.trace_reg, 0, sizeof(cpu.trace_reg));
+        memset(cpu.trace_ip, 0, sizeof(cpu.trace_ip));
+        memset(cpu.trace_flags, 0, sizeof(cpu.trace_flags));
+        memset(cpu.trace_clocks, 0, sizeof(cpu.trace_clocks));
+
+        cpu.written_reg = Reg::none;
+        cpu.written_old = 0;
+        cpu.written_new = 0;
     }
 
 
-    static InstrData get_rm_r(u8* data, int offset)
+    static void reset(CpuState& cpu)
     {
-        InstrData in{};   
-
-        auto byte1 = data[offset];
-        auto byte2 = data[offset + 1];
+        reset_regs(cpu);
+        MEMORY::reset(cpu.MEM);
+    }
 
-        in.opcode = byte1 >> 2;
-        in.d_b1 = (byte1 & 0b0000'0010) >> 1;
-        in.w_b1 = byte1 & 0b0000'0001;
-        in.mod_b2 = byte2 >> 6;
-        in.reg_b3 = (byte2 & 0b00'111'000) >> 3;
-        in.rm_b3 = byte2 & 0b00'000'111;
 
-        auto disp_sz = get_disp_sz(in.mod_b2, in.rm_b3);
-        if (disp_sz)
+    // heap instances for running many machines side by side
+    static bool create(CpuState*& cpu)
+    {
+        // no pages to free in reset()
+        auto data = std::calloc(1, sizeof(CpuState));
+        if (!data)
         {
-            set_disp(in, data + offset + 2, disp_sz);
-        }        
+            assert(false);
+            return false;
+        }
 
-        in.offset_begin = offset;
-        in.offset_end = offset + 2 + disp_sz;
+        cpu = (CpuState*)data;
+        reset(*cpu);
 
-        REG::set_ip(in.offset_end);
+        return true;
+    }
 
-        in.bytes.data = data + offset;
-        in.bytes.length = in.offset_end - in.offset_begin;
 
-        return in;
+    static void destroy(CpuState*& cpu)
+    {
+        if (cpu)
+        {
+            MEMORY::destroy(cpu->MEM);
+            std::free(cpu);
+            cpu = nullptr;
+        }
     }
 
 
-    static InstrData get_im_rm(u8* data, int offset)
+    // golden image of a machine, restored between runs
+    class Snapshot
     {
-        InstrData in{};   
+    public:
+        u16 regs[12] = { 0 };
+        u16 IP = 0;
+        u16 FLAGS = 0;
 
-        auto byte1 = data[offset];
-        auto byte2 = data[offset + 1];
+        MEMORY::Snapshot mem;
+    };
 
-        in.opcode = byte1 >> 2;
-        in.w_b1 = byte1 & 0b0000'0001;
-        in.s_b1 = (byte1 & 0b0000'0010) >> 1;
-        in.mod_b2 = byte2 >> 6;
-        in.rm_b3 = byte2 & 0b00'000'111;
 
-        auto disp_sz = get_disp_sz(in.mod_b2, in.rm_b3);
-        if (disp_sz)
+    static bool create(Snapshot*& snap, CpuState& cpu)
+    {
+        auto data = std::calloc(1, sizeof(Snapshot));
+        if (!data)
         {
-            set_disp(in, data + offset + 2, disp_sz);
+            assert(false);
+            return false;
         }
 
-        auto im_sz = get_w_sz(in.w_b1 && !in.s_b1);
-        set_im_data(in, data + offset + 2 + disp_sz, im_sz);
+        snap = (Snapshot*)data;
 
-        in.offset_begin = offset;
-        in.offset_end = offset + 2 + disp_sz + im_sz;
+        memcpy(snap->regs, cpu.regs, sizeof(cpu.regs));
+        snap->IP = cpu.IP;
+        snap->FLAGS = get_flags(cpu);
+
+        if (!MEMORY::snapshot(snap->mem, cpu.MEM))
+        {
+            std::free(snap);
+            snap = nullptr;
+            return false;
+        }
 
-        REG::set_ip(in.offset_end);
+        return true;
+    }
 
-        in.bytes.data = data + offset;
-        in.bytes.length = in.offset_end - in.offset_begin;
 
-        return in;
+    static void destroy(Snapshot*& snap)
+    {
+        if (snap)
+        {
+            MEMORY::destroy(snap->mem);
+            std::free(snap);
+            snap = nullptr;
+        }
     }
 
 
-    static InstrData get_mov_im_rm(u8* data, int offset)
+    // as reset() to the state of the snapshot
+    // only the pages written since the last restore are copied
+    static void restore(CpuState& cpu, Snapshot const& snap)
     {
-        InstrData in{};   
+        reset_regs(cpu);
 
-        auto byte1 = data[offset];
-        auto byte2 = data[offset + 1];
+        memcpy(cpu.regs, snap.regs, sizeof(cpu.regs));
+        cpu.IP = snap.IP;
+        cpu.FLAGS = snap.FLAGS;
 
-        in.opcode = byte1 >> 1;
-        in.w_b1 = byte1 & 0b0000'0001;
-        in.mod_b2 = byte2 >> 6;
-        in.rm_b3 = byte2 & 0b00'000'111;
+        MEMORY::restore(cpu.MEM, snap.mem);
+    }
+
+
+    // same registers, ip, flags and memory
+    static bool equal(CpuState const& a, CpuState const& b)
+    {
+        return
+            memcmp(a.regs, b.regs, sizeof(a.regs)) == 0 &&
+            a.IP == b.IP &&
+            get_flags(a) == get_flags(b) &&
+            MEMORY::equal(a.MEM, b.MEM);
+    }
 
-        auto disp_sz = get_disp_sz(in.mod_b2, in.rm_b3);
-        if (disp_sz)
-        {
-            set_disp(in, data + offset + 2, disp_sz);
-        }
 
-        auto im_sz = get_w_sz(in.w_b1);
-        set_im_data(in, data + offset + 2 + disp_sz, im_sz);
+    // 8 bit writes report the 16 bit register holding them
+    static void mov_reg_value(CpuState& cpu, Reg name, int v)
+    {
+        auto slot = SLOTS[(int)name];
 
-        in.offset_begin = offset;
-        in.offset_end = offset + 2 + disp_sz + im_sz;
+        auto& reg = cpu.regs[slot.index];
+        auto old = reg;
 
-        REG::set_ip(in.offset_end);
+        reg = (u16)((reg & ~(slot.mask << slot.shift)) | ((v & slot.mask) << slot.shift));
 
-        in.bytes.data = data + offset;
-        in.bytes.length = in.offset_end - in.offset_begin;
+        cpu.written_reg = (Reg)((int)Reg::ax + get_index(name));
+        cpu.written_old = old;
+        cpu.written_new = reg;
 
-        return in;
+        if constexpr (TRACE)
+        {
+            snprintf(cpu.trace_reg, sizeof(cpu.trace_reg), "%s:0x%x->0x%x", get_str(cpu.written_reg), old, reg);
+        }
     }
 
 
-    static InstrData get_mov_im_r(u8* data, int offset)
+    enum class MemReg : int
     {
-        InstrData in{};   
+        m_bx_si,
+        m_bx_di,
+        m_bp_si,
+        m_bp_di,
+        m_si,
+        m_di,
+        m_bp,
+        m_bx,
 
-        auto byte1 = data[offset];
+        none = -1
+    };
 
-        in.opcode = byte1 >> 4;
-        in.w_b1 = (byte1 & 0b0000'1000) >> 3;
-        in.reg_b3 = byte1 & 0b0000'0111;
 
-        auto im_sz = get_w_sz(in.w_b1);
-        set_im_data(in, data + offset + 1, im_sz);
+    static cstr get_str(MemReg mr)
+    {
+        switch(mr)
+        {
+        case MemReg::m_bx_si: return "bx + si";
+        case MemReg::m_bx_di: return "bx + di";
+        case MemReg::m_bp_si: return "bp + si";
+        case MemReg::m_bp_di: return "bp + di";
+        case MemReg::m_si: return "si";
+        case MemReg::m_di: return "di";
+        case MemReg::m_bp: return "bp";
+        case MemReg::m_bx: return "bx";
+        }
 
-        in.offset_begin = offset;
-        in.offset_end = offset + 1 + im_sz;
+        return "err";
+    }
 
-        REG::set_ip(in.offset_end);
 
-        in.bytes.data = data + offset;
-        in.bytes.length = in.offset_end - in.offset_begin;
+    static MemReg get_mem_reg(int rm_b3, int mod_b2)
+    {
+        if(rm_b3 == 0b110 && mod_b2 == 0b00)
+        {
+            return MemReg::none;
+        }
 
-        return in;
+        return (MemReg)rm_b3;
     }
 
 
-    static InstrData get_mov_m_ac(u8* data, int offset)
+    static int get_value(CpuState const& cpu, MemReg mr)
     {
-        InstrData in{};   
+        switch(mr)
+        {
+        case MemReg::m_bx_si: return get_value(cpu, Reg::bx) + get_value(cpu, Reg::si);
+        case MemReg::m_bx_di: return get_value(cpu, Reg::bx) + get_value(cpu, Reg::di);
+        case MemReg::m_bp_si: return get_value(cpu, Reg::bp) + get_value(cpu, Reg::si);
+        case MemReg::m_bp_di: return get_value(cpu, Reg::bp) + get_value(cpu, Reg::di);
+        case MemReg::m_si: return get_value(cpu, Reg::si);
+        case MemReg::m_di: return get_value(cpu, Reg::di);
+        case MemReg::m_bp: return get_value(cpu, Reg::bp);
+        case MemReg::m_bx: return get_value(cpu, Reg::bx);
+        }
 
-        auto byte1 = data[offset];
+        return -1;
+    }
 
-        in.opcode = byte1 >> 1;
-        in.w_b1 = byte1 & 0b0000'0001;
 
-        auto addr_sz = get_w_sz(in.w_b1);
-        set_addr(in, data + offset + 1, addr_sz);
+    // bp based addresses are in the stack segment
+    static Reg get_seg(MemReg mr)
+    {
+        switch (mr)
+        {
+        case MemReg::m_bp_si:
+        case MemReg::m_bp_di:
+        case MemReg::m_bp: return Reg::ss;
+        default: return Reg::ds;
+        }
+    }
 
-        in.offset_begin = offset;
-        in.offset_end = offset + 1 + addr_sz;
 
-        REG::set_ip(in.offset_end);
+    // seg:offset, offsets wrap at 64k and addresses at 1 MB
+    static u32 get_address(CpuState const& cpu, Reg seg, int offset)
+    {
+        return (((u32)get_value(cpu, seg) << 4) + (u16)offset) & MEMORY::ADDR_MASK;
+    }
 
-        in.bytes.data = data + offset;
-        in.bytes.length = in.offset_end - in.offset_begin;
 
-        return in;
+    static u32 get_address(CpuState const& cpu, MemReg mr, int disp)
+    {
+        return get_address(cpu, get_seg(mr), get_value(cpu, mr) + disp);
     }
 
 
-    static InstrData get_im_ac(u8* data, int offset)
+    static int read_mem(CpuState const& cpu, u32 addr, int w)
     {
-        InstrData in{};   
+        return MEMORY::read(cpu.MEM, addr, w);
+    }
 
-        auto byte1 = data[offset];
 
-        in.opcode = byte1 >> 1;
-        in.w_b1 = byte1 & 0b0000'0001;
+    static void write_mem(CpuState& cpu, u32 addr, int w, int v)
+    {
+        MEMORY::write(cpu.MEM, addr, w, v);
+    }
 
-        auto im_sz = get_w_sz(in.w_b1);
-        set_im_data(in, data + offset + 1, im_sz);
+    
+}
 
-        in.offset_begin = offset;
-        in.offset_end = offset + 1 + im_sz;
 
-        REG::set_ip(in.offset_end);
+namespace DATA
+{
+    void print_binary(u8 value) 
+    {
+        printf("[");
+        for (int i = 7; i >= 4; --i) 
+        {
+            printf("%d", (value >> i) & 1);
+        }
 
-        in.bytes.data = data + offset;
-        in.bytes.length = in.offset_end - in.offset_begin;
+        printf(" ");
 
-        return in;
+        for (int i = 3; i >= 0; --i) 
+        {
+            printf("%d", (value >> i) & 1);
+        }
+        printf("]");
     }
 
 
-    static InstrData get_jump(u8* data, int offset)
+    // decoded instruction packed into 8 bytes
+    // fields that do not apply to an instruction are 0
+    class Instr
     {
-        InstrData in{};   
-
-        auto byte1 = data[offset];
+    public:
+        // first byte
+        u8 opcode;
 
-        in.opcode = byte1;
+        // ModRM fields, reg is also the register of mov im_r
+        u8 rm_b3 : 3;
+        u8 reg_b3 : 3;
+        u8 mod_b2 : 2;
 
-        in.j_b8 = data[offset + 1];
+        u8 w_b1 : 1;
+        u8 d_b1 : 1;
+        u8 disp_sz : 2;
+        u8 length : 4;
 
-        in.offset_begin = offset;
-        in.offset_end = offset + 2;
+        u8 im_sz : 2;
 
-        in.bytes.data = data + offset;
-        in.bytes.length = in.offset_end - in.offset_begin;
+        // 0 or the low bits of a rep prefix, 0b10 repne, 0b11 rep/repe
+        u8 rep_b2 : 2;
 
-        return in;
-    }
-}
+        // sign extended displacement, direct address or sign extended jump offset
+        u16 disp;
 
+        // immediate, sign extended when s is set
+        u16 im;
+    };
 
-namespace CMD
-{
-    using Reg = REG::Reg;
-    using MR = REG::MemReg;
+    static_assert(sizeof(Instr) == 8);
 
 
-    class Im2Reg
+    static void print(Instr const& in)
     {
-    public:
-        int src = -1;
-        Reg dst = Reg::none;        
-    };
+        print_binary(in.opcode);
 
+        if (in.length > 1)
+        {
+            print_binary((u8)((in.mod_b2 << 6) | (in.reg_b3 << 3) | in.rm_b3));
+        }
 
-    static void print(Im2Reg const& cmd, cstr op)
-    {
-        printf("%s %s, %d", op, REG::get_str(cmd.dst), cmd.src);
+        printf(" ");
     }
 
 
-    static Im2Reg get_im_r(DATA::InstrData const& in_data)
+    static constexpr int get_disp_sz(int mod_b2, int rm_b3)
     {
-        Im2Reg res{};
-
-        res.dst = REG::get_reg(in_data.rm_b3, in_data.w_b1);
-
-        if (in_data.im_sz == 1)
+        if (mod_b2 == 0b00 && rm_b3 == 0b110)
         {
-            res.src = in_data.imlo_b8;
+            return 2;
         }
-        else if (in_data.im_sz == 2)
+
+        switch (mod_b2)
         {
-            res.src = in_data.imlo_b8 + (in_data.imhi_b8 << 8);
+        case 0b00: return 0;
+        case 0b01: return 1;
+        case 0b10: return 2;
+        case 0b11: return 0;
         }
 
-        return res;
+        return 0;
     }
 
 
-    static Im2Reg get_mov_im_r(DATA::InstrData const& in_data)
+    static constexpr int get_w_sz(int w_b1)
     {
-        Im2Reg res{};
-
-        res.dst = REG::get_reg(in_data.reg_b3, in_data.w_b1);
-
-        if (in_data.im_sz == 1)
+        if (w_b1)
         {
-            res.src = in_data.imlo_b8;
+            return 2;
         }
-        else if (in_data.im_sz == 2)
+
+        return 1;
+    }
+
+
+    static u16 get_u16(u8* data, int size)
+    {
+        switch (size)
         {
-            res.src = in_data.imlo_b8 + (in_data.imhi_b8 << 8);
+        case 1: return data[0];
+        case 2: return data[0] + (data[1] << 8);
         }
 
-        return res;
+        return 0;
     }
 
 
-    class Reg2Reg
+    static void set_modrm(Instr& in, u8 byte2)
     {
-    public:
-        Reg src = Reg::none;
+        in.mod_b2 = byte2 >> 6;
+        in.reg_b3 = (byte2 & 0b00'111'000) >> 3;
+        in.rm_b3 = byte2 & 0b00'000'111;
+    }
+
+
+    static void set_disp(Instr& in, u8* disp)
+    {
+        in.disp_sz = get_disp_sz(in.mod_b2, in.rm_b3);
+        in.disp = get_u16(disp, in.disp_sz);
+
+        // disp8 is sign extended, a direct address is always 16 bits
+        if (in.disp_sz == 1)
+        {
+            in.disp = (u16)(i16)(i8)in.disp;
+        }
+    }
+
+
+    static void set_im(Instr& in, u8* im, int im_sz, bool sign_extend)
+    {
+        in.im_sz = im_sz;
+        in.im = get_u16(im, im_sz);
+
+        if (sign_extend && im_sz == 1)
+        {
+            in.im = (u16)(i16)(i8)in.im;
+        }
+    }
+
+
+    static Instr get_rm_r(u8* data, int offset)
+    {
+        Instr in{};
+
+        auto byte1 = data[offset];
+
+        in.opcode = byte1;
+        in.d_b1 = (byte1 & 0b0000'0010) >> 1;
+        in.w_b1 = byte1 & 0b0000'0001;
+
+        set_modrm(in, data[offset + 1]);
+        set_disp(in, data + offset + 2);
+
+        in.length = 2 + in.disp_sz;
+
+        return in;
+    }
+
+
+    // mov to or from a segment register, reg is sr and the operand is a word
+    static Instr get_mov_sr(u8* data, int offset)
+    {
+        auto in = get_rm_r(data, offset);
+        in.w_b1 = 1;
+
+        return in;
+    }
+
+
+    static Instr get_im_rm(u8* data, int offset)
+    {
+        Instr in{};
+
+        auto byte1 = data[offset];
+
+        in.opcode = byte1;
+        in.w_b1 = byte1 & 0b0000'0001;
+
+        auto s_b1 = (byte1 & 0b0000'0010) >> 1;
+
+        set_modrm(in, data[offset + 1]);
+        set_disp(in, data + offset + 2);
+        set_im(in, data + offset + 2 + in.disp_sz, get_w_sz(in.w_b1 && !s_b1), in.w_b1 && s_b1);
+
+        in.length = 2 + in.disp_sz + in.im_sz;
+
+        return in;
+    }
+
+
+    static Instr get_mov_im_rm(u8* data, int offset)
+    {
+        Instr in{};
+
+        auto byte1 = data[offset];
+
+        in.opcode = byte1;
+        in.w_b1 = byte1 & 0b0000'0001;
+
+        set_modrm(in, data[offset + 1]);
+        set_disp(in, data + offset + 2);
+        set_im(in, data + offset + 2 + in.disp_sz, get_w_sz(in.w_b1), false);
+
+        in.length = 2 + in.disp_sz + in.im_sz;
+
+        return in;
+    }
+
+
+    static Instr get_mov_im_r(u8* data, int offset)
+    {
+        Instr in{};
+
+        auto byte1 = data[offset];
+
+        in.opcode = byte1;
+        in.w_b1 = (byte1 & 0b0000'1000) >> 3;
+        in.reg_b3 = byte1 & 0b0000'0111;
+
+        set_im(in, data + offset + 1, get_w_sz(in.w_b1), false);
+
+        in.length = 1 + in.im_sz;
+
+        return in;
+    }
+
+
+    // the address is kept in disp
+    static Instr get_mov_m_ac(u8* data, int offset)
+    {
+        Instr in{};
+
+        auto byte1 = data[offset];
+
+        in.opcode = byte1;
+        in.w_b1 = byte1 & 0b0000'0001;
+        in.disp_sz = 2;
+        in.disp = get_u16(data + offset + 1, 2);
+
+        in.length = 3;
+
+        return in;
+    }
+
+
+    static Instr get_im_ac(u8* data, int offset)
+    {
+        Instr in{};
+
+        auto byte1 = data[offset];
+
+        in.opcode = byte1;
+        in.w_b1 = byte1 & 0b0000'0001;
+
+        set_im(in, data + offset + 1, get_w_sz(in.w_b1), false);
+
+        in.length = 1 + in.im_sz;
+
+        return in;
+    }
+
+
+    // one byte instructions
+    static Instr get_op1(u8* data, int offset)
+    {
+        Instr in{};
+
+        in.opcode = data[offset];
+        in.length = 1;
+
+        return in;
+    }
+
+
+    // movs, cmps, stos, lods and scas, the opcode follows an optional rep prefix
+    static Instr get_string(u8* data, int offset)
+    {
+        Instr in{};
+
+        auto byte1 = data[offset];
+
+        if (byte1 == 0b1111'0010 || byte1 == 0b1111'0011)
+        {
+            in.rep_b2 = byte1 & 0b0000'0011;
+            in.length = 1;
+
+            byte1 = data[offset + 1];
+        }
+
+        in.opcode = byte1;
+        in.w_b1 = byte1 & 0b0000'0001;
+        in.length += 1;
+
+        return in;
+    }
+
+
+    static Instr get_jump(u8* data, int offset)
+    {
+        Instr in{};
+
+        in.opcode = data[offset];
+        in.disp = (u16)(i16)(i8)data[offset + 1];
+
+        in.length = 2;
+
+        return in;
+    }
+
+
+    // push and pop of a register, the register is in the opcode
+    static Instr get_stack_r(u8* data, int offset)
+    {
+        Instr in{};
+
+        auto byte1 = data[offset];
+
+        in.opcode = byte1;
+        in.w_b1 = 1;
+        in.reg_b3 = byte1 & 0b0000'0111;
+        in.length = 1;
+
+        return in;
+    }
+
+
+    // push and pop of a segment register, 0b000'sr'11x
+    static Instr get_stack_sr(u8* data, int offset)
+    {
+        Instr in{};
+
+        auto byte1 = data[offset];
+
+        in.opcode = byte1;
+        in.w_b1 = 1;
+        in.reg_b3 = (byte1 & 0b0001'1000) >> 3;
+        in.length = 1;
+
+        return in;
+    }
+
+
+    // call near, the 16 bit offset is kept in disp
+    static Instr get_call(u8* data, int offset)
+    {
+        Instr in{};
+
+        in.opcode = data[offset];
+        in.w_b1 = 1;
+        in.disp_sz = 2;
+        in.disp = get_u16(data + offset + 1, 2);
+
+        in.length = 3;
+
+        return in;
+    }
+
+
+    // ret with the bytes to release from the stack
+    static Instr get_ret_im(u8* data, int offset)
+    {
+        Instr in{};
+
+        in.opcode = data[offset];
+        in.w_b1 = 1;
+
+        set_im(in, data + offset + 1, 2, false);
+
+        in.length = 3;
+
+        return in;
+    }
+}
+
+
+namespace CMD
+{
+    using Reg = REG::Reg;
+    using MR = REG::MemReg;
+
+
+    class Im2Reg
+    {
+    public:
+        int src = -1;
+        Reg dst = Reg::none;        
+    };
+
+
+    static Im2Reg get_im_r(DATA::Instr const& in_data)
+    {
+        Im2Reg res{};
+
+        res.dst = REG::get_reg(in_data.rm_b3, in_data.w_b1);
+
+        res.src = in_data.im;
+
+        return res;
+    }
+
+
+    static Im2Reg get_mov_im_r(DATA::Instr const& in_data)
+    {
+        Im2Reg res{};
+
+        res.dst = REG::get_reg(in_data.reg_b3, in_data.w_b1);
+
+        res.src = in_data.im;
+
+        return res;
+    }
+
+
+    class Reg2Reg
+    {
+    public:
+        Reg src = Reg::none;
+        Reg dst = Reg::none;
+    };
+
+
+    static Reg2Reg get_r_r(DATA::Instr const& in_data)
+    {
+        Reg2Reg res{};
+
+        auto reg = REG::get_reg(in_data.reg_b3, in_data.w_b1);
+        auto rm = REG::get_reg(in_data.rm_b3, in_data.w_b1);
+
+        if (in_data.d_b1)
+        {
+            res.src = rm;
+            res.dst = reg;
+        }
+        else
+        {
+            res.src = reg;
+            res.dst = rm;
+        }
+
+        return res;
+    }
+
+
+    class Mem2Reg
+    {
+    public:
+        int src = -1;
         Reg dst = Reg::none;
     };
 
 
-    static void print(Reg2Reg const& cmd, cstr op)
+    static Mem2Reg get_m_r(DATA::Instr const& in_data)
+    {
+        Mem2Reg res{};
+
+        res.dst = REG::get_reg(in_data.reg_b3, in_data.w_b1);
+
+        assert(in_data.disp_sz == 2);
+        
+        res.src = in_data.disp;
+
+        return res;
+    }
+
+
+    class Reg2MemReg
+    {
+    public:
+        Reg src = Reg::none;
+        MR dst = MR::none;
+    };
+
+
+    static Reg2MemReg get_r_mr(DATA::Instr const& in_data)
+    {
+        Reg2MemReg res{};
+
+        res.src = REG::get_reg(in_data.reg_b3, in_data.w_b1);
+        res.dst = REG::get_mem_reg(in_data.rm_b3, in_data.mod_b2);
+
+        return res;
+    }
+
+
+    class RegMem2Reg
+    {
+    public:
+        MR src = MR::none;
+        Reg dst = Reg::none;
+    };
+
+
+    static RegMem2Reg get_rm_r(DATA::Instr const& in_data)
+    {
+        RegMem2Reg res{};
+
+        res.src = REG::get_mem_reg(in_data.rm_b3, in_data.mod_b2);
+        res.dst = REG::get_reg(in_data.reg_b3, in_data.w_b1);
+
+        return res;
+    }
+
+
+    class Im2Mem
+    {
+    public:
+        int src = -1;
+        int dst = -1;
+
+        int im_size = -1;
+    };
+
+
+    static Im2Mem get_im_m(DATA::Instr const& in_data)
+    {
+        Im2Mem res{};
+
+        assert(in_data.disp_sz == 2);
+
+        res.im_size = in_data.im_sz;
+        res.dst = in_data.disp;
+        res.src = in_data.im;
+
+        return res;
+    }
+
+
+    class Im2MemRegDisp
+    {
+    public:
+        int src = -1;
+        MR dst = MR::none;
+
+        int im_size = -1;
+        int disp = -1;
+    };
+
+
+    static Im2MemRegDisp get_im_rmd(DATA::Instr const& in_data)
+    {
+        Im2MemRegDisp res{};
+
+        res.dst = REG::get_mem_reg(in_data.rm_b3, in_data.mod_b2);
+
+        res.im_size = in_data.im_sz;
+        res.disp = (i16)in_data.disp;
+        res.src = in_data.im;
+
+        return res;
+    }
+
+
+    class Jump
+    {
+    public:
+        int j_offset = 0;
+    };
+   
+
+    static void print(Jump const& j, cstr op)
+    {
+        if constexpr (!TRACE)
+        {
+            return;
+        }
+
+        printf("%s $%d", op, j.j_offset);
+    }
+
+
+    static bool is_r_r(DATA::Instr const& in_data)
+    {
+        return 
+            in_data.mod_b2 == 0b11;
+    }
+
+
+    // the form handlers move words
+    static bool is_m_r(DATA::Instr const& in_data)
+    {
+        return
+            in_data.d_b1 == 1 &&
+            in_data.w_b1 == 1 &&
+            in_data.mod_b2 == 0b00 &&
+            in_data.rm_b3 == 0b110;
+    }
+
+
+    // [reg] without a displacement
+    static bool is_rm_r(DATA::Instr const& in_data)
+    {
+        return 
+            in_data.d_b1 == 1 &&
+            in_data.w_b1 == 1 &&
+            in_data.mod_b2 == 0b00 &&
+            in_data.rm_b3 != 0b110;
+    }
+
+
+    static bool is_r_rm(DATA::Instr const& in_data)
+    {
+        return 
+            in_data.d_b1 == 0 &&
+            in_data.w_b1 == 1 &&
+            in_data.mod_b2 == 0b00 &&
+            in_data.rm_b3 != 0b110;
+    }
+
+
+    static bool is_im_r(DATA::Instr const& in_data)
+    {
+        return
+            (in_data.opcode >> 2) == 0b100000 &&
+            in_data.mod_b2 == 0b11 &&
+            (in_data.im_sz == 1 || in_data.im_sz == 2);
+    }
+
+
+    static bool is_m(DATA::Instr const& in_data)
+    {
+        return
+            in_data.mod_b2 == 0b00 &&
+            in_data.rm_b3 == 0b110;
+    }
+
+
+    static bool is_rmd(DATA::Instr const& in_data)
+    {
+        return
+            (in_data.mod_b2 == 0b01 || in_data.mod_b2 == 0b10);
+    }
+
+
+    static Jump get_jump(DATA::Instr const& in_data)
+    {
+        Jump res{};
+
+        res.j_offset = (i16)in_data.disp + in_data.length;
+
+        return res;
+    }
+}
+
+
+using CpuState = REG::CpuState;
+
+
+// register or memory operand of an executor
+namespace OPERAND
+{
+    using R = REG::Reg;
+    using MR = REG::MemReg;
+
+
+    class Operand
+    {
+    public:
+        // none for memory
+        R reg = R::none;
+
+        u32 addr = 0;
+        int w = 0;
+
+        // how memory is printed, none for a direct address
+        MR mr = MR::none;
+        int disp = 0;
+        bool has_disp = false;
+    };
+
+
+    static bool is_mem(Operand const& op) { return op.reg == R::none; }
+
+
+    static Operand get_reg(R r)
+    {
+        Operand op{};
+        op.reg = r;
+        op.w = REG::is_wide(r);
+
+        return op;
+    }
+
+
+    // ds:offset
+    static Operand get_direct(CpuState const& cpu, int offset, int w)
+    {
+        Operand op{};
+        op.addr = REG::get_address(cpu, R::ds, offset);
+        op.w = w;
+        op.disp = offset;
+
+        return op;
+    }
+
+
+    static Operand get_mem(CpuState const& cpu, MR mr, int disp, int w, bool has_disp)
+    {
+        Operand op{};
+        op.addr = REG::get_address(cpu, mr, disp);
+        op.w = w;
+        op.mr = mr;
+        op.disp = disp;
+        op.has_disp = has_disp;
+
+        return op;
+    }
+
+
+    static Operand get_reg(DATA::Instr const& in_data)
+    {
+        return get_reg(REG::get_reg(in_data.reg_b3, in_data.w_b1));
+    }
+
+
+    // al or ax
+    static Operand get_ac(DATA::Instr const& in_data)
+    {
+        return get_reg(REG::get_reg(0b000, in_data.w_b1));
+    }
+
+
+    static Operand get_direct(CpuState const& cpu, DATA::Instr const& in_data)
+    {
+        return get_direct(cpu, in_data.disp, in_data.w_b1);
+    }
+
+
+    static Operand get_rm(CpuState const& cpu, DATA::Instr const& in_data)
+    {
+        if (in_data.mod_b2 == 0b11)
+        {
+            return get_reg(REG::get_reg(in_data.rm_b3, in_data.w_b1));
+        }
+
+        auto mr = REG::get_mem_reg(in_data.rm_b3, in_data.mod_b2);
+        if (mr == MR::none)
+        {
+            return get_direct(cpu, in_data);
+        }
+
+        return get_mem(cpu, mr, (i16)in_data.disp, in_data.w_b1, in_data.mod_b2 != 0b00);
+    }
+
+
+    static int read(CpuState const& cpu, Operand const& op)
+    {
+        return is_mem(op) ? REG::read_mem(cpu, op.addr, op.w) : REG::get_value(cpu, op.reg);
+    }
+
+
+    static void write(CpuState& cpu, Operand const& op, int v)
+    {
+        if (is_mem(op))
+        {
+            REG::write_mem(cpu, op.addr, op.w, v);
+        }
+        else
+        {
+            REG::mov_reg_value(cpu, op.reg, v);
+        }
+    }
+
+
+    // memory destinations are given a size
+    static void print(Operand const& op, bool dst)
+    {
+        if (!is_mem(op))
+        {
+            printf("%s", REG::get_str(op.reg));
+            return;
+        }
+
+        if (dst)
+        {
+            printf("%s ", op.w ? "word" : "byte");
+        }
+
+        if (op.mr == MR::none)
+        {
+            printf("[%d]", op.disp);
+        }
+        else if (op.has_disp)
+        {
+            printf("[%s %c %d]", REG::get_str(op.mr), op.disp < 0 ? '-' : '+', std::abs(op.disp));
+        }
+        else
+        {
+            printf("[%s]", REG::get_str(op.mr));
+        }
+    }
+
+
+    static void print(cstr name, Operand const& dst, Operand const& src)
+    {
+        if constexpr (!TRACE)
+        {
+            return;
+        }
+
+        printf("%s ", name);
+        print(dst, true);
+        printf(", ");
+        print(src, false);
+    }
+
+
+    static void print(cstr name, Operand const& dst, int im)
+    {
+        if constexpr (!TRACE)
+        {
+            return;
+        }
+
+        printf("%s ", name);
+        print(dst, true);
+        printf(", %d", im);
+    }
+}
+
+
+// add, sub and cmp in every operand form, cmp does not store the result
+namespace ALU
+{
+    using A = REG::Alu;
+    using Operand = OPERAND::Operand;
+
+
+    static void run(CpuState& cpu, A alu, bool store, Operand const& dst, int src)
+    {
+        auto res = REG::set_alu(cpu, alu, dst.w, OPERAND::read(cpu, dst), src);
+        if (store)
+        {
+            OPERAND::write(cpu, dst, res);
+        }
+    }
+
+
+    static void run(CpuState& cpu, A alu, cstr name, bool store, Operand const& dst, Operand const& src)
+    {
+        OPERAND::print(name, dst, src);
+        run(cpu, alu, store, dst, OPERAND::read(cpu, src));
+    }
+
+
+    static void run(CpuState& cpu, A alu, cstr name, bool store, Operand const& dst, int im)
+    {
+        OPERAND::print(name, dst, im);
+        run(cpu, alu, store, dst, im);
+    }
+
+
+    // d selects whether reg is the destination
+    static void rm_r(CpuState& cpu, DATA::Instr const& in_data, A alu, cstr name, bool store)
+    {
+        auto reg = OPERAND::get_reg(in_data);
+        auto rm = OPERAND::get_rm(cpu, in_data);
+
+        if (in_data.d_b1)
+        {
+            run(cpu, alu, name, store, reg, rm);
+        }
+        else
+        {
+            run(cpu, alu, name, store, rm, reg);
+        }
+    }
+
+
+    static void im_rm(CpuState& cpu, DATA::Instr const& in_data, A alu, cstr name, bool store)
+    {
+        run(cpu, alu, name, store, OPERAND::get_rm(cpu, in_data), in_data.im);
+    }
+
+
+    static void im_ac(CpuState& cpu, DATA::Instr const& in_data, A alu, cstr name, bool store)
+    {
+        run(cpu, alu, name, store, OPERAND::get_ac(in_data), in_data.im);
+    }
+}
+
+
+// the form functions are the pre-decoded entries of the threaded engine, all go through mov()
+namespace MOV
+{
+    using R = REG::Reg;
+    using Operand = OPERAND::Operand;
+
+
+    static void mov(CpuState& cpu, Operand const& dst, Operand const& src)
+    {
+        OPERAND::print("mov", dst, src);
+        OPERAND::write(cpu, dst, OPERAND::read(cpu, src));
+    }
+
+
+    static void mov(CpuState& cpu, Operand const& dst, int im)
+    {
+        OPERAND::print("mov", dst, im);
+        OPERAND::write(cpu, dst, im);
+    }
+
+
+    static void mov_r_r(CpuState& cpu, CMD::Reg2Reg const& cmd)
+    {
+        mov(cpu, OPERAND::get_reg(cmd.dst), OPERAND::get_reg(cmd.src));
+    }
+
+
+    static void mov_m_r(CpuState& cpu, CMD::Mem2Reg const& cmd)
+    {
+        mov(cpu, OPERAND::get_reg(cmd.dst), OPERAND::get_direct(cpu, cmd.src, REG::is_wide(cmd.dst)));
+    }
+
+
+    static void mov_r_rm(CpuState& cpu, CMD::Reg2MemReg const& cmd)
+    {
+        mov(cpu, OPERAND::get_mem(cpu, cmd.dst, 0, REG::is_wide(cmd.src), false), OPERAND::get_reg(cmd.src));
+    }
+
+
+    static void mov_rm_r(CpuState& cpu, CMD::RegMem2Reg const& cmd)
+    {
+        mov(cpu, OPERAND::get_reg(cmd.dst), OPERAND::get_mem(cpu, cmd.src, 0, REG::is_wide(cmd.dst), false));
+    }
+
+
+    static void mov_im_m(CpuState& cpu, CMD::Im2Mem const& cmd)
+    {
+        mov(cpu, OPERAND::get_direct(cpu, cmd.dst, cmd.im_size == 2), cmd.src);
+    }
+
+
+    static void mov_im_rmd(CpuState& cpu, CMD::Im2MemRegDisp const& cmd)
+    {
+        mov(cpu, OPERAND::get_mem(cpu, cmd.dst, cmd.disp, cmd.im_size == 2, true), cmd.src);
+    }
+
+
+    static void mov_im_r(CpuState& cpu, CMD::Im2Reg const& cmd)
+    {
+        mov(cpu, OPERAND::get_reg(cmd.dst), cmd.src);
+    }
+
+
+    // d selects whether reg is the destination
+    static void rm_r(CpuState& cpu, DATA::Instr const& in_data)
+    {
+        auto reg = OPERAND::get_reg(in_data);
+        auto rm = OPERAND::get_rm(cpu, in_data);
+
+        if (in_data.d_b1)
+        {
+            mov(cpu, reg, rm);
+        }
+        else
+        {
+            mov(cpu, rm, reg);
+        }
+    }
+
+
+    static void im_rm(CpuState& cpu, DATA::Instr const& in_data)
+    {
+        mov(cpu, OPERAND::get_rm(cpu, in_data), in_data.im);
+    }
+
+
+    // 0b1010'000w loads the accumulator, 0b1010'001w stores it
+    static void m_ac(CpuState& cpu, DATA::Instr const& in_data)
+    {
+        auto ac = OPERAND::get_ac(in_data);
+        auto m = OPERAND::get_direct(cpu, in_data);
+
+        if (in_data.opcode & 0b0000'0010)
+        {
+            mov(cpu, m, ac);
+        }
+        else
+        {
+            mov(cpu, ac, m);
+        }
+    }
+
+
+    // reg is the segment register, the operand is a word
+    static void sr(CpuState& cpu, DATA::Instr const& in_data)
+    {
+        auto sr = OPERAND::get_reg((R)((int)R::es + (in_data.reg_b3 & 0b11)));
+        auto rm = OPERAND::get_rm(cpu, in_data);
+
+        if (in_data.d_b1)
+        {
+            mov(cpu, sr, rm);
+        }
+        else
+        {
+            mov(cpu, rm, sr);
+        }
+    }
+
+
+    static void im_r(CpuState& cpu, DATA::Instr const& in_data)
+    {
+        mov_im_r(cpu, CMD::get_mov_im_r(in_data));
+    }
+}
+
+
+// the form functions are the pre-decoded entries of the threaded engine
+namespace ADD
+{
+    using A = REG::Alu;
+
+    static void add_im_r(CpuState& cpu, CMD::Im2Reg const& cmd)
+    {
+        ALU::run(cpu, A::add, "add", true, OPERAND::get_reg(cmd.dst), cmd.src);
+    }
+
+
+    static void add_r_r(CpuState& cpu, CMD::Reg2Reg const& cmd)
+    {
+        ALU::run(cpu, A::add, "add", true, OPERAND::get_reg(cmd.dst), OPERAND::get_reg(cmd.src));
+    }
+
+
+    static void rm_r(CpuState& cpu, DATA::Instr const& in_data)
+    {
+        ALU::rm_r(cpu, in_data, A::add, "add", true);
+    }
+
+
+    static void im_rm(CpuState& cpu, DATA::Instr const& in_data)
+    {
+        ALU::im_rm(cpu, in_data, A::add, "add", true);
+    }
+
+
+    static void im_ac(CpuState& cpu, DATA::Instr const& in_data)
+    {
+        ALU::im_ac(cpu, in_data, A::add, "add", true);
+    }
+}
+
+
+namespace SUB
+{
+    using A = REG::Alu;
+
+    static void r_r(CpuState& cpu, CMD::Reg2Reg const& cmd)
+    {
+        ALU::run(cpu, A::sub, "sub", true, OPERAND::get_reg(cmd.dst), OPERAND::get_reg(cmd.src));
+    }
+
+
+    static void im_r(CpuState& cpu, CMD::Im2Reg const& cmd)
+    {
+        ALU::run(cpu, A::sub, "sub", true, OPERAND::get_reg(cmd.dst), cmd.src);
+    }
+
+
+    static void rm_r(CpuState& cpu, DATA::Instr const& in_data)
+    {
+        ALU::rm_r(cpu, in_data, A::sub, "sub", true);
+    }
+
+
+    static void im_rm(CpuState& cpu, DATA::Instr const& in_data)
+    {
+        ALU::im_rm(cpu, in_data, A::sub, "sub", true);
+    }
+
+
+    static void im_ac(CpuState& cpu, DATA::Instr const& in_data)
+    {
+        ALU::im_ac(cpu, in_data, A::sub, "sub", true);
+    }
+}
+
+
+namespace CMP
+{
+    using A = REG::Alu;
+
+    static void r_r(CpuState& cpu, CMD::Reg2Reg const& cmd)
+    {
+        ALU::run(cpu, A::sub, "cmp", false, OPERAND::get_reg(cmd.dst), OPERAND::get_reg(cmd.src));
+    }
+
+
+    static void rm_r(CpuState& cpu, DATA::Instr const& in_data)
+    {
+        ALU::rm_r(cpu, in_data, A::sub, "cmp", false);
+    }
+
+
+    static void im_rm(CpuState& cpu, DATA::Instr const& in_data)
+    {
+        ALU::im_rm(cpu, in_data, A::sub, "cmp", false);
+    }
+
+
+    static void im_ac(CpuState& cpu, DATA::Instr const& in_data)
+    {
+        ALU::im_ac(cpu, in_data, A::sub, "cmp", false);
+    }
+}
+
+
+namespace JUMP
+{
+    static void jnz(CpuState& cpu, CMD::Jump const& cmd)
+    {
+        CMD::print(cmd, "jnz");
+        if (REG::zf(cpu))
+        {
+            REG::set_ip(cpu, REG::ip(cpu) + 2);
+        }
+        else
+        {
+            REG::set_ip(cpu, REG::ip(cpu) + cmd.j_offset);
+        }
+    }
+
+
+    static void jnz(CpuState& cpu, DATA::Instr const& in_data)
+    {
+        auto cmd = CMD::get_jump(in_data);
+        jnz(cpu, cmd);
+    }
+}
+
+
+namespace STRING
+{
+    using R = REG::Reg;
+    using A = REG::Alu;
+
+    // DATA::Instr::rep_b2
+    constexpr int REPNE = 0b10;
+    constexpr int REPE = 0b11;
+
+    // ds:si is the source and es:di the destination
+    constexpr int SEG_SIZE = 0x10000;
+
+
+    // registers of a string instruction while it runs
+    class Regs
+    {
+    public:
+        u16 si = 0;
+        u16 di = 0;
+        u16 cx = 0;
+
+        int w = 0;
+        int size = 1;
+        int step = 1;
+
+        // elements to run, cx when repeated
+        u32 count = 1;
+        bool rep = false;
+    };
+
+
+    static void print(DATA::Instr const& in, cstr op, bool cmp)
+    {
+        if constexpr (!TRACE)
+        {
+            return;
+        }
+
+        auto prefix = "";
+        if (in.rep_b2 == REPNE)
+        {
+            prefix = "repne ";
+        }
+        else if (in.rep_b2 == REPE)
+        {
+            prefix = cmp ? "repe " : "rep ";
+        }
+
+        printf("%s%s%c", prefix, op, in.w_b1 ? 'w' : 'b');
+    }
+
+
+    static Regs load(CpuState const& cpu, DATA::Instr const& in)
+    {
+        Regs s{};
+
+        s.si = (u16)REG::get_value(cpu, R::si);
+        s.di = (u16)REG::get_value(cpu, R::di);
+        s.cx = (u16)REG::get_value(cpu, R::cx);
+
+        s.w = in.w_b1;
+        s.size = in.w_b1 ? 2 : 1;
+        s.step = REG::df(cpu) ? -s.size : s.size;
+
+        s.rep = in.rep_b2 != 0;
+        s.count = s.rep ? s.cx : 1;
+
+        return s;
+    }
+
+
+    static void store(CpuState& cpu, Regs const& s, bool si, bool di)
+    {
+        if (si)
+        {
+            REG::mov_reg_value(cpu, R::si, s.si);
+        }
+
+        if (di)
+        {
+            REG::mov_reg_value(cpu, R::di, s.di);
+        }
+
+        if (s.rep)
+        {
+            REG::mov_reg_value(cpu, R::cx, s.cx);
+        }
+    }
+
+
+    // elements n run from addr
+    static void advance(u16& addr, Regs& s, u32 n)
+    {
+        addr = (u16)(addr + s.step * (int)n);
+    }
+
+
+    // lowest physical address of n elements starting at seg:addr
+    // -1 when they wrap around the segment or the address space
+    static int get_low(CpuState const& cpu, R seg, u16 addr, Regs const& s, u32 n)
+    {
+        int n_bytes = (int)n * s.size;
+        int low = s.step > 0 ? addr : addr + s.size - n_bytes;
+
+        if (low < 0 || low + n_bytes > SEG_SIZE)
+        {
+            return -1;
+        }
+
+        int base = REG::get_value(cpu, seg) << 4;
+
+        return base + low + n_bytes <= (int)MEMORY::SIZE ? base + low : -1;
+    }
+
+
+    static int read(CpuState const& cpu, R seg, u16 addr, int w)
+    {
+        return REG::read_mem(cpu, REG::get_address(cpu, seg, addr), w);
+    }
+
+
+    static void write(CpuState& cpu, R seg, u16 addr, int w, int v)
+    {
+        REG::write_mem(cpu, REG::get_address(cpu, seg, addr), w, v);
+    }
+
+
+    static void movs(CpuState& cpu, DATA::Instr const& in)
+    {
+        print(in, "movs", false);
+
+        auto s = load(cpu, in);
+        if (!s.count)
+        {
+            return;
+        }
+
+        int n_bytes = (int)s.count * s.size;
+        int src = get_low(cpu, R::ds, s.si, s, s.count);
+        int dst = get_low(cpu, R::es, s.di, s, s.count);
+
+        // stepping forward only differs from memmove when dst is just above src, backward when it is just below
+        bool hazard = s.step > 0 
+            ? dst > src && dst < src + n_bytes
+            : dst < src && dst + n_bytes > src;
+
+        if (src >= 0 && dst >= 0 && !hazard)
+        {
+            MEMORY::copy(cpu.MEM, dst, src, n_bytes);
+            advance(s.si, s, s.count);
+            advance(s.di, s, s.count);
+        }
+        else
+        {
+            for (u32 i = 0; i < s.count; ++i)
+            {
+                write(cpu, R::es, s.di, s.w, read(cpu, R::ds, s.si, s.w));
+                advance(s.si, s, 1);
+                advance(s.di, s, 1);
+            }
+        }
+
+        s.cx = 0;
+        store(cpu, s, true, true);
+    }
+
+
+    static void stos(CpuState& cpu, DATA::Instr const& in)
+    {
+        print(in, "stos", false);
+
+        auto s = load(cpu, in);
+        if (!s.count)
+        {
+            return;
+        }
+
+        auto ax = REG::get_value(cpu, R::ax);
+        int dst = get_low(cpu, R::es, s.di, s, s.count);
+
+        if (dst >= 0 && (!s.w || (ax & 0xFF) == (ax >> 8)))
+        {
+            MEMORY::fill(cpu.MEM, dst, ax & 0xFF, s.count * s.size);
+            advance(s.di, s, s.count);
+        }
+        else
+        {
+            for (u32 i = 0; i < s.count; ++i)
+            {
+                write(cpu, R::es, s.di, s.w, ax);
+                advance(s.di, s, 1);
+            }
+        }
+
+        s.cx = 0;
+        store(cpu, s, false, true);
+    }
+
+
+    // only the last element stays in the accumulator
+    static void lods(CpuState& cpu, DATA::Instr const& in)
+    {
+        print(in, "lods", false);
+
+        auto s = load(cpu, in);
+        if (!s.count)
+        {
+            return;
+        }
+
+        advance(s.si, s, s.count - 1);
+        REG::mov_reg_value(cpu, s.w ? R::ax : R::al, read(cpu, R::ds, s.si, s.w));
+        advance(s.si, s, 1);
+
+        s.cx = 0;
+        store(cpu, s, true, false);
+    }
+
+
+    // compares that run until the rep condition fails, returns the number run
+    // only the last compare sets the flags
+    template <class CMP_F>
+    static u32 compare(CpuState& cpu, DATA::Instr const& in, Regs const& s, CMP_F const& cmp)
+    {
+        int dst = 0;
+        int src = 0;
+
+        u32 i = 0;
+        while (i < s.count)
+        {
+            cmp(i, dst, src);
+            ++i;
+
+            if ((in.rep_b2 == REPE && dst != src) || (in.rep_b2 == REPNE && dst == src))
+            {
+                break;
+            }
+        }
+
+        REG::set_alu(cpu, A::sub, s.w, dst, src);
+
+        return i;
+    }
+
+
+    static void cmps(CpuState& cpu, DATA::Instr const& in)
+    {
+        print(in, "cmps", true);
+
+        auto s = load(cpu, in);
+        if (!s.count)
+        {
+            return;
+        }
+
+        auto n = compare(cpu, in, s, [&](u32 i, int& dst, int& src)
+        {
+            auto si = s.si;
+            auto di = s.di;
+            advance(si, s, i);
+            advance(di, s, i);
+
+            dst = read(cpu, R::ds, si, s.w);
+            src = read(cpu, R::es, di, s.w);
+        });
+
+        advance(s.si, s, n);
+        advance(s.di, s, n);
+        s.cx -= n;
+        store(cpu, s, true, true);
+    }
+
+
+    static void scas(CpuState& cpu, DATA::Instr const& in)
+    {
+        print(in, "scas", true);
+
+        auto s = load(cpu, in);
+        if (!s.count)
+        {
+            return;
+        }
+
+        auto acc = REG::get_value(cpu, s.w ? R::ax : R::al);
+
+        u32 n = 0;
+        int dst = get_low(cpu, R::es, s.di, s, s.count);
+
+        if (in.rep_b2 == REPNE && !s.w && s.step > 0 && dst >= 0)
+        {
+            // repne scasb searches forward for al
+            auto found = MEMORY::find(cpu.MEM, dst, acc, s.count);
+
+            n = found >= 0 ? (u32)found + 1 : s.count;
+
+            auto di = s.di;
+            advance(di, s, n - 1);
+            REG::set_alu(cpu, A::sub, s.w, acc, read(cpu, R::es, di, s.w));
+        }
+        else
+        {
+            n = compare(cpu, in, s, [&](u32 i, int& dst, int& src)
+            {
+                auto di = s.di;
+                advance(di, s, i);
+
+                dst = acc;
+                src = read(cpu, R::es, di, s.w);
+            });
+        }
+
+        advance(s.di, s, n);
+        s.cx -= n;
+        store(cpu, s, false, true);
+    }
+
+
+    static void clear_df(CpuState& cpu, DATA::Instr const&)
+    {
+        if constexpr (TRACE)
+        {
+            printf("cld");
+        }
+
+        REG::set_df(cpu, false);
+    }
+
+
+    static void set_df(CpuState& cpu, DATA::Instr const&)
+    {
+        if constexpr (TRACE)
+        {
+            printf("std");
+        }
+
+        REG::set_df(cpu, true);
+    }
+}
+
+
+// the stack is ss:sp and grows down a word at a time
+namespace STACK
+{
+    using R = REG::Reg;
+
+
+    static void push(CpuState& cpu, int v)
+    {
+        auto sp = REG::get_value(cpu, R::sp) - 2;
+
+        REG::mov_reg_value(cpu, R::sp, sp);
+        REG::write_mem(cpu, REG::get_address(cpu, R::ss, sp), 1, v);
+    }
+
+
+    static int pop(CpuState& cpu)
+    {
+        auto sp = REG::get_value(cpu, R::sp);
+        auto v = REG::read_mem(cpu, REG::get_address(cpu, R::ss, sp), 1);
+
+        REG::mov_reg_value(cpu, R::sp, sp + 2);
+
+        return v;
+    }
+
+
+    static void print(cstr op, R r)
+    {
+        if constexpr (TRACE)
+        {
+            printf("%s %s", op, REG::get_str(r));
+        }
+    }
+
+
+    static void push_r(CpuState& cpu, DATA::Instr const& in_data)
+    {
+        auto r = REG::get_reg(in_data.reg_b3, 1);
+        print("push", r);
+
+        // the 8086 pushes sp after it is decremented
+        auto v = REG::get_value(cpu, r) - (r == R::sp ? 2 : 0);
+        push(cpu, v);
+    }
+
+
+    static void pop_r(CpuState& cpu, DATA::Instr const& in_data)
     {
-        printf("%s %s, %s", op, REG::get_str(cmd.dst), REG::get_str(cmd.src));
+        auto r = REG::get_reg(in_data.reg_b3, 1);
+        print("pop", r);
+
+        REG::mov_reg_value(cpu, r, pop(cpu));
     }
 
 
-    static Reg2Reg get_r_r(DATA::InstrData const& in_data)
+    static void push_sr(CpuState& cpu, DATA::Instr const& in_data)
     {
-        Reg2Reg res{};
-
-        auto reg = REG::get_reg(in_data.reg_b3, in_data.w_b1);
-        auto rm = REG::get_reg(in_data.rm_b3, in_data.w_b1);
-
-        if (in_data.d_b1)
-        {
-            res.src = rm;
-            res.dst = reg;
-        }
-        else
-        {
-            res.src = reg;
-            res.dst = rm;
-        }
+        auto sr = (R)((int)R::es + in_data.reg_b3);
+        print("push", sr);
 
-        return res;
+        push(cpu, REG::get_value(cpu, sr));
     }
 
 
-    class Mem2Reg
+    static void pop_sr(CpuState& cpu, DATA::Instr const& in_data)
     {
-    public:
-        int src = -1;
-        Reg dst = Reg::none;
-    };
+        auto sr = (R)((int)R::es + in_data.reg_b3);
+        print("pop", sr);
+
+        REG::mov_reg_value(cpu, sr, pop(cpu));
+    }
 
 
-    static void print(Mem2Reg const& cmd, cstr op)
+    // the return address is the next instruction
+    static void call(CpuState& cpu, DATA::Instr const& in_data)
     {
-        printf("%s word %s, [%d]", op, REG::get_str(cmd.dst), cmd.src);
+        auto cmd = CMD::get_jump(in_data);
+        CMD::print(cmd, "call");
+
+        auto ip = REG::ip(cpu);
+        push(cpu, ip + in_data.length);
+        REG::set_ip(cpu, ip + cmd.j_offset);
     }
 
 
-    static Mem2Reg get_m_r(DATA::InstrData const& in_data)
+    // ret im also releases im bytes of arguments
+    static void ret(CpuState& cpu, DATA::Instr const& in_data)
     {
-        Mem2Reg res{};
-
-        res.dst = REG::get_reg(in_data.reg_b3, in_data.w_b1);
+        if constexpr (TRACE)
+        {
+            if (in_data.im_sz)
+            {
+                printf("ret %d", in_data.im);
+            }
+            else
+            {
+                printf("ret");
+            }
+        }
 
-        assert(in_data.disp_sz == 2);
-        
-        res.src = in_data.displo_b8 + (in_data.disphi_b8 << 8);
+        auto sp = REG::get_value(cpu, R::sp);
 
-        return res;
+        REG::set_ip(cpu, REG::read_mem(cpu, REG::get_address(cpu, R::ss, sp), 1));
+        REG::mov_reg_value(cpu, R::sp, sp + 2 + in_data.im);
     }
+}
 
 
-    class Reg2MemReg
-    {
-    public:
-        Reg src = Reg::none;
-        MR dst = MR::none;
-    };
+namespace OP
+{
+    typedef DATA::Instr (*decode_t)(u8*, int);
+    typedef void (*exec_t)(CpuState&, DATA::Instr const&);
 
 
-    static void print(Reg2MemReg const& cmd, cstr op)
+    // operand form an executor takes for a decoded instruction
+    enum class Form : int
     {
-        printf("%s word [%s], %s", op, REG::get_str(cmd.dst), REG::get_str(cmd.src));
-    }
+        mov_r_r,
+        mov_m_r,
+        mov_r_rm,
+        mov_rm_r,
+        mov_im_m,
+        mov_im_rmd,
+        mov_im_r,
 
+        add_r_r,
+        add_im_r,
 
-    static Reg2MemReg get_r_mr(DATA::InstrData const& in_data)
-    {
-        Reg2MemReg res{};
+        sub_r_r,
+        sub_im_r,
 
-        res.src = REG::get_reg(in_data.reg_b3, in_data.w_b1);
-        res.dst = REG::get_mem_reg(in_data.rm_b3, in_data.mod_b2);
+        cmp_r_r,
 
-        return res;
-    }
+        jnz,
 
+        call,
+        ret,
 
-    class RegMem2Reg
-    {
-    public:
-        MR src = MR::none;
-        Reg dst = Reg::none;
+        other
     };
 
 
-    static void print(RegMem2Reg const& cmd, cstr op)
+    // decoded instruction ready to be executed
+    class Op
     {
-        printf("%s %s, [%s]", op, REG::get_str(cmd.dst), REG::get_str(cmd.src));
-    }
+    public:
+        DATA::Instr in;
+        exec_t exec = nullptr;
+        Form form = Form::other;
+
+        // jumps set ip themselves
+        bool sets_ip = false;
+    };
 
 
-    static RegMem2Reg get_rm_r(DATA::InstrData const& in_data)
+    // decoder/executor pair for an opcode
+    class OpDef
     {
-        RegMem2Reg res{};
+    public:
+        decode_t decode = nullptr;
+        exec_t exec = nullptr;
 
-        res.src = REG::get_mem_reg(in_data.rm_b3, in_data.mod_b2);
-        res.dst = REG::get_reg(in_data.reg_b3, in_data.w_b1);
+        bool sets_ip = false;
 
-        return res;
-    }
+        // opcode is selected by the reg field of the ModRM byte
+        bool by_reg = false;
+
+        // rep prefix, the opcode is the next byte
+        bool prefix = false;
+    };
 
 
-    class Im2Mem
+    class OpTable
     {
     public:
-        int src = -1;
-        int dst = -1;
+        OpDef byte1[256];
 
-        int im_size = -1;
+        // 0b1000'00sw, indexed by reg
+        OpDef im_rm[8];
     };
 
 
-    static void print(Im2Mem const& cmd, cstr op)
+    static void no_op(CpuState&, DATA::Instr const&) {}
+
+
+    static void execute(CpuState& cpu, Op const& op)
     {
-        auto sz = "err";
-        if (cmd.im_size == 1)
-        {
-            sz = "byte";
-        }
-        else if (cmd.im_size == 2)
+        if (!op.sets_ip)
         {
-            sz = "word";
+            REG::set_ip(cpu, REG::ip(cpu) + op.in.length);
         }
 
-        printf("%s %s [%d], %d", op, sz, cmd.dst, cmd.src);     
+        op.exec(cpu, op.in);
     }
 
 
-    static Im2Mem get_im_m(DATA::InstrData const& in_data)
+    static Form get_form(Op const& op)
     {
-        Im2Mem res{};
-
-        assert(in_data.disp_sz == 2);
+        using F = Form;
 
-        res.im_size = in_data.im_sz;
-        res.dst = in_data.displo_b8 + (in_data.disphi_b8 << 8);
+        auto& in = op.in;
 
-        if (in_data.im_sz == 1 || in_data.s_b1 == 1)
+        if (op.exec == MOV::rm_r)
+        {
+            if (CMD::is_r_r(in)) { return F::mov_r_r; }
+            if (CMD::is_m_r(in)) { return F::mov_m_r; }
+            if (CMD::is_r_rm(in)) { return F::mov_r_rm; }
+            if (CMD::is_rm_r(in)) { return F::mov_rm_r; }
+        }
+        else if (op.exec == MOV::im_rm)
+        {
+            if (CMD::is_m(in)) { return F::mov_im_m; }
+            if (CMD::is_rmd(in)) { return F::mov_im_rmd; }
+        }
+        else if (op.exec == MOV::im_r)
+        {
+            return F::mov_im_r;
+        }
+        else if (op.exec == ADD::rm_r)
+        {
+            if (CMD::is_r_r(in)) { return F::add_r_r; }
+        }
+        else if (op.exec == ADD::im_rm)
+        {
+            if (CMD::is_im_r(in)) { return F::add_im_r; }
+        }
+        else if (op.exec == SUB::rm_r)
+        {
+            if (CMD::is_r_r(in)) { return F::sub_r_r; }
+        }
+        else if (op.exec == SUB::im_rm)
+        {
+            if (CMD::is_im_r(in)) { return F::sub_im_r; }
+        }
+        else if (op.exec == CMP::rm_r)
+        {
+            if (CMD::is_r_r(in)) { return F::cmp_r_r; }
+        }
+        else if (op.exec == (exec_t)JUMP::jnz)
+        {
+            return F::jnz;
+        }
+        else if (op.exec == STACK::call)
         {
-            res.src = in_data.imlo_b8;
+            return F::call;
         }
-        else if (in_data.im_sz == 2)
+        else if (op.exec == STACK::ret)
         {
-            res.src = in_data.imlo_b8 + (in_data.imhi_b8 << 8);
+            return F::ret;
         }
 
-        return res;
+        return F::other;
     }
 
 
-    class Im2MemRegDisp
+    static constexpr OpTable make_op_table()
     {
-    public:
-        int src = -1;
-        MR dst = MR::none;
+        OpTable table{};
 
-        int im_size = -1;
-        int disp = -1;
-    };
-
-
-    static void print(Im2MemRegDisp const& cmd, cstr op)
-    {
-        auto sz = "err";
-        if (cmd.im_size == 1)
+        auto const set = [&](int byte1, int count, decode_t decode, exec_t exec)
         {
-            sz = "byte";
-        }
-        else if (cmd.im_size == 2)
+            for (int i = 0; i < count; ++i)
+            {
+                auto& def = table.byte1[byte1 + i];
+                def.decode = decode;
+                def.exec = exec;
+            }
+        };
+
+        auto const set_im_rm = [&](int reg, exec_t exec)
         {
-            sz = "word";
-        }
+            auto& def = table.im_rm[reg];
+            def.decode = DATA::get_im_rm;
+            def.exec = exec;
+        };
 
-        printf("%s %s [%s + %d], %d", op, sz, REG::get_str(cmd.dst), cmd.disp, cmd.src);
-    }
+        // mov
+        set(0b1000'1000, 4, DATA::get_rm_r, MOV::rm_r);
+        set(0b1100'0110, 2, DATA::get_mov_im_rm, MOV::im_rm);
+        set(0b1011'0000, 16, DATA::get_mov_im_r, MOV::im_r);
+        set(0b1010'0000, 4, DATA::get_mov_m_ac, MOV::m_ac);
+        set(0b1000'1100, 1, DATA::get_mov_sr, MOV::sr);
+        set(0b1000'1110, 1, DATA::get_mov_sr, MOV::sr);
 
+        // add
+        set(0b0000'0000, 4, DATA::get_rm_r, ADD::rm_r);
+        set(0b0000'0100, 2, DATA::get_im_ac, ADD::im_ac);
+        set_im_rm(0b000, ADD::im_rm);
 
-    static Im2MemRegDisp get_im_rmd(DATA::InstrData const& in_data)
-    {
-        Im2MemRegDisp res{};
+        // sub
+        set(0b0010'1000, 4, DATA::get_rm_r, SUB::rm_r);
+        set(0b0010'1100, 2, DATA::get_im_ac, SUB::im_ac);
+        set_im_rm(0b101, SUB::im_rm);
 
-        res.dst = REG::get_mem_reg(in_data.rm_b3, in_data.mod_b2);
+        // cmp
+        set(0b0011'1000, 4, DATA::get_rm_r, CMP::rm_r);
+        set(0b0011'1100, 2, DATA::get_im_ac, CMP::im_ac);
+        set_im_rm(0b111, CMP::im_rm);
 
-        res.im_size = in_data.im_sz;
-        
-        if (in_data.disp_sz == 1)
-        {
-            res.disp = in_data.displo_b8;
-        }
-        else if (in_data.disp_sz == 2)
+        for (int i = 0; i < 4; ++i)
         {
-            res.disp = in_data.displo_b8 + (in_data.disphi_b8 << 8);
+            table.byte1[0b1000'0000 + i].by_reg = true;
         }
 
-        if (in_data.im_sz == 1 || in_data.s_b1 == 1)
-        {
-            res.src = in_data.imlo_b8;
-        }
-        else if (in_data.im_sz == 2)
+        // jump
+        set(0b0111'0101, 1, DATA::get_jump, JUMP::jnz);
+        table.byte1[0b0111'0101].sets_ip = true;
+
+        // string
+        set(0b1010'0100, 2, DATA::get_string, STRING::movs);
+        set(0b1010'0110, 2, DATA::get_string, STRING::cmps);
+        set(0b1010'1010, 2, DATA::get_string, STRING::stos);
+        set(0b1010'1100, 2, DATA::get_string, STRING::lods);
+        set(0b1010'1110, 2, DATA::get_string, STRING::scas);
+
+        table.byte1[0b1111'0010].prefix = true; // repne
+        table.byte1[0b1111'0011].prefix = true; // rep/repe
+
+        set(0b1111'1100, 1, DATA::get_op1, STRING::clear_df); // cld
+        set(0b1111'1101, 1, DATA::get_op1, STRING::set_df); // std
+
+        // stack
+        set(0b0101'0000, 8, DATA::get_stack_r, STACK::push_r);
+        set(0b0101'1000, 8, DATA::get_stack_r, STACK::pop_r);
+
+        for (int sr = 0; sr < 4; ++sr)
         {
-            res.src = in_data.imlo_b8 + (in_data.imhi_b8 << 8);
+            set(0b0000'0110 | (sr << 3), 1, DATA::get_stack_sr, STACK::push_sr);
+
+            // 0b0000'1111 would be pop cs
+            if (sr != 1)
+            {
+                set(0b0000'0111 | (sr << 3), 1, DATA::get_stack_sr, STACK::pop_sr);
+            }
         }
 
-        //DATA::print(in_data.bytes);
+        set(0b1110'1000, 1, DATA::get_call, STACK::call);
+        set(0b1100'0011, 1, DATA::get_op1, STACK::ret);
+        set(0b1100'0010, 1, DATA::get_ret_im, STACK::ret);
+        table.byte1[0b1110'1000].sets_ip = true;
+        table.byte1[0b1100'0011].sets_ip = true;
+        table.byte1[0b1100'0010].sets_ip = true;
 
-        return res;
+        return table;
     }
 
 
-    class Jump
-    {
-    public:
-        int j_offset = 0;
-    };
-   
+    static constexpr OpTable OP_TABLE = make_op_table();
+}
 
-    static void print(Jump const& j, cstr op)
-    {
-        printf("%s $%d", op, j.j_offset);
-    }
 
+static OP::Op decode_next(u8* data, int offset)
+{
+    auto def = OP::OP_TABLE.byte1[data[offset]];
 
-    static bool is_r_r(DATA::InstrData const& in_data)
+    if (def.by_reg)
     {
-        return 
-            in_data.mod_b2 == 0b11;
+        auto reg = (data[offset + 1] & 0b00'111'000) >> 3;
+        def = OP::OP_TABLE.im_rm[reg];
     }
-
-
-    static bool is_m_r(DATA::InstrData const& in_data)
+    else if (def.prefix)
     {
-        return
-            in_data.d_b1 == 1 &&
-            in_data.mod_b2 == 0b00 &&
-            in_data.rm_b3 == 0b110;
+        // only string instructions repeat
+        def = OP::OP_TABLE.byte1[data[offset + 1]];
+        if (def.decode != DATA::get_string)
+        {
+            def = {};
+        }
     }
 
+    OP::Op op{};
 
-    static bool is_rm_r(DATA::InstrData const& in_data)
+    if (!def.decode)
     {
-        return 
-            in_data.d_b1 == 1 &&
-            in_data.mod_b2 != 0b11;
+        return op;
     }
 
+    op.in = def.decode(data, offset);
+    op.exec = def.exec;
+    op.sets_ip = def.sets_ip;
+    op.form = OP::get_form(op);
 
-    static bool is_r_rm(DATA::InstrData const& in_data)
-    {
-        return 
-            in_data.d_b1 == 0 &&
-            in_data.mod_b2 != 0b11;
-
-    }
+    return op;
+}
 
 
-    static bool is_im_r(DATA::InstrData const& in_data)
+namespace CACHE
+{
+    // decoded ops indexed by ip
+    // the program is not loaded into cpu.MEM so an entry never goes stale
+    class OpCache
     {
-        return
-            in_data.opcode == 0b100000 &&
-            in_data.mod_b2 == 0b11 &&
-            (in_data.im_sz == 1 || in_data.im_sz == 2);
-    }
+    public:
+        OP::Op* ops = nullptr;
+        u32 size = 0;
+    };
 
 
-    static bool is_m(DATA::InstrData const& in_data)
+    static void destroy(OpCache& cache)
     {
-        return
-            in_data.mod_b2 == 0b00 &&
-            in_data.rm_b3 == 0b110;
+        if (cache.ops)
+        {
+            std::free(cache.ops);
+            cache.ops = nullptr;
+        }
     }
 
 
-    static bool is_rmd(DATA::InstrData const& in_data)
+    static bool create(OpCache& cache, u32 size)
     {
-        return
-            (in_data.mod_b2 == 0b01 || in_data.mod_b2 == 0b10);
-    }
-
+        assert(!cache.ops);
+        assert(size);
 
-    static Jump get_jump(DATA::InstrData const& in_data)
-    {
-        Jump res{};
+        if (cache.ops || !size)
+        {
+            return false;
+        }
 
-        auto j_b8 = in_data.j_b8;
+        cache.ops = (OP::Op*)std::calloc(size, sizeof(OP::Op));
+        if (!cache.ops)
+        {
+            return false;
+        }
 
-        res.j_offset = *((i8*)(&j_b8)) + in_data.offset_end - in_data.offset_begin;
+        cache.size = size;
 
-        return res;
+        return true;
     }
-}
 
 
-namespace MOV
-{
-    using R = REG::Reg;
+    static OP::Op const& get_op(OpCache& cache, u8* data, int offset)
+    {
+        auto& op = cache.ops[offset];
+        if (!op.exec)
+        {
+            op = decode_next(data, offset);
+        }
 
-    typedef void (*func_t)(int);
+        return op;
+    }
+}
 
 
-    static u16 set_high(u16 reg, int v)
+// returns the number of instructions executed
+static u64 decode_run(CpuState& cpu, u8* data, u32 size)
+{
+    CACHE::OpCache cache{};
+    if (!CACHE::create(cache, size))
     {
-        return (u16)(((v & REG::LOW_8) << 8) + (reg & REG::LOW_8));
+        assert(false);
+        return 0;
     }
 
+    u64 count = 0;
 
-    static u16 set_low(u16 reg, int v)
+    int offset = 0;
+    while (offset >= 0 && offset < size)
     {
-        return (u16)((reg & REG::HI_8) + (v & REG::LOW_8));
-    }
+        auto& op = CACHE::get_op(cache, data, offset);
+        if (!op.exec)
+        {
+            break;
+        }
+
+        OP::execute(cpu, op);
+        ++count;
 
+        REG::print_trace(cpu);
 
-    static void ax(int v) { REG::mov_reg_value(REG::AX, R::ax, v); }
-    static void bx(int v) { REG::mov_reg_value(REG::BX, R::bx, v); }
-    static void cx(int v) { REG::mov_reg_value(REG::CX, R::cx, v); }
-    static void dx(int v) { REG::mov_reg_value(REG::DX, R::dx, v); }
+        offset = REG::ip(cpu);
+    }
 
-    static void ah(int v) { REG::mov_reg_value(REG::AX, R::ax, set_high(REG::AX, v)); }
-    static void bh(int v) { REG::mov_reg_value(REG::BX, R::bx, set_high(REG::BX, v)); }
-    static void ch(int v) { REG::mov_reg_value(REG::DX, R::cx, set_high(REG::CX, v)); }
-    static void dh(int v) { REG::mov_reg_value(REG::DX, R::dx, set_high(REG::DX, v)); }
+    CACHE::destroy(cache);
 
-    static void al(int v) { REG::mov_reg_value(REG::AX, R::ax, set_low(REG::AX, v)); }
-    static void bl(int v) { REG::mov_reg_value(REG::BX, R::bx, set_low(REG::BX, v)); }
-    static void cl(int v) { REG::mov_reg_value(REG::DX, R::cx, set_low(REG::CX, v)); }
-    static void dl(int v) { REG::mov_reg_value(REG::DX, R::dx, set_low(REG::DX, v)); }
+    return count;
+}
 
-    static void sp(int v) { REG::mov_reg_value(REG::SP, R::sp, v); }
-    static void bp(int v) { REG::mov_reg_value(REG::BP, R::bp, v); }
-    static void si(int v) { REG::mov_reg_value(REG::SI, R::si, v); }
-    static void di(int v) { REG::mov_reg_value(REG::DI, R::di, v); }
 
-    static void no_op(int) { printf("no op"); }
+static void decode_bin_file(CpuState& cpu, cstr bin_file)
+{
+    auto buffer = Bytes::read(bin_file);
 
+    assert(buffer.data);
+    assert(buffer.size);
 
-    static func_t get_mov_f(R reg)
-    {
-        switch (reg)
-        {
-        case R::ax: return ax;
-        case R::bx: return bx;
-        case R::cx: return cx;
-        case R::dx: return dx;
-        
-        case R::ah: return ah;
-        case R::bh: return bh;
-        case R::ch: return ch;
-        case R::dh: return dh;
+    decode_run(cpu, buffer.data, buffer.size);
 
-        case R::al: return al;
-        case R::bl: return bl;
-        case R::cl: return cl;
-        case R::dl: return dl;
+    Bytes::destroy(buffer);
+}
 
-        case R::sp: return sp;
-        case R::bp: return bp;
-        case R::si: return si;
-        case R::di: return di;
-        }
 
-        return no_op;
-    }
+namespace THREAD
+{
+    union Operands
+    {
+        Operands() : op{} {}
+
+        OP::Op op;
+        CMD::Reg2Reg r_r;
+        CMD::Mem2Reg m_r;
+        CMD::Reg2MemReg r_mr;
+        CMD::RegMem2Reg mr_r;
+        CMD::Im2Reg im_r;
+        CMD::Im2Mem im_m;
+        CMD::Im2MemRegDisp im_rmd;
+        CMD::Jump jump;
+    };
 
 
-    static void mov_r_r(CMD::Reg2Reg const& cmd)
+    // handler address and operands, indexed by ip
+    class Thread
     {
-        CMD::print(cmd, "mov");
+    public:
+        void* handler = nullptr;
+        int offset_end = 0;
+        OP::Form form = OP::Form::other;
 
-        auto f = get_mov_f(cmd.dst);
-        auto val = REG::get_value(cmd.src);
-        if (val >= 0)
-        {
-            f(val);
-        }
-    }
+        Operands ops;
+    };
 
 
-    static void mov_m_r(CMD::Mem2Reg const& cmd)
+    // instruction sequences run by one handler
+    enum class Fused : int
     {
-        print(cmd, "mov");
+        none,
 
-        auto p16 = (u16*)(REG::MEM + cmd.src);
-        REG::set_reg_value(cmd.dst, *p16);
-    }
+        // add si, 2; cmp si, dx; jnz
+        add_cmp_jnz,
+
+        // cmp si, dx; jnz
+        cmp_jnz,
+
+        // mov cx, [bp + si]; add bx, cx
+        mov_add
+    };
 
 
-    static void mov_r_rm(CMD::Reg2MemReg const& cmd)
+    static Fused get_fused(OP::Form f1, OP::Form f2, OP::Form f3)
     {
-        print(cmd, "mov");
+        using F = OP::Form;
 
-        auto p16 = (u16*)(REG::MEM + REG::get_value(cmd.dst));
-        *p16 = REG::get_value(cmd.src);
+        if (f1 == F::add_im_r && f2 == F::cmp_r_r && f3 == F::jnz) { return Fused::add_cmp_jnz; }
+        if (f1 == F::cmp_r_r && f2 == F::jnz) { return Fused::cmp_jnz; }
+        if (f1 == F::mov_rm_r && f2 == F::add_r_r) { return Fused::mov_add; }
+
+        return Fused::none;
     }
 
 
-    static void mov_rm_r(CMD::RegMem2Reg const& cmd)
+    // the instructions following offset in program order
+    static Fused get_fused(Thread const* threads, u32 size, int offset)
     {
-        print(cmd, "mov");
+        auto const next = [&](int i) { return i < size ? threads[i].offset_end : 0; };
+        auto const form = [&](int i) { return i > 0 && i < size ? threads[i].form : OP::Form::other; };
+
+        auto i2 = next(offset);
+        auto i3 = next(i2);
 
-        auto p16 = (u16*)(REG::MEM + REG::get_value(cmd.src));
-        REG::set_reg_value(cmd.dst, *p16);
+        return get_fused(form(offset), form(i2), form(i3));
     }
 
 
-    static void mov_im_m(CMD::Im2Mem const& cmd)
+    // pre-decoded operands of the forms with a handler
+    static Operands get_operands(OP::Op const& op)
     {
-        CMD::print(cmd, "mov");
+        using F = OP::Form;
 
-        auto p8 = REG::MEM + cmd.dst;
+        auto& in = op.in;
 
-        if (cmd.im_size == 1)
-        {
-            *p8 = (u8)cmd.src;
-        }
-        else if (cmd.im_size == 2)
+        Operands ops;
+
+        switch (op.form)
         {
-            auto p16 = (u16*)p8;
-            *p16 = (u16)cmd.src;
-        }
-    }
+        case F::mov_r_r:
+        case F::add_r_r:
+        case F::sub_r_r:
+        case F::cmp_r_r:
+            ops.r_r = CMD::get_r_r(in);
+            break;
 
+        case F::mov_m_r: ops.m_r = CMD::get_m_r(in); break;
+        case F::mov_r_rm: ops.r_mr = CMD::get_r_mr(in); break;
+        case F::mov_rm_r: ops.mr_r = CMD::get_rm_r(in); break;
+        case F::mov_im_m: ops.im_m = CMD::get_im_m(in); break;
+        case F::mov_im_rmd: ops.im_rmd = CMD::get_im_rmd(in); break;
+        case F::mov_im_r: ops.im_r = CMD::get_mov_im_r(in); break;
 
-    static void mov_im_rmd(CMD::Im2MemRegDisp const& cmd)
-    {
-        CMD::print(cmd, "mov");
+        case F::add_im_r:
+        case F::sub_im_r:
+            ops.im_r = CMD::get_im_r(in);
+            break;
 
-        auto p8 = REG::MEM + REG::get_value(cmd.dst) + cmd.disp;
+        case F::jnz: ops.jump = CMD::get_jump(in); break;
 
-        if (cmd.im_size == 1)
-        {
-            *p8 = (u8)cmd.src;
-        }
-        else if (cmd.im_size == 2)
-        {
-            auto p16 = (u16*)p8;
-            *p16 = (u16)cmd.src;
+        default:
+            // anything without a handler runs through its executor
+            ops.op = op;
         }
+
+        return ops;
     }
 
 
-    static void rm_r(DATA::InstrData const& in_data)
+    static void run(CpuState& cpu, u8* data, u32 size)
     {
-        if (CMD::is_r_r(in_data))
+        using F = OP::Form;
+
+        auto threads = (Thread*)std::calloc(size, sizeof(Thread));
+        if (!threads)
         {
-            auto cmd = CMD::get_r_r(in_data);
-            mov_r_r(cmd);
-        }
-        else if (CMD::is_m_r(in_data))
-        {            
-            auto cmd = CMD::get_m_r(in_data);
-            mov_m_r(cmd);
+            assert(false);
+            return;
         }
-        else if (CMD::is_r_rm(in_data))
+
+        // ips not reached by the sweep are decoded the first time they run
+        for (u32 i = 0; i < size; ++i)
         {
-            auto cmd = CMD::get_r_mr(in_data);
-            mov_r_rm(cmd);
+            threads[i].handler = &&translate;
+            threads[i].form = OP::Form::other;
         }
-        else if (CMD::is_rm_r(in_data))
+
+        void* handlers[(int)F::other + 1] = { 0 };
+        for (auto& h : handlers)
         {
-            auto cmd = CMD::get_rm_r(in_data);
-            mov_rm_r(cmd);
+            h = &&exec_op;
         }
-        else
+
+        handlers[(int)F::mov_r_r] = &&mov_r_r;
+        handlers[(int)F::mov_m_r] = &&mov_m_r;
+        handlers[(int)F::mov_r_rm] = &&mov_r_rm;
+        handlers[(int)F::mov_rm_r] = &&mov_rm_r;
+        handlers[(int)F::mov_im_m] = &&mov_im_m;
+        handlers[(int)F::mov_im_rmd] = &&mov_im_rmd;
+        handlers[(int)F::mov_im_r] = &&mov_im_r;
+        handlers[(int)F::add_r_r] = &&add_r_r;
+        handlers[(int)F::add_im_r] = &&add_im_r;
+        handlers[(int)F::sub_r_r] = &&sub_r_r;
+        handlers[(int)F::sub_im_r] = &&sub_im_r;
+        handlers[(int)F::cmp_r_r] = &&cmp_r_r;
+        handlers[(int)F::jnz] = &&jnz;
+
+        auto const translate_at = [&](int offset)
         {
-            
-            printf("X rm_r");
-        }
-    }
+            auto op = decode_next(data, offset);
+            if (!op.exec)
+            {
+                return false;
+            }
 
+            auto& t = threads[offset];
+            t.offset_end = offset + op.in.length;
+            t.form = OP::get_form(op);
+            t.handler = handlers[(int)t.form];
+            t.ops = get_operands(op);
 
-    static void im_rm(DATA::InstrData const& in_data)
-    {
-        if (CMD::is_m(in_data))
-        {
-            auto cmd = CMD::get_im_m(in_data);
-            mov_im_m(cmd);
-        }
-        else if (CMD::is_rmd(in_data))
+            return true;
+        };
+
+        // translate once up to the first byte that does not decode
+        int offset = 0;
+        while (offset < size && translate_at(offset))
         {
-            auto cmd = CMD::get_im_rmd(in_data);
-            mov_im_rmd(cmd);
+            offset = threads[offset].offset_end;
         }
-        else
+
+        // the fused handler replaces the first instruction only
+        // a jump into the middle of a sequence runs the rest unfused
+        for (u32 i = 0; i < size; ++i)
         {
-            printf("X im_rm");
+            switch (get_fused(threads, size, i))
+            {
+            case Fused::add_cmp_jnz: threads[i].handler = &&add_cmp_jnz; break;
+            case Fused::cmp_jnz: threads[i].handler = &&cmp_jnz; break;
+            case Fused::mov_add: threads[i].handler = &&mov_add; break;
+            default: break;
+            }
         }
+
+        Thread* t = threads;
+
+        #define THREAD_NEXT() \
+            REG::print_trace(cpu); \
+            if (cpu.IP >= size) goto halt; \
+            t = threads + cpu.IP; \
+            goto *t->handler;
+
+        #define THREAD_SET_IP() REG::set_ip(cpu, t->offset_end);
+
+        // next instruction of a fused sequence
+        #define THREAD_STEP() \
+            REG::print_trace(cpu); \
+            t = threads + cpu.IP;
+
+        goto *t->handler;
+
+    mov_r_r:
+        THREAD_SET_IP();
+        MOV::mov_r_r(cpu, t->ops.r_r);
+        THREAD_NEXT();
+
+    mov_m_r:
+        THREAD_SET_IP();
+        MOV::mov_m_r(cpu, t->ops.m_r);
+        THREAD_NEXT();
+
+    mov_r_rm:
+        THREAD_SET_IP();
+        MOV::mov_r_rm(cpu, t->ops.r_mr);
+        THREAD_NEXT();
+
+    mov_rm_r:
+        THREAD_SET_IP();
+        MOV::mov_rm_r(cpu, t->ops.mr_r);
+        THREAD_NEXT();
+
+    mov_im_m:
+        THREAD_SET_IP();
+        MOV::mov_im_m(cpu, t->ops.im_m);
+        THREAD_NEXT();
+
+    mov_im_rmd:
+        THREAD_SET_IP();
+        MOV::mov_im_rmd(cpu, t->ops.im_rmd);
+        THREAD_NEXT();
+
+    mov_im_r:
+        THREAD_SET_IP();
+        MOV::mov_im_r(cpu, t->ops.im_r);
+        THREAD_NEXT();
+
+    add_r_r:
+        THREAD_SET_IP();
+        ADD::add_r_r(cpu, t->ops.r_r);
+        THREAD_NEXT();
+
+    add_im_r:
+        THREAD_SET_IP();
+        ADD::add_im_r(cpu, t->ops.im_r);
+        THREAD_NEXT();
+
+    sub_r_r:
+        THREAD_SET_IP();
+        SUB::r_r(cpu, t->ops.r_r);
+        THREAD_NEXT();
+
+    sub_im_r:
+        THREAD_SET_IP();
+        SUB::im_r(cpu, t->ops.im_r);
+        THREAD_NEXT();
+
+    cmp_r_r:
+        THREAD_SET_IP();
+        CMP::r_r(cpu, t->ops.r_r);
+        THREAD_NEXT();
+
+    jnz:
+        JUMP::jnz(cpu, t->ops.jump);
+        THREAD_NEXT();
+
+    exec_op:
+        OP::execute(cpu, t->ops.op);
+        THREAD_NEXT();
+
+    add_cmp_jnz:
+        THREAD_SET_IP();
+        ADD::add_im_r(cpu, t->ops.im_r);
+        THREAD_STEP();
+        THREAD_SET_IP();
+        CMP::r_r(cpu, t->ops.r_r);
+        THREAD_STEP();
+        JUMP::jnz(cpu, t->ops.jump);
+        THREAD_NEXT();
+
+    cmp_jnz:
+        THREAD_SET_IP();
+        CMP::r_r(cpu, t->ops.r_r);
+        THREAD_STEP();
+        JUMP::jnz(cpu, t->ops.jump);
+        THREAD_NEXT();
+
+    mov_add:
+        THREAD_SET_IP();
+        MOV::mov_rm_r(cpu, t->ops.mr_r);
+        THREAD_STEP();
+        THREAD_SET_IP();
+        ADD::add_r_r(cpu, t->ops.r_r);
+        THREAD_NEXT();
+
+    translate:
+        // code past embedded data, runs unfused
+        if (!translate_at(cpu.IP))
+        {
+            goto halt;
+        }
+
+        goto *t->handler;
+
+    halt:
+        std::free(threads);
+
+        #undef THREAD_NEXT
+        #undef THREAD_SET_IP
+        #undef THREAD_STEP
     }
+}
 
 
-    static void im_r(DATA::InstrData const& in_data)
-    {
-        auto cmd = CMD::get_mov_im_r(in_data);
-        CMD::print(cmd, "mov");
+#include "jit.cpp"
+#include "recompile.cpp"
+#include "trace.cpp"
+#include "batch.cpp"
+#include "clocks.cpp"
+#include "profile.cpp"
+#include "fuse.cpp"
+#include "ensemble.cpp"
+#include "cfg.cpp"
+#include "fastfwd.cpp"
+#include "index.cpp"
+#include "bench.cpp"
+#include "callgraph.cpp"
 
-        auto f = get_mov_f(cmd.dst);
-        auto val = cmd.src;
-        if (val >= 0)
-        {
-            f(val);
-        }
-    }
+
+static void thread_bin_file(CpuState& cpu, cstr bin_file)
+{
+    auto buffer = Bytes::read(bin_file);
+
+    assert(buffer.data);
+    assert(buffer.size);
+
+    THREAD::run(cpu, buffer.data, buffer.size);
+
+    Bytes::destroy(buffer);
 }
 
 
-namespace ADD
+static void jit_bin_file(CpuState& cpu, cstr bin_file)
 {
-    using R = REG::Reg;
+    auto buffer = Bytes::read(bin_file);
 
-    typedef void (*func_t)(int);
+    assert(buffer.data);
+    assert(buffer.size);
 
+    JIT::run(cpu, buffer.data, buffer.size);
 
-    static u16 add_high(u16 reg, int v)
-    {
-        auto high = (u16)(reg & REG::HI_8) << 8;
-        auto low = (u16)(reg & REG::LOW_8);
+    Bytes::destroy(buffer);
+}
 
-        high += (u16)((v & REG::LOW_8) << 8);
 
-        reg = high + low;
+static void ffwd_bin_file(CpuState& cpu, cstr bin_file)
+{
+    auto buffer = Bytes::read(bin_file);
 
-        return reg;
-    }
+    assert(buffer.data);
+    assert(buffer.size);
 
+    FFWD::run(cpu, buffer.data, buffer.size);
 
-    static u16 add_low(u16 reg, int v)
-    {
-        auto high = (u16)(reg & REG::HI_8) << 8;
-        auto low = (u16)(reg & REG::LOW_8);
+    Bytes::destroy(buffer);
+}
 
-        low += (u16)((v & REG::LOW_8) << 8);        
 
-        reg = high + low;
+static bool recompile_bin_file(cstr bin_file, cstr out_file)
+{
+    auto buffer = Bytes::read(bin_file);
 
-        return reg;
-    }
+    assert(buffer.data);
+    assert(buffer.size);
 
+    auto result = RECOMP::recompile(buffer.data, buffer.size, bin_file, out_file);
 
-    static void ax(int v) { REG::set_reg_value(REG::AX, R::ax, REG::AX + v); }
-    static void bx(int v) { REG::set_reg_value(REG::BX, R::bx, REG::BX + v); }
-    static void cx(int v) { REG::set_reg_value(REG::CX, R::cx, REG::CX + v); }
-    static void dx(int v) { REG::set_reg_value(REG::DX, R::dx, REG::DX + v); }
+    Bytes::destroy(buffer);
 
-    static void ah(int v) { REG::set_reg_value(REG::AX, R::ax, add_high(REG::AX, v)); }
-    static void bh(int v) { REG::set_reg_value(REG::BX, R::bx, add_high(REG::BX, v)); }
-    static void ch(int v) { REG::set_reg_value(REG::CX, R::cx, add_high(REG::CX, v)); }
-    static void dh(int v) { REG::set_reg_value(REG::DX, R::dx, add_high(REG::DX, v)); }
+    return result;
+}
 
-    static void al(int v) { REG::set_reg_value(REG::AX, R::ax, add_low(REG::AX, v)); }
-    static void bl(int v) { REG::set_reg_value(REG::BX, R::bx, add_low(REG::BX, v)); }
-    static void cl(int v) { REG::set_reg_value(REG::CX, R::cx, add_low(REG::CX, v)); }
-    static void dl(int v) { REG::set_reg_value(REG::CX, R::cx, add_low(REG::DX, v)); }
 
-    static void sp(int v) { REG::set_reg_value(REG::SP, R::sp, REG::SP + v); }
-    static void bp(int v) { REG::set_reg_value(REG::BP, R::bp, REG::BP + v); }
-    static void si(int v) { REG::set_reg_value(REG::SI, R::si, REG::SI + v); }
-    static void di(int v) { REG::set_reg_value(REG::DI, R::di, REG::DI + v); }
+static bool record_bin_file(CpuState& cpu, cstr bin_file, cstr trace_file)
+{
+    auto buffer = Bytes::read(bin_file);
 
-    static void no_op(int) {}
+    assert(buffer.data);
+    assert(buffer.size);
 
+    auto result = RECORD::record(cpu, buffer.data, buffer.size, bin_file, trace_file);
 
-    static func_t get_add_f(R reg)
-    {
-        switch (reg)
-        {
-        case R::ax: return ax;
-        case R::bx: return bx;
-        case R::cx: return cx;
-        case R::dx: return dx;
-        
-        case R::ah: return ah;
-        case R::bh: return bh;
-        case R::ch: return ch;
-        case R::dh: return dh;
+    Bytes::destroy(buffer);
 
-        case R::al: return al;
-        case R::bl: return bl;
-        case R::cl: return cl;
-        case R::dl: return dl;
+    return result;
+}
 
-        case R::sp: return sp;
-        case R::bp: return bp;
-        case R::si: return si;
-        case R::di: return di;
-        }
 
-        return no_op;
-    }
+static bool clocks_bin_file(CpuState& cpu, cstr bin_file)
+{
+    auto buffer = Bytes::read(bin_file);
 
+    assert(buffer.data);
+    assert(buffer.size);
 
-    static void add_im_r(CMD::Im2Reg const& cmd)
+    CLOCKS::Profile prof{};
+    if (!CLOCKS::create(prof, buffer.size))
     {
-        CMD::print(cmd, "add");
+        Bytes::destroy(buffer);
+        return false;
+    }
 
-        auto f = get_add_f(cmd.dst);
-        auto val = cmd.src;
-        if (val >= 0)
-        {
-            f(val);
-        }
+    auto result = CLOCKS::run(cpu, buffer.data, buffer.size, prof);
+    if (result)
+    {
+        CLOCKS::print(prof, buffer.data);
     }
 
+    CLOCKS::destroy(prof);
+    Bytes::destroy(buffer);
 
-    static void add_r_r(CMD::Reg2Reg const& cmd)
-    {
-        CMD::print(cmd, "add");
+    return result;
+}
 
-        auto f = get_add_f(cmd.dst);
-        auto val = REG::get_value(cmd.src);
-        if (val >= 0)
-        {
-            f(val);
-        }
-    }
 
+static bool profile_bin_file(CpuState& cpu, cstr bin_file)
+{
+    auto buffer = Bytes::read(bin_file);
+
+    assert(buffer.data);
+    assert(buffer.size);
 
-    static void im_rm(DATA::InstrData const& in_data)
+    PROFILE::Hotspots hs{};
+    if (!PROFILE::create(hs, buffer.size))
     {
-        if (CMD::is_im_r(in_data))
-        {
-            auto cmd = CMD::get_im_r(in_data);
-            add_im_r(cmd);
-        }
-        else
-        {
-            DATA::print(in_data.bytes);
-        }
+        Bytes::destroy(buffer);
+        return false;
     }
 
-
-    static void rm_r(DATA::InstrData const& in_data)
+    auto result = PROFILE::run(cpu, buffer.data, buffer.size, hs);
+    if (result)
     {
-        if (CMD::is_r_r(in_data))
-        {
-            auto cmd = CMD::get_r_r(in_data);
-            add_r_r(cmd);
-        }
-        else
-        {
-            DATA::print(in_data.bytes);
-        }
+        PROFILE::print(hs, buffer.data, buffer.size);
     }
+
+    PROFILE::destroy(hs);
+    Bytes::destroy(buffer);
+
+    return result;
 }
 
 
-namespace SUB
+static bool callgraph_bin_file(CpuState& cpu, cstr bin_file, cstr folded_file)
 {
-    using R = REG::Reg;
-
-    typedef void (*func_t)(int);
+    auto buffer = Bytes::read(bin_file);
 
+    assert(buffer.data);
+    assert(buffer.size);
 
-    static u16 sub_high(u16 reg, int v)
+    CALLGRAPH::CallGraph cg{};
+    if (!CALLGRAPH::create(cg, buffer.size))
     {
-        auto high = (u16)(reg & REG::HI_8) << 8;
-        auto low = (u16)(reg & REG::LOW_8);
-
-        high -= (u16)((v & REG::LOW_8) << 8);
-
-        reg = high + low;
-
-        return reg;
+        Bytes::destroy(buffer);
+        return false;
     }
 
+    auto result =
+        CALLGRAPH::run(cpu, buffer.data, buffer.size, cg) &&
+        CALLGRAPH::summarize(cg) &&
+        CALLGRAPH::write_folded(cg, folded_file);
 
-    static u16 sub_low(u16 reg, int v)
+    if (result)
     {
-        auto high = (u16)(reg & REG::HI_8) << 8;
-        auto low = (u16)(reg & REG::LOW_8);
-
-        low -= (u16)((v & REG::LOW_8) << 8);        
+        CALLGRAPH::print(cg);
+        printf("folded stacks: %s\n", folded_file);
+    }
 
-        reg = high + low;
+    CALLGRAPH::destroy(cg);
+    Bytes::destroy(buffer);
 
-        return reg;
-    }
+    return result;
+}
 
 
-    static void ax(int v) { REG::set_reg_value(REG::AX, R::ax, REG::AX - v); }
-    static void bx(int v) { REG::set_reg_value(REG::BX, R::bx, REG::BX - v); }
-    static void cx(int v) { REG::set_reg_value(REG::CX, R::cx, REG::CX - v); }
-    static void dx(int v) { REG::set_reg_value(REG::DX, R::dx, REG::DX - v); }
+static void usage(char* name)
+{
+    printf("\nUsage:\n");
+    printf("  %s [bin_file]\n", name);
+    printf("  %s --engine <decode|threaded|jit|ffwd> [bin_file]\n", name);
+    printf("  %s --recompile out_file [bin_file]\n", name);
+    printf("  %s --cfg out_name [bin_file]\n", name);
+    printf("  %s --index bin_file\n", name);
+    printf("  %s --bench [megabytes] [seed]\n", name);
+    printf("  %s --record trace_file [bin_file]\n", name);
+    printf("  %s --clocks [bin_file]\n", name);
+    printf("  %s --profile [bin_file]\n", name);
+    printf("  %s --callgraph folded_file [bin_file]\n", name);
+    printf("  %s --format trace_file [bin_file]\n", name);
+    printf("  %s --batch <dir|bin_file> [copies] [threads]\n", name);
+    printf("  %s --fuse-stats <dir|bin_file>\n", name);
+    printf("  %s --ensemble bin_file [inputs]\n", name);
+}
 
-    static void ah(int v) { REG::set_reg_value(REG::AX, R::ax, sub_high(REG::AX, v)); }
-    static void bh(int v) { REG::set_reg_value(REG::BX, R::bx, sub_high(REG::BX, v)); }
-    static void ch(int v) { REG::set_reg_value(REG::CX, R::cx, sub_high(REG::CX, v)); }
-    static void dh(int v) { REG::set_reg_value(REG::DX, R::dx, sub_high(REG::DX, v)); }
 
-    static void al(int v) { REG::set_reg_value(REG::AX, R::ax, sub_low(REG::AX, v)); }
-    static void bl(int v) { REG::set_reg_value(REG::BX, R::bx, sub_low(REG::BX, v)); }
-    static void cl(int v) { REG::set_reg_value(REG::CX, R::cx, sub_low(REG::CX, v)); }
-    static void dl(int v) { REG::set_reg_value(REG::CX, R::cx, sub_low(REG::DX, v)); }
+int main(int argc, char* argv[])
+{
+    //constexpr auto file_old = "../06/listing_0044_register_movs";
+    //constexpr auto file_old = "../07/listing_0046_add_sub_cmp";
+    //constexpr auto file_old = "../08/listing_0048_ip_register";
+    //constexpr auto file_old = "../08/listing_0049_conditional_jumps";
 
-    static void sp(int v) { REG::set_reg_value(REG::SP, R::sp, REG::SP - v); }
-    static void bp(int v) { REG::set_reg_value(REG::BP, R::bp, REG::BP - v); }
-    static void si(int v) { REG::set_reg_value(REG::SI, R::si, REG::SI - v); }
-    static void di(int v) { REG::set_reg_value(REG::DI, R::di, REG::DI - v); }
+    constexpr auto file_051 = "listing_0051_memory_mov";
+    constexpr auto file_052 = "listing_0052_memory_add_loop";
 
-    static void no_op(int) {}
+    static CpuState cpu{};
 
+    cstr bin_file = file_052;
+    auto run_bin_file = decode_bin_file;
 
-    static func_t get_sub_f(R reg)
+    int arg = 1;
+    if (arg < argc && strcmp(argv[arg], "--batch") == 0)
     {
-        switch (reg)
+        if (arg + 1 >= argc || arg + 4 < argc)
         {
-        case R::ax: return ax;
-        case R::bx: return bx;
-        case R::cx: return cx;
-        case R::dx: return dx;
-        
-        case R::ah: return ah;
-        case R::bh: return bh;
-        case R::ch: return ch;
-        case R::dh: return dh;
-
-        case R::al: return al;
-        case R::bl: return bl;
-        case R::cl: return cl;
-        case R::dl: return dl;
-
-        case R::sp: return sp;
-        case R::bp: return bp;
-        case R::si: return si;
-        case R::di: return di;
+            usage(argv[0]);
+            return 1;
         }
 
-        return no_op;
-    }
+        if constexpr (TRACE)
+        {
+            printf("--batch needs the silent build (-DSIM_SILENT)\n");
+            return 1;
+        }
 
+        u32 n_copies = arg + 2 < argc ? (u32)atoi(argv[arg + 2]) : 1;
+        u32 n_threads = arg + 3 < argc ? (u32)atoi(argv[arg + 3]) : std::thread::hardware_concurrency();
 
-    static void r_r(CMD::Reg2Reg const& cmd)
-    {
-        CMD::print(cmd, "sub");
+        if (!n_copies || !n_threads || n_threads > BATCH::MAX_THREADS)
+        {
+            usage(argv[0]);
+            return 1;
+        }
 
-        auto f = get_sub_f(cmd.dst);
-        auto val = REG::get_value(cmd.src);
-        if (val >= 0)
+        if (!BATCH::run(argv[arg + 1], n_copies, n_threads))
         {
-            f(val);
+            printf("batch failed: %s\n", argv[arg + 1]);
+            return 1;
         }
-    }
 
+        return 0;
+    }
 
-    static void im_r(CMD::Im2Reg const& cmd)
+    if (arg < argc && strcmp(argv[arg], "--fuse-stats") == 0)
     {
-        CMD::print(cmd, "sub");
-
-        auto f = get_sub_f(cmd.dst);
-        auto val = cmd.src;
-        if (val >= 0)
+        if (arg + 2 != argc)
         {
-            f(val);
+            usage(argv[0]);
+            return 1;
         }
-    }
-
 
-    static void rm_r(DATA::InstrData const& in_data)
-    {
-        if (CMD::is_r_r(in_data))
+        if constexpr (TRACE)
         {
-            auto cmd = CMD::get_r_r(in_data);
-            r_r(cmd);
+            printf("--fuse-stats needs the silent build (-DSIM_SILENT)\n");
+            return 1;
         }
-        else
+
+        if (!FUSE::run(argv[arg + 1]))
         {
-            printf("X rm_r");
+            printf("fuse stats failed: %s\n", argv[arg + 1]);
+            return 1;
         }
-    }
 
+        return 0;
+    }
 
-    static void im_rm(DATA::InstrData const& in_data)
+    if (arg < argc && strcmp(argv[arg], "--ensemble") == 0)
     {
-        if (CMD::is_im_r(in_data))
+        if (arg + 2 != argc && arg + 3 != argc)
         {
-            auto cmd = CMD::get_im_r(in_data);
-            im_r(cmd);
+            usage(argv[0]);
+            return 1;
         }
-        else
+
+        if constexpr (TRACE)
         {
-            printf("X im_r");
+            printf("--ensemble needs the silent build (-DSIM_SILENT)\n");
+            return 1;
         }
-    }
-}
-
-
-namespace CMP
-{
-    using R = REG::Reg;
 
-    typedef void (*func_t)(int);
+        u32 n_inputs = arg + 2 < argc ? (u32)atoi(argv[arg + 2]) : ENSEMBLE::LANES;
 
+        // init is a u16
+        if (!n_inputs || n_inputs > 0x10000)
+        {
+            usage(argv[0]);
+            return 1;
+        }
 
-    static u16 cmp_high(u16 reg, int v)
-    {
-        auto high = (u16)(reg & REG::HI_8) << 8;
+        if (!ENSEMBLE::run(argv[arg + 1], n_inputs))
+        {
+            printf("ensemble failed: %s\n", argv[arg + 1]);
+            return 1;
+        }
 
-        return high - (u16)((v & REG::LOW_8) << 8);
+        return 0;
     }
 
-
-    static u16 cmp_low(u16 reg, int v)
+    if (arg < argc && strcmp(argv[arg], "--recompile") == 0)
     {
-        auto low = (u16)(reg & REG::LOW_8);
-
-        return low - (u16)((v & REG::LOW_8) << 8); 
-    }
-
-
-    static void ax(int v) { REG::set_z_flag(REG::AX - (u16)v); }
-    static void bx(int v) { REG::set_z_flag(REG::BX - (u16)v); }
-    static void cx(int v) { REG::set_z_flag(REG::CX - (u16)v); }
-    static void dx(int v) { REG::set_z_flag(REG::DX - (u16)v); }
-
-    static void ah(int v) { REG::set_z_flag(cmp_high(REG::AX, v)); }
-    static void bh(int v) { REG::set_z_flag(cmp_high(REG::BX, v)); }
-    static void ch(int v) { REG::set_z_flag(cmp_high(REG::CX, v)); }
-    static void dh(int v) { REG::set_z_flag(cmp_high(REG::DX, v)); }
-
-    static void al(int v) { REG::set_z_flag(cmp_low(REG::AX, v)); }
-    static void bl(int v) { REG::set_z_flag(cmp_low(REG::BX, v)); }
-    static void cl(int v) { REG::set_z_flag(cmp_low(REG::CX, v)); }
-    static void dl(int v) { REG::set_z_flag(cmp_low(REG::DX, v)); }
+        if (arg + 1 >= argc || arg + 3 < argc)
+        {
+            usage(argv[0]);
+            return 1;
+        }
 
-    static void sp(int v) { REG::set_z_flag(REG::SP - (u16)v); }
-    static void bp(int v) { REG::set_z_flag(REG::BP - (u16)v); }
-    static void si(int v) { REG::set_z_flag(REG::SI - (u16)v); }
-    static void di(int v) { REG::set_z_flag(REG::DI - (u16)v); }
+        auto out_file = argv[arg + 1];
+        if (arg + 2 < argc)
+        {
+            bin_file = argv[arg + 2];
+        }
 
-    static void no_op(int) {}
+        if (!recompile_bin_file(bin_file, out_file))
+        {
+            printf("recompile failed: %s\n", bin_file);
+            return 1;
+        }
 
+        printf("%s -> %s\n", bin_file, out_file);
+        return 0;
+    }
 
-    static func_t get_cmp_f(R reg)
+    if (arg < argc && strcmp(argv[arg], "--bench") == 0)
     {
-        switch (reg)
+        if (arg + 3 < argc)
         {
-        case R::ax: return ax;
-        case R::bx: return bx;
-        case R::cx: return cx;
-        case R::dx: return dx;
-        
-        case R::ah: return ah;
-        case R::bh: return bh;
-        case R::ch: return ch;
-        case R::dh: return dh;
+            usage(argv[0]);
+            return 1;
+        }
 
-        case R::al: return al;
-        case R::bl: return bl;
-        case R::cl: return cl;
-        case R::dl: return dl;
+        u32 n_mb = arg + 1 < argc ? (u32)atoi(argv[arg + 1]) : 256;
+        u64 seed = arg + 2 < argc ? (u64)atoll(argv[arg + 2]) : 1;
 
-        case R::sp: return sp;
-        case R::bp: return bp;
-        case R::si: return si;
-        case R::di: return di;
+        if (!BENCH::run(n_mb, seed))
+        {
+            printf("bench failed\n");
+            return 1;
         }
 
-        return no_op;
+        return 0;
     }
 
-
-    static void r_r(CMD::Reg2Reg const& cmd)
+    if (arg < argc && strcmp(argv[arg], "--index") == 0)
     {
-        CMD::print(cmd, "cmp");
+        if (arg + 2 != argc)
+        {
+            usage(argv[0]);
+            return 1;
+        }
 
-        auto f = get_cmp_f(cmd.dst);
-        auto val = REG::get_value(cmd.src);
-        if (val >= 0)
+        if (!INDEX::run(argv[arg + 1]))
         {
-            f(val);
+            printf("index failed: %s\n", argv[arg + 1]);
+            return 1;
         }
-    }
 
+        return 0;
+    }
 
-    static void rm_r(DATA::InstrData const& in_data)
+    if (arg < argc && strcmp(argv[arg], "--cfg") == 0)
     {
-        if (CMD::is_r_r(in_data))
+        if (arg + 1 >= argc || arg + 3 < argc)
         {
-            auto cmd = CMD::get_r_r(in_data);
-            r_r(cmd);
+            usage(argv[0]);
+            return 1;
         }
-        else
+
+        if (arg + 2 < argc)
         {
-            printf("X rm_r");
+            bin_file = argv[arg + 2];
         }
-    }
-}
 
-
-namespace JUMP
-{
-    static void jnz(CMD::Jump const& cmd)
-    {
-        CMD::print(cmd, "jnz");
-        if (REG::zf())
+        if (!CFG::run(cpu, bin_file, argv[arg + 1]))
         {
-            REG::set_ip(REG::ip() + 2);
+            printf("cfg failed: %s\n", bin_file);
+            return 1;
         }
-        else
+
+        return 0;
+    }
+
+    if (arg < argc && strcmp(argv[arg], "--format") == 0)
+    {
+        if (arg + 1 >= argc || arg + 3 < argc)
         {
-            REG::set_ip(REG::ip() + cmd.j_offset);
+            usage(argv[0]);
+            return 1;
         }
-    }
-}
 
+        cstr trace_bin = arg + 2 < argc ? argv[arg + 2] : nullptr;
 
-static int decode_next(u8* data, int offset)
-{
-    auto byte1 = data[offset];
-    auto byte2 = data[offset + 1];        
+        if (!RECORD::format(argv[arg + 1], trace_bin))
+        {
+            printf("format failed: %s\n", argv[arg + 1]);
+            return 1;
+        }
 
-    auto byte1_top4 = byte1 >> 4;
-    auto byte1_top6 = byte1 >> 2;
-    auto byte1_top7 = byte1 >> 1;
+        return 0;
+    }
 
-    auto byte2_345 = (byte2 & 0b00'111'000) >> 3;
+    cstr trace_file = nullptr;
+    bool clocks = false;
+    bool profile = false;
+    cstr folded_file = nullptr;
 
-    if (byte1_top6 == 0b0010'0010)
+    if (arg < argc && strcmp(argv[arg], "--record") == 0)
     {
-        auto inst = DATA::get_rm_r(data, offset);
-        MOV::rm_r(inst);
-        offset = REG::ip();
-    }
-    else if (byte1_top7 == 0b0110'0011)
-    {
-        auto inst = DATA::get_mov_im_rm(data, offset);
-        MOV::im_rm(inst);
-        offset = REG::ip();
+        if (arg + 1 >= argc)
+        {
+            usage(argv[0]);
+            return 1;
+        }
+
+        trace_file = argv[arg + 1];
+        arg += 2;
     }
-    else if (byte1_top4 == 0b0000'1011)
+    else if (arg < argc && strcmp(argv[arg], "--clocks") == 0)
     {
-        auto inst = DATA::get_mov_im_r(data, offset);
-        MOV::im_r(inst);
-        offset = REG::ip();
+        clocks = true;
+        ++arg;
     }
-    else if (byte1_top7 == 0b0110'0011)
+    else if (arg < argc && strcmp(argv[arg], "--profile") == 0)
     {
-        auto inst = DATA::get_mov_m_ac(data, offset);
-        //auto cmd = CMD::get_m_ac(inst);
-        //MOV::m_ac(cmd);
-        offset = REG::ip();
+        profile = true;
+        ++arg;
     }
-    else if (byte1_top7 == 0b0101'0001)
+    else if (arg < argc && strcmp(argv[arg], "--callgraph") == 0)
     {
-        auto inst = DATA::get_mov_m_ac(data, offset);
-        //auto cmd = CMD::get_ac_m(inst);
-        //MOV::ac_m(cmd);
-        offset = REG::ip();
-    }
+        if (arg + 1 >= argc)
+        {
+            usage(argv[0]);
+            return 1;
+        }
 
-    else if (byte1_top6 == 0b0000'0000)
-    {
-        auto inst = DATA::get_rm_r(data, offset);
-        ADD::rm_r(inst);
-        offset = REG::ip();
-    }
-    else if (byte1_top6 == 0b0010'0000 && byte2_345 == 0b0000'0000)
-    {
-        auto inst = DATA::get_im_rm(data, offset);
-        ADD::im_rm(inst);
-        offset = REG::ip();
-    }
-    else if (byte1_top7 == 0b0001'0110)
-    {
-        auto inst = DATA::get_im_ac(data, offset);
-        //auto cmd = CMD::get_im_ac(inst);
-        //ADD::im_ac(cmd);
-        offset = REG::ip();
+        folded_file = argv[arg + 1];
+        arg += 2;
     }
 
-    else if (byte1_top6 == 0b0000'1010)
+    if (arg < argc && strcmp(argv[arg], "--engine") == 0)
     {
-        auto inst = DATA::get_rm_r(data, offset);
-        SUB::rm_r(inst);
-        offset = REG::ip();
+        if (arg + 1 >= argc)
+        {
+            usage(argv[0]);
+            return 1;
+        }
+
+        auto engine = argv[arg + 1];
+
+        if (strcmp(engine, "decode") == 0)
+        {
+            run_bin_file = decode_bin_file;
+        }
+        else if (strcmp(engine, "threaded") == 0)
+        {
+            run_bin_file = thread_bin_file;
+        }
+        else if (strcmp(engine, "jit") == 0)
+        {
+            run_bin_file = jit_bin_file;
+        }
+        else if (strcmp(engine, "ffwd") == 0)
+        {
+            run_bin_file = ffwd_bin_file;
+        }
+        else
+        {
+            usage(argv[0]);
+            return 1;
+        }
+
+        arg += 2;
     }
-    else if (byte1_top6 == 0b0010'0000 && byte2_345 == 0b0000'0101)
+
+    if (arg < argc)
     {
-        auto inst = DATA::get_im_rm(data, offset);
-        SUB::im_rm(inst);
-        offset = REG::ip();
+        bin_file = argv[arg++];
     }
-    else if (byte1_top7 == 0b0001'0110)
+
+    if (arg < argc)
     {
-        auto inst = DATA::get_im_ac(data, offset);
-        //auto cmd = CMD::get_im_ac(inst);
-        //SUB::im_ac(cmd);
-        offset = REG::ip();
+        usage(argv[0]);
+        return 1;
     }
 
-    else if (byte1_top6 == 0b0000'1110)
+    if (folded_file)
     {
-        auto inst = DATA::get_rm_r(data, offset);
-        CMP::rm_r(inst);
-        offset = REG::ip();
+        if (!callgraph_bin_file(cpu, bin_file, folded_file))
+        {
+            printf("callgraph failed: %s\n", bin_file);
+            return 1;
+        }
     }
-    else if (byte1_top6 == 0b0010'0000 && byte2_345 == 0b0000'0111)
+    else if (profile)
     {
-        auto inst = DATA::get_im_rm(data, offset);
-        //auto cmd = CMD::get_im_rm(inst);
-        //CMP::im_rm(cmd);
-        offset = REG::ip();
+        if (!profile_bin_file(cpu, bin_file))
+        {
+            printf("profile failed: %s\n", bin_file);
+            return 1;
+        }
     }
-    else if (byte1_top7 == 0b0001'1110)
+    else if (clocks)
     {
-        auto inst = DATA::get_im_ac(data, offset);
-        //auto cmd = CMD::get_im_ac(inst);
-        //CMP::im_ac(cmd);
-        offset = REG::ip();
+        if (!clocks_bin_file(cpu, bin_file))
+        {
+            printf("clocks failed: %s\n", bin_file);
+            return 1;
+        }
     }
-
-    else if (byte1 == 0b0111'0101)
+    else if (trace_file)
     {
-        auto inst = DATA::get_jump(data, offset);
-        auto cmd = CMD::get_jump(inst);
-        JUMP::jnz(cmd);
-        offset = REG::ip();
+        if (!record_bin_file(cpu, bin_file, trace_file))
+        {
+            printf("record failed: %s\n", trace_file);
+            return 1;
+        }
     }
-
     else
     {
-        offset = -1;
-    }
-
-    REG::print_trace();
-    printf("\n");
-
-    return offset;
-}
-
-
-static void decode_bin_file(cstr bin_file)
-{
-    auto buffer = Bytes::read(bin_file);
-
-    assert(buffer.data);
-    assert(buffer.size);
-
-    int offset = 0;
-    while (offset >= 0 && offset < buffer.size)
-    {
-        offset = decode_next(buffer.data, offset);
+        run_bin_file(cpu, bin_file);
     }
-}
-
-
-int main()
-{
-    //constexpr auto file_old = "../06/listing_0044_register_movs";
-    //constexpr auto file_old = "../07/listing_0046_add_sub_cmp";
-    //constexpr auto file_old = "../08/listing_0048_ip_register";
-    //constexpr auto file_old = "../08/listing_0049_conditional_jumps";
-
-    constexpr auto file_051 = "listing_0051_memory_mov";
-    constexpr auto file_052 = "listing_0052_memory_add_loop";
-
-    decode_bin_file(file_052);
 
     printf("\nFinal registers:\n");
-    REG::print_all();
+    REG::print_all(cpu);
 
-    /*REG::reset();
+    /*REG::reset(cpu);
 
-    decode_bin_file(file_052);
+    decode_bin_file(cpu, file_052);
     printf("\nFinal registers:\n");
-    REG::print_all();*/
+    REG::print_all(cpu);*/
     
 }
\ No newline at end of file
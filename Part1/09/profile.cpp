@@ -0,0 +1,227 @@
+namespace PROFILE
+{
+    constexpr u32 LINE_SIZE = 16;
+    constexpr u32 N_LINES = MEMORY::SIZE / LINE_SIZE;
+
+    // rows printed in the memory table
+    constexpr u32 MAX_LINE_ROWS = 16;
+
+
+    class Hotspots
+    {
+    public:
+        // executions and clocks by ip
+        CLOCKS::Profile clocks;
+
+        // physical memory traffic by 16 byte line
+        u32* line_reads = nullptr;
+        u32* line_writes = nullptr;
+    };
+
+
+    static void destroy(Hotspots& hs)
+    {
+        CLOCKS::destroy(hs.clocks);
+
+        if (hs.line_reads)
+        {
+            std::free(hs.line_reads);
+            hs.line_reads = nullptr;
+        }
+
+        if (hs.line_writes)
+        {
+            std::free(hs.line_writes);
+            hs.line_writes = nullptr;
+        }
+    }
+
+
+    static bool create(Hotspots& hs, u32 size)
+    {
+        assert(!hs.line_reads);
+
+        if (!CLOCKS::create(hs.clocks, size))
+        {
+            return false;
+        }
+
+        hs.line_reads = (u32*)std::calloc(N_LINES, sizeof(u32));
+        hs.line_writes = (u32*)std::calloc(N_LINES, sizeof(u32));
+        if (!hs.line_reads || !hs.line_writes)
+        {
+            destroy(hs);
+            return false;
+        }
+
+        return true;
+    }
+
+
+    // each line is charged for the elements that touch it, a word can straddle two lines
+    static void count_access(Hotspots& hs, CLOCKS::Access const& access)
+    {
+        if (access.addr < 0 || !access.size || !access.count)
+        {
+            return;
+        }
+
+        u32 bytes = access.count * access.size;
+        u32 begin = access.down ? (u32)access.addr + access.size - bytes : (u32)access.addr;
+        u32 end = begin + bytes;
+
+        for (u32 line = begin / LINE_SIZE; line <= (end - 1) / LINE_SIZE && line < N_LINES; ++line)
+        {
+            auto lo = std::max(begin, line * LINE_SIZE);
+            auto hi = std::min(end, (line + 1) * LINE_SIZE);
+            auto n = (hi - lo + access.size - 1) / access.size;
+
+            hs.line_reads[line] += access.read ? n : 0;
+            hs.line_writes[line] += access.write ? n : 0;
+        }
+    }
+
+
+    static bool run(CpuState& cpu, u8* data, u32 size, Hotspots& hs)
+    {
+        CACHE::OpCache cache{};
+        if (!CACHE::create(cache, size))
+        {
+            assert(false);
+            return false;
+        }
+
+        auto& prof = hs.clocks;
+
+        int offset = 0;
+        while (offset >= 0 && offset < size)
+        {
+            auto& op = CACHE::get_op(cache, data, offset);
+            if (!op.exec)
+            {
+                break;
+            }
+
+            auto est = CLOCKS::estimate(cpu, op);
+
+            OP::execute(cpu, op);
+
+            CLOCKS::complete(est, cpu, op, offset);
+
+            auto clocks = est.total();
+            prof.total += clocks;
+            prof.clocks[offset] += clocks;
+            prof.counts[offset]++;
+
+            count_access(hs, est.access);
+            count_access(hs, est.src);
+
+            REG::print_trace(cpu);
+
+            offset = REG::ip(cpu);
+        }
+
+        CACHE::destroy(cache);
+
+        return true;
+    }
+
+
+    // sorts indices by descending key, equal keys keep their order
+    template <typename T>
+    static void sort_desc(u32* ids, u32 n, T const* keys)
+    {
+        std::stable_sort(ids, ids + n, [&](u32 a, u32 b) { return keys[b] < keys[a]; });
+    }
+
+
+    static void print_ips(Hotspots const& hs, u8* data, u32 size)
+    {
+        auto& prof = hs.clocks;
+
+        auto ids = (u32*)std::malloc(sizeof(u32) * size);
+        if (!ids)
+        {
+            assert(false);
+            return;
+        }
+
+        u32 n = 0;
+        for (u32 ip = 0; ip < size; ++ip)
+        {
+            if (prof.counts[ip])
+            {
+                ids[n++] = ip;
+            }
+        }
+
+        sort_desc(ids, n, prof.clocks);
+
+        printf("\nHotspots by clocks:\n");
+        printf("      ip    count     clocks       %%  instruction\n");
+
+        for (u32 i = 0; i < n; ++i)
+        {
+            auto ip = ids[i];
+            auto pct = prof.total ? 100.0 * prof.clocks[ip] / prof.total : 0.0;
+
+            printf("  0x%04x %8u %10llu %6.2f%%  ", ip, prof.counts[ip], (unsigned long long)prof.clocks[ip], pct);
+            RECORD::print_op(decode_next(data, (int)ip));
+            printf("\n");
+        }
+
+        printf("\nTotal clocks: %llu\n", (unsigned long long)prof.total);
+
+        std::free(ids);
+    }
+
+
+    static void print_lines(Hotspots const& hs)
+    {
+        auto ids = (u32*)std::malloc(sizeof(u32) * N_LINES);
+        auto totals = (u64*)std::malloc(sizeof(u64) * N_LINES);
+        if (!ids || !totals)
+        {
+            assert(false);
+            std::free(ids);
+            std::free(totals);
+            return;
+        }
+
+        u32 n = 0;
+        for (u32 line = 0; line < N_LINES; ++line)
+        {
+            totals[line] = (u64)hs.line_reads[line] + hs.line_writes[line];
+            if (totals[line])
+            {
+                ids[n++] = line;
+            }
+        }
+
+        sort_desc(ids, n, totals);
+
+        printf("\nMemory by %u byte line:\n", LINE_SIZE);
+        printf("    address      reads     writes\n");
+
+        for (u32 i = 0; i < n && i < MAX_LINE_ROWS; ++i)
+        {
+            auto line = ids[i];
+            printf("  0x%05x %10u %10u\n", line * LINE_SIZE, hs.line_reads[line], hs.line_writes[line]);
+        }
+
+        if (n > MAX_LINE_ROWS)
+        {
+            printf("  ... %u more lines\n", n - MAX_LINE_ROWS);
+        }
+
+        std::free(ids);
+        std::free(totals);
+    }
+
+
+    static void print(Hotspots const& hs, u8* data, u32 size)
+    {
+        print_ips(hs, data, size);
+        print_lines(hs);
+    }
+}
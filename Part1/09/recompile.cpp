@@ -0,0 +1,563 @@
+namespace RECOMP
+{
+    using Reg = REG::Reg;
+    using MR = REG::MemReg;
+
+
+    // what the control flow walk found at each offset
+    class Site
+    {
+    public:
+        bool is_instr = false;
+        bool is_leader = false;
+    };
+
+
+    static bool is_reg16(Reg r)
+    {
+        return (int)r >= (int)Reg::ax && (int)r <= (int)Reg::di;
+    }
+
+
+    static cstr get_ea_str(MR mr)
+    {
+        switch(mr)
+        {
+        case MR::m_bx_si: return "cpu.bx + cpu.si";
+        case MR::m_bx_di: return "cpu.bx + cpu.di";
+        case MR::m_bp_si: return "cpu.bp + cpu.si";
+        case MR::m_bp_di: return "cpu.bp + cpu.di";
+        case MR::m_si: return "cpu.si";
+        case MR::m_di: return "cpu.di";
+        case MR::m_bp: return "cpu.bp";
+        case MR::m_bx: return "cpu.bx";
+        }
+
+        return "err";
+    }
+
+
+    // offsets wrap at 64k as in REG::get_address, recompiled segments are 0
+    static void write_ea(std::ofstream& out, MR mr, int disp)
+    {
+        out << "(u16)(" << get_ea_str(mr);
+        if (disp)
+        {
+            out << (disp < 0 ? " - " : " + ") << std::abs(disp);
+        }
+
+        out << ")";
+    }
+
+
+    static void write_header(std::ofstream& out, cstr bin_file)
+    {
+        out << "// generated from " << bin_file << "\n"
+            << "\n"
+            << "#include <cstdio>\n"
+            << "#include <cstdint>\n"
+            << "#include <cstring>\n"
+            << "\n"
+            << "using u8 = uint8_t;\n"
+            << "using u16 = uint16_t;\n"
+            << "using cstr = const char*;\n"
+            << "\n"
+            << "\n"
+            << "constexpr u16 CF = " << REG::CF << ";\n"
+            << "constexpr u16 PF = " << REG::PF << ";\n"
+            << "constexpr u16 AF = " << REG::AF << ";\n"
+            << "constexpr u16 ZF = " << REG::ZF << ";\n"
+            << "constexpr u16 SF = " << REG::SF << ";\n"
+            << "constexpr u16 OF = " << REG::OF << ";\n"
+            << "\n"
+            << "constexpr u16 ALU_NONE = " << (int)REG::Alu::none << ";\n"
+            << "constexpr u16 ALU_ADD = " << (int)REG::Alu::add << ";\n"
+            << "constexpr u16 ALU_SUB = " << (int)REG::Alu::sub << ";\n"
+            << "\n"
+            << "\n"
+            << "class CpuState\n"
+            << "{\n"
+            << "public:\n"
+            << "    u16 ax = 0;\n"
+            << "    u16 bx = 0;\n"
+            << "    u16 cx = 0;\n"
+            << "    u16 dx = 0;\n"
+            << "    u16 sp = 0;\n"
+            << "    u16 bp = 0;\n"
+            << "    u16 si = 0;\n"
+            << "    u16 di = 0;\n"
+            << "    u16 ip = 0;\n"
+            << "\n"
+            << "    // lazy flags, only 16 bit ops are recompiled\n"
+            << "    u16 flags = 0;\n"
+            << "    u16 alu = ALU_NONE;\n"
+            << "    u16 alu_dst = 0;\n"
+            << "    u16 alu_src = 0;\n"
+            << "    u16 alu_res = 0;\n"
+            << "};\n"
+            << "\n"
+            << "\n"
+            << "static u8 MEM[" << MEMORY::SIZE << "] = { 0 };\n"
+            << "\n"
+            << "\n"
+            << "static u16 load16(u8* mem, int addr)\n"
+            << "{\n"
+            << "    u16 v = 0;\n"
+            << "    memcpy(&v, mem + addr, sizeof(v));\n"
+            << "    return v;\n"
+            << "}\n"
+            << "\n"
+            << "\n"
+            << "static void store16(u8* mem, int addr, u16 v)\n"
+            << "{\n"
+            << "    memcpy(mem + addr, &v, sizeof(v));\n"
+            << "}\n"
+            << "\n"
+            << "\n"
+            << "static u16 set_alu(CpuState& cpu, u16 alu, u16 dst, u16 src)\n"
+            << "{\n"
+            << "    cpu.alu = alu;\n"
+            << "    cpu.alu_dst = dst;\n"
+            << "    cpu.alu_src = src;\n"
+            << "    cpu.alu_res = (u16)(alu == ALU_ADD ? dst + src : dst - src);\n"
+            << "\n"
+            << "    return cpu.alu_res;\n"
+            << "}\n"
+            << "\n"
+            << "\n"
+            << "static u16 get_flags(CpuState const& cpu)\n"
+            << "{\n"
+            << "    if (cpu.alu == ALU_NONE)\n"
+            << "    {\n"
+            << "        return cpu.flags;\n"
+            << "    }\n"
+            << "\n"
+            << "    u16 dst = cpu.alu_dst;\n"
+            << "    u16 src = cpu.alu_src;\n"
+            << "    u16 res = cpu.alu_res;\n"
+            << "\n"
+            << "    u16 flags = 0;\n"
+            << "\n"
+            << "    if (!res) { flags |= ZF; }\n"
+            << "    if (res & 0x8000) { flags |= SF; }\n"
+            << "    if (!__builtin_parity(res & 0xFF)) { flags |= PF; }\n"
+            << "    if ((dst ^ src ^ res) & 0x10) { flags |= AF; }\n"
+            << "\n"
+            << "    if (cpu.alu == ALU_ADD)\n"
+            << "    {\n"
+            << "        if (dst + src > 0xFFFF) { flags |= CF; }\n"
+            << "        if ((dst ^ res) & (src ^ res) & 0x8000) { flags |= OF; }\n"
+            << "    }\n"
+            << "    else\n"
+            << "    {\n"
+            << "        if (src > dst) { flags |= CF; }\n"
+            << "        if ((dst ^ src) & (dst ^ res) & 0x8000) { flags |= OF; }\n"
+            << "    }\n"
+            << "\n"
+            << "    return flags;\n"
+            << "}\n"
+            << "\n"
+            << "\n";
+    }
+
+
+    static void write_footer(std::ofstream& out)
+    {
+        out << "static void print_flags(u16 flags)\n"
+            << "{\n"
+            << "    constexpr int n_flags = 6;\n"
+            << "    constexpr u16 bits[n_flags] = { CF, PF, AF, ZF, SF, OF };\n"
+            << "    constexpr char letters[n_flags] = { 'C', 'P', 'A', 'Z', 'S', 'O' };\n"
+            << "\n"
+            << "    for (int i = 0; i < n_flags; ++i)\n"
+            << "    {\n"
+            << "        if (flags & bits[i])\n"
+            << "        {\n"
+            << "            printf(\"%c\", letters[i]);\n"
+            << "        }\n"
+            << "    }\n"
+            << "}\n"
+            << "\n"
+            << "\n"
+            << "static void print_all(CpuState const& cpu)\n"
+            << "{\n"
+            << "    auto const print = [](cstr str, int val){ printf(\"%s: 0x%04x (%d)\\n\", str, val, val); };\n"
+            << "\n"
+            << "    print(\"ax\", cpu.ax);\n"
+            << "    print(\"bx\", cpu.bx);\n"
+            << "    print(\"cx\", cpu.cx);\n"
+            << "    print(\"dx\", cpu.dx);\n"
+            << "    print(\"sp\", cpu.sp);\n"
+            << "    print(\"bp\", cpu.bp);\n"
+            << "    print(\"si\", cpu.si);\n"
+            << "    print(\"di\", cpu.di);\n"
+            << "    print(\"ip\", cpu.ip);\n"
+            << "\n"
+            << "    printf(\"flags: \");\n"
+            << "    print_flags(get_flags(cpu));\n"
+            << "    printf(\"\\n\");\n"
+            << "}\n"
+            << "\n"
+            << "\n"
+            << "int main()\n"
+            << "{\n"
+            << "    CpuState cpu{};\n"
+            << "\n"
+            << "    run(cpu, MEM);\n"
+            << "\n"
+            << "    print_all(cpu);\n"
+            << "}\n";
+    }
+
+
+    // a leader whose bytes do not decode has no block
+    static void write_goto(std::ofstream& out, Site const* sites, u32 size, int target)
+    {
+        if (target >= 0 && target < (int)size && sites[target].is_leader && sites[target].is_instr)
+        {
+            out << "goto block_" << target << ";";
+        }
+        else
+        {
+            out << "{ cpu.ip = " << target << "; return; }";
+        }
+    }
+
+
+    // writes the semantics of REG/MOV/ADD/SUB/CMP for one instruction
+    static bool write_op(std::ofstream& out, OP::Op const& op)
+    {
+        using F = OP::Form;
+
+        auto& in = op.in;
+        auto const reg = [](Reg r){ return REG::get_str(r); };
+
+        if (op.exec == OP::no_op)
+        {
+            out << "    // no op\n";
+            return true;
+        }
+
+        auto form = OP::get_form(op);
+
+        switch (form)
+        {
+        case F::mov_r_r:
+        {
+            auto cmd = CMD::get_r_r(in);
+            if (!is_reg16(cmd.src) || !is_reg16(cmd.dst))
+            {
+                return false;
+            }
+
+            out << "    cpu." << reg(cmd.dst) << " = cpu." << reg(cmd.src) << ";\n";
+        } return true;
+
+        case F::mov_m_r:
+        {
+            auto cmd = CMD::get_m_r(in);
+            if (!is_reg16(cmd.dst))
+            {
+                return false;
+            }
+
+            out << "    cpu." << reg(cmd.dst) << " = load16(mem, " << cmd.src << ");\n";
+        } return true;
+
+        case F::mov_r_rm:
+        {
+            auto cmd = CMD::get_r_mr(in);
+            if (in.mod_b2 != 0b00 || cmd.dst == MR::none || !is_reg16(cmd.src))
+            {
+                return false;
+            }
+
+            out << "    store16(mem, ";
+            write_ea(out, cmd.dst, 0);
+            out << ", cpu." << reg(cmd.src) << ");\n";
+        } return true;
+
+        case F::mov_rm_r:
+        {
+            auto cmd = CMD::get_rm_r(in);
+            if (in.mod_b2 != 0b00 || cmd.src == MR::none || !is_reg16(cmd.dst))
+            {
+                return false;
+            }
+
+            out << "    cpu." << reg(cmd.dst) << " = load16(mem, ";
+            write_ea(out, cmd.src, 0);
+            out << ");\n";
+        } return true;
+
+        case F::mov_im_m:
+        {
+            auto cmd = CMD::get_im_m(in);
+            if (cmd.im_size == 1)
+            {
+                out << "    mem[" << cmd.dst << "] = (u8)" << (cmd.src & 0xFF) << ";\n";
+            }
+            else if (cmd.im_size == 2)
+            {
+                out << "    store16(mem, " << cmd.dst << ", (u16)" << (cmd.src & 0xFFFF) << ");\n";
+            }
+            else
+            {
+                return false;
+            }
+        } return true;
+
+        case F::mov_im_rmd:
+        {
+            auto cmd = CMD::get_im_rmd(in);
+
+            if (cmd.dst == MR::none)
+            {
+                return false;
+            }
+
+            if (cmd.im_size == 1)
+            {
+                out << "    mem[";
+                write_ea(out, cmd.dst, cmd.disp);
+                out << "] = (u8)" << (cmd.src & 0xFF) << ";\n";
+            }
+            else if (cmd.im_size == 2)
+            {
+                out << "    store16(mem, ";
+                write_ea(out, cmd.dst, cmd.disp);
+                out << ", (u16)" << (cmd.src & 0xFFFF) << ");\n";
+            }
+            else
+            {
+                return false;
+            }
+        } return true;
+
+        case F::mov_im_r:
+        {
+            auto cmd = CMD::get_mov_im_r(in);
+            if (!is_reg16(cmd.dst))
+            {
+                return false;
+            }
+
+            out << "    cpu." << reg(cmd.dst) << " = " << (cmd.src & 0xFFFF) << ";\n";
+        } return true;
+
+        case F::add_r_r:
+        case F::sub_r_r:
+        {
+            auto cmd = CMD::get_r_r(in);
+            if (!is_reg16(cmd.src) || !is_reg16(cmd.dst))
+            {
+                return false;
+            }
+
+            auto alu = form == F::add_r_r ? "ALU_ADD" : "ALU_SUB";
+
+            out << "    cpu." << reg(cmd.dst) << " = set_alu(cpu, " << alu << ", cpu." << reg(cmd.dst) << ", cpu." << reg(cmd.src) << ");\n";
+        } return true;
+
+        case F::add_im_r:
+        case F::sub_im_r:
+        {
+            auto cmd = CMD::get_im_r(in);
+            if (!is_reg16(cmd.dst))
+            {
+                return false;
+            }
+
+            auto alu = form == F::add_im_r ? "ALU_ADD" : "ALU_SUB";
+
+            out << "    cpu." << reg(cmd.dst) << " = set_alu(cpu, " << alu << ", cpu." << reg(cmd.dst) << ", (u16)" << (cmd.src & 0xFFFF) << ");\n";
+        } return true;
+
+        case F::cmp_r_r:
+        {
+            auto cmd = CMD::get_r_r(in);
+            if (!is_reg16(cmd.src) || !is_reg16(cmd.dst))
+            {
+                return false;
+            }
+
+            out << "    set_alu(cpu, ALU_SUB, cpu." << reg(cmd.dst) << ", cpu." << reg(cmd.src) << ");\n";
+        } return true;
+
+        default:
+            return false;
+        }
+    }
+
+
+    // walks control flow from the entry and marks instructions and block leaders
+    static bool find_blocks(CACHE::OpCache& cache, u8* data, u32 size, Site* sites)
+    {
+        int* stack = (int*)std::malloc(sizeof(int) * (size + 2));
+        if (!stack)
+        {
+            return false;
+        }
+
+        int top = 0;
+
+        auto const push = [&](int offset)
+        {
+            if (offset >= 0 && offset < (int)size && !sites[offset].is_instr)
+            {
+                stack[top++] = offset;
+            }
+        };
+
+        sites[0].is_leader = true;
+        push(0);
+
+        while (top > 0)
+        {
+            auto offset = stack[--top];
+
+            while (offset < (int)size && !sites[offset].is_instr)
+            {
+                auto& op = CACHE::get_op(cache, data, offset);
+                if (!op.exec)
+                {
+                    break;
+                }
+
+                sites[offset].is_instr = true;
+
+                auto form = OP::get_form(op);
+
+                // the return address comes from the stack
+                if (form == OP::Form::ret)
+                {
+                    break;
+                }
+
+                // a call is walked into and returned from
+                if (form == OP::Form::jnz || form == OP::Form::call)
+                {
+                    auto target = offset + CMD::get_jump(op.in).j_offset;
+                    auto next = offset + op.in.length;
+
+                    if (target >= 0 && target < (int)size)
+                    {
+                        sites[target].is_leader = true;
+                    }
+
+                    if (next < (int)size)
+                    {
+                        sites[next].is_leader = true;
+                    }
+
+                    push(target);
+                    push(next);
+                    break;
+                }
+
+                offset = offset + op.in.length;
+            }
+        }
+
+        std::free(stack);
+
+        return true;
+    }
+
+
+    static bool write_blocks(std::ofstream& out, CACHE::OpCache& cache, u8* data, u32 size, Site const* sites)
+    {
+        out << "static void run(CpuState& cpu, u8* mem)\n"
+            << "{\n";
+
+        for (int offset = 0; offset < (int)size; ++offset)
+        {
+            if (!sites[offset].is_instr)
+            {
+                continue;
+            }
+
+            auto& op = CACHE::get_op(cache, data, offset);
+            auto next = offset + op.in.length;
+
+            if (sites[offset].is_leader)
+            {
+                out << "\nblock_" << offset << ":\n";
+            }
+
+            if (OP::get_form(op) == OP::Form::jnz)
+            {
+                auto target = offset + CMD::get_jump(op.in).j_offset;
+
+                out << "    if (!(get_flags(cpu) & ZF)) ";
+                write_goto(out, sites, size, target);
+                out << "\n";
+
+                out << "    ";
+                write_goto(out, sites, size, next);
+                out << "\n";
+                continue;
+            }
+
+            if (!write_op(out, op))
+            {
+                printf("recompile: unsupported instruction at 0x%x: ", offset);
+                DATA::print(op.in);
+                printf("\n");
+                return false;
+            }
+
+            if (next >= (int)size || !sites[next].is_instr)
+            {
+                // ran off the program or into bytes that do not decode
+                out << "    cpu.ip = " << next << ";\n"
+                    << "    return;\n";
+            }
+        }
+
+        out << "}\n"
+            << "\n"
+            << "\n";
+
+        return true;
+    }
+
+
+    static bool recompile(u8* data, u32 size, cstr bin_file, cstr out_file)
+    {
+        CACHE::OpCache cache{};
+        if (!CACHE::create(cache, size))
+        {
+            assert(false);
+            return false;
+        }
+
+        auto sites = (Site*)std::calloc(size, sizeof(Site));
+        if (!sites)
+        {
+            assert(false);
+            CACHE::destroy(cache);
+            return false;
+        }
+
+        std::ofstream out(out_file, std::ios::out);
+
+        auto result =
+            out.is_open() &&
+            find_blocks(cache, data, size, sites);
+
+        if (result)
+        {
+            write_header(out, bin_file);
+            result = write_blocks(out, cache, data, size, sites);
+            write_footer(out);
+        }
+
+        out.close();
+
+        std::free(sites);
+        CACHE::destroy(cache);
+
+        return result;
+    }
+}
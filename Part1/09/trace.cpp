@@ -0,0 +1,690 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <sys/mman.h>
+
+
+namespace RECORD
+{
+    using Reg = REG::Reg;
+    using MR = REG::MemReg;
+    using F = OP::Form;
+
+
+    constexpr u32 MAGIC = 0x36383038; // "8086"
+    constexpr u32 DEFAULT_CAPACITY = 1024 * 1024;
+
+    constexpr u8 NO_REG = 0xFF;
+
+
+    // lazy flags as CpuState keeps them, the formatter computes the flags
+    class AluState
+    {
+    public:
+        u8 alu = 0;
+        u8 w = 0;
+
+        u16 dst = 0;
+        u16 src = 0;
+        u16 res = 0;
+
+        // CpuState::FLAGS
+        u16 flags = 0;
+    };
+
+    static_assert(sizeof(AluState) == 10);
+
+
+    // one executed instruction, alu is the state after it
+    class Record
+    {
+    public:
+        u16 ip_begin = 0;
+        u16 ip_end = 0;
+
+        u8 form = 0;
+        u8 reg = NO_REG;
+
+        u16 reg_old = 0;
+        u16 reg_new = 0;
+
+        AluState alu;
+    };
+
+    static_assert(sizeof(Record) == 20);
+
+
+    // records are a ring buffer of capacity entries after the header
+    class Header
+    {
+    public:
+        u32 magic = 0;
+        u32 record_size = 0;
+
+        u64 count = 0;
+        u64 capacity = 0;
+
+        // final state, as CpuState::regs
+        u16 regs[8] = { 0 };
+        u16 ip = 0;
+        u16 flags = 0;
+
+        // state before the oldest record
+        AluState alu;
+
+        char bin_file[256] = { 0 };
+    };
+
+
+    class Recorder
+    {
+    public:
+        int fd = -1;
+
+        u8* data = nullptr;
+        size_t data_size = 0;
+
+        Header* header = nullptr;
+        Record* records = nullptr;
+    };
+
+
+    static size_t get_file_size(u64 capacity)
+    {
+        return sizeof(Header) + capacity * sizeof(Record);
+    }
+
+
+    static void close(Recorder& rec)
+    {
+        if (rec.data)
+        {
+            munmap(rec.data, rec.data_size);
+            rec.data = nullptr;
+        }
+
+        if (rec.fd >= 0)
+        {
+            ::close(rec.fd);
+            rec.fd = -1;
+        }
+
+        rec.header = nullptr;
+        rec.records = nullptr;
+    }
+
+
+    static bool create(Recorder& rec, cstr trace_file, u64 capacity, cstr bin_file)
+    {
+        assert(rec.fd < 0);
+        assert(capacity);
+
+        rec.fd = open(trace_file, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (rec.fd < 0)
+        {
+            return false;
+        }
+
+        rec.data_size = get_file_size(capacity);
+        if (ftruncate(rec.fd, rec.data_size) != 0)
+        {
+            close(rec);
+            return false;
+        }
+
+        auto data = mmap(0, rec.data_size, PROT_READ | PROT_WRITE, MAP_SHARED, rec.fd, 0);
+        if (data == MAP_FAILED)
+        {
+            close(rec);
+            return false;
+        }
+
+        rec.data = (u8*)data;
+        rec.header = (Header*)rec.data;
+        rec.records = (Record*)(rec.data + sizeof(Header));
+
+        auto& h = *rec.header;
+        h = Header{};
+        h.magic = MAGIC;
+        h.record_size = sizeof(Record);
+        h.capacity = capacity;
+        snprintf(h.bin_file, sizeof(h.bin_file), "%s", bin_file);
+
+        return true;
+    }
+
+
+    static AluState get_alu(CpuState const& cpu)
+    {
+        AluState alu{};
+        alu.alu = (u8)cpu.alu;
+        alu.w = cpu.alu_w;
+        alu.dst = cpu.alu_dst;
+        alu.src = cpu.alu_src;
+        alu.res = cpu.alu_res;
+        alu.flags = cpu.FLAGS;
+
+        return alu;
+    }
+
+
+    static u16 get_flags(AluState const& alu)
+    {
+        if ((REG::Alu)alu.alu == REG::Alu::none)
+        {
+            return alu.flags;
+        }
+
+        return REG::get_alu_flags((REG::Alu)alu.alu, alu.w, alu.dst, alu.src, alu.res) | (alu.flags & REG::DF);
+    }
+
+
+    // saves the final state and drops unused capacity from the file
+    static bool finish(Recorder& rec, CpuState& cpu)
+    {
+        auto& h = *rec.header;
+
+        for (int i = 0; i < REG::N_GENERAL; ++i)
+        {
+            h.regs[i] = cpu.regs[i];
+        }
+
+        h.ip = cpu.IP;
+        h.flags = REG::get_flags(cpu);
+
+        u64 capacity = h.capacity;
+        if (h.count < capacity)
+        {
+            capacity = h.count ? h.count : 1;
+            h.capacity = capacity;
+        }
+
+        munmap(rec.data, rec.data_size);
+        rec.data = nullptr;
+
+        auto res = ftruncate(rec.fd, get_file_size(capacity));
+        if (res != 0)
+        {
+            printf("ftruncate: %s\n", strerror(errno));
+        }
+
+        close(rec);
+
+        return res == 0;
+    }
+
+
+    static Record& begin(Recorder& rec, CpuState& cpu, OP::Op const& op)
+    {
+        auto& h = *rec.header;
+        auto& r = rec.records[h.count % h.capacity];
+
+        // the ring wrapped, the trace now starts after the oldest record
+        if (h.count >= h.capacity)
+        {
+            h.alu = r.alu;
+        }
+
+        r.ip_begin = cpu.IP;
+        r.form = (u8)op.form;
+
+        cpu.written_reg = Reg::none;
+
+        return r;
+    }
+
+
+    static void end(Recorder& rec, CpuState const& cpu, Record& r)
+    {
+        r.ip_end = cpu.IP;
+        r.alu = get_alu(cpu);
+        r.reg = cpu.written_reg == Reg::none ? NO_REG : (u8)cpu.written_reg;
+        r.reg_old = cpu.written_old;
+        r.reg_new = cpu.written_new;
+
+        ++rec.header->count;
+    }
+
+
+    static bool record(CpuState& cpu, u8* data, u32 size, cstr bin_file, cstr trace_file)
+    {
+        Recorder rec{};
+        if (!create(rec, trace_file, DEFAULT_CAPACITY, bin_file))
+        {
+            return false;
+        }
+
+        rec.header->alu = get_alu(cpu);
+
+        CACHE::OpCache cache{};
+        if (!CACHE::create(cache, size))
+        {
+            assert(false);
+            close(rec);
+            return false;
+        }
+
+        int offset = 0;
+        while (offset >= 0 && offset < size)
+        {
+            auto& op = CACHE::get_op(cache, data, offset);
+            if (!op.exec)
+            {
+                break;
+            }
+
+            auto& r = begin(rec, cpu, op);
+            OP::execute(cpu, op);
+            end(rec, cpu, r);
+
+            REG::print_trace(cpu);
+
+            offset = REG::ip(cpu);
+        }
+
+        CACHE::destroy(cache);
+
+        return finish(rec, cpu);
+    }
+}
+
+
+/* offline formatter */
+
+namespace RECORD
+{
+    static cstr get_ea_str(MR mr)
+    {
+        switch(mr)
+        {
+        case MR::m_bx_si: return "bx+si";
+        case MR::m_bx_di: return "bx+di";
+        case MR::m_bp_si: return "bp+si";
+        case MR::m_bp_di: return "bp+di";
+        case MR::m_si: return "si";
+        case MR::m_di: return "di";
+        case MR::m_bp: return "bp";
+        case MR::m_bx: return "bx";
+        }
+
+        return "err";
+    }
+
+
+    static cstr get_size_str(int size)
+    {
+        return size == 1 ? "byte" : "word";
+    }
+
+
+    static void print_flags(u16 flags)
+    {
+        printf("%s", REG::get_flags_str(flags).str);
+    }
+
+
+    // memory destinations are given a size
+    static void print_rm(DATA::Instr const& in, bool dst)
+    {
+        if (in.mod_b2 == 0b11)
+        {
+            printf("%s", REG::get_str(REG::get_reg(in.rm_b3, in.w_b1)));
+            return;
+        }
+
+        if (dst)
+        {
+            printf("%s ", get_size_str(in.w_b1 ? 2 : 1));
+        }
+
+        auto mr = REG::get_mem_reg(in.rm_b3, in.mod_b2);
+        if (mr == MR::none)
+        {
+            printf("[+%d]", in.disp);
+        }
+        else if (in.mod_b2 == 0b00)
+        {
+            printf("[%s]", get_ea_str(mr));
+        }
+        else
+        {
+            printf("[%s%+d]", get_ea_str(mr), (i16)in.disp);
+        }
+    }
+
+
+    static cstr get_alu_str(OP::exec_t exec)
+    {
+        if (exec == MOV::rm_r || exec == MOV::im_rm) { return "mov"; }
+        if (exec == ADD::rm_r || exec == ADD::im_rm || exec == ADD::im_ac) { return "add"; }
+        if (exec == SUB::rm_r || exec == SUB::im_rm || exec == SUB::im_ac) { return "sub"; }
+        if (exec == CMP::rm_r || exec == CMP::im_rm || exec == CMP::im_ac) { return "cmp"; }
+
+        return nullptr;
+    }
+
+
+    static cstr get_string_str(OP::exec_t exec)
+    {
+        if (exec == STRING::movs) { return "movs"; }
+        if (exec == STRING::cmps) { return "cmps"; }
+        if (exec == STRING::stos) { return "stos"; }
+        if (exec == STRING::lods) { return "lods"; }
+        if (exec == STRING::scas) { return "scas"; }
+
+        return nullptr;
+    }
+
+
+    // instructions without a form, by executor
+    // false when the executor is unknown
+    static bool print_other(OP::Op const& op)
+    {
+        auto& in = op.in;
+        auto exec = op.exec;
+
+        auto const reg = [&](int reg_b3){ return REG::get_str(REG::get_reg(reg_b3, in.w_b1)); };
+        auto const sr = [&](){ return REG::get_str((Reg)((int)Reg::es + (in.reg_b3 & 0b11))); };
+        auto const ac = [&](){ return reg(0b000); };
+
+        if (exec == MOV::rm_r || exec == ADD::rm_r || exec == SUB::rm_r || exec == CMP::rm_r)
+        {
+            printf("%s ", get_alu_str(exec));
+            if (in.d_b1)
+            {
+                printf("%s, ", reg(in.reg_b3));
+                print_rm(in, false);
+            }
+            else
+            {
+                print_rm(in, true);
+                printf(", %s", reg(in.reg_b3));
+            }
+        }
+        else if (exec == MOV::im_rm || exec == ADD::im_rm || exec == SUB::im_rm || exec == CMP::im_rm)
+        {
+            printf("%s ", get_alu_str(exec));
+            print_rm(in, true);
+            printf(", %d", in.im);
+        }
+        else if (exec == ADD::im_ac || exec == SUB::im_ac || exec == CMP::im_ac)
+        {
+            printf("%s %s, %d", get_alu_str(exec), ac(), in.im);
+        }
+        else if (exec == MOV::m_ac)
+        {
+            if (in.opcode & 0b0000'0010)
+            {
+                printf("mov %s [+%d], %s", get_size_str(in.w_b1 ? 2 : 1), in.disp, ac());
+            }
+            else
+            {
+                printf("mov %s, [+%d]", ac(), in.disp);
+            }
+        }
+        else if (exec == MOV::sr)
+        {
+            if (in.d_b1)
+            {
+                printf("mov %s, ", sr());
+                print_rm(in, false);
+            }
+            else
+            {
+                printf("mov ");
+                print_rm(in, true);
+                printf(", %s", sr());
+            }
+        }
+        else if (exec == STACK::push_r || exec == STACK::pop_r)
+        {
+            printf("%s %s", exec == STACK::push_r ? "push" : "pop", reg(in.reg_b3));
+        }
+        else if (exec == STACK::push_sr || exec == STACK::pop_sr)
+        {
+            printf("%s %s", exec == STACK::push_sr ? "push" : "pop", sr());
+        }
+        else if (get_string_str(exec))
+        {
+            auto cmp = exec == STRING::cmps || exec == STRING::scas;
+            auto prefix = in.rep_b2 == STRING::REPNE ? "repne " : in.rep_b2 == STRING::REPE ? (cmp ? "repe " : "rep ") : "";
+            printf("%s%s%c", prefix, get_string_str(exec), in.w_b1 ? 'w' : 'b');
+        }
+        else if (exec == STRING::clear_df || exec == STRING::set_df)
+        {
+            printf(exec == STRING::clear_df ? "cld" : "std");
+        }
+        else
+        {
+            return false;
+        }
+
+        return true;
+    }
+
+
+    static void print_op(OP::Op const& op)
+    {
+        auto& in = op.in;
+        auto const reg = [](Reg r){ return REG::get_str(r); };
+
+        switch ((F)op.form)
+        {
+        case F::mov_r_r:
+        case F::add_r_r:
+        case F::sub_r_r:
+        case F::cmp_r_r:
+        {
+            auto cmd = CMD::get_r_r(in);
+            auto name = op.form == F::mov_r_r ? "mov" : op.form == F::add_r_r ? "add" : op.form == F::sub_r_r ? "sub" : "cmp";
+            printf("%s %s, %s", name, reg(cmd.dst), reg(cmd.src));
+        } break;
+
+        case F::mov_m_r:
+        {
+            auto cmd = CMD::get_m_r(in);
+            printf("mov %s, [+%d]", reg(cmd.dst), cmd.src);
+        } break;
+
+        case F::mov_r_rm:
+        {
+            auto cmd = CMD::get_r_mr(in);
+            printf("mov word [%s], %s", get_ea_str(cmd.dst), reg(cmd.src));
+        } break;
+
+        case F::mov_rm_r:
+        {
+            auto cmd = CMD::get_rm_r(in);
+            printf("mov %s, [%s]", reg(cmd.dst), get_ea_str(cmd.src));
+        } break;
+
+        case F::mov_im_m:
+        {
+            auto cmd = CMD::get_im_m(in);
+            printf("mov %s [+%d], %d", get_size_str(cmd.im_size), cmd.dst, cmd.src);
+        } break;
+
+        case F::mov_im_rmd:
+        {
+            auto cmd = CMD::get_im_rmd(in);
+            printf("mov %s [%s%+d], %d", get_size_str(cmd.im_size), get_ea_str(cmd.dst), cmd.disp, cmd.src);
+        } break;
+
+        case F::mov_im_r:
+        {
+            auto cmd = CMD::get_mov_im_r(in);
+            printf("mov %s, %d", reg(cmd.dst), cmd.src);
+        } break;
+
+        case F::add_im_r:
+        case F::sub_im_r:
+        {
+            auto cmd = CMD::get_im_r(in);
+            printf("%s %s, %d", op.form == F::add_im_r ? "add" : "sub", reg(cmd.dst), cmd.src);
+        } break;
+
+        case F::jnz:
+        {
+            auto cmd = CMD::get_jump(in);
+            printf("jne $%+d", cmd.j_offset);
+        } break;
+
+        case F::call:
+        {
+            auto cmd = CMD::get_jump(in);
+            printf("call $%+d", cmd.j_offset);
+        } break;
+
+        case F::ret:
+        {
+            printf("ret");
+            if (in.im_sz)
+            {
+                printf(" %d", in.im);
+            }
+        } break;
+
+        case F::other:
+            if (!print_other(op))
+            {
+                // the record does not match the program
+                printf("(not decoded)");
+            }
+            break;
+        }
+    }
+
+
+    static void print_record(Record const& r, OP::Op const& op, u16 flags_old)
+    {
+        print_op(op);
+        printf(" ; ");
+
+        if (r.reg != NO_REG && r.reg_old != r.reg_new)
+        {
+            printf("%s:0x%x->0x%x ", REG::get_str((Reg)r.reg), r.reg_old, r.reg_new);
+        }
+
+        printf("ip:0x%x->0x%x ", r.ip_begin, r.ip_end);
+
+        auto flags_new = get_flags(r.alu);
+        if (flags_old != flags_new)
+        {
+            printf("flags:");
+            print_flags(flags_old);
+            printf("->");
+            print_flags(flags_new);
+            printf(" ");
+        }
+
+        printf("\n");
+    }
+
+
+    static void print_final(Header const& h)
+    {
+        auto const print = [](cstr str, int val)
+        {
+            if (val)
+            {
+                printf("%8s: 0x%04x (%d)\n", str, val, val);
+            }
+        };
+
+        printf("\nFinal registers:\n");
+
+        for (auto r : REG::PRINT_ORDER)
+        {
+            print(REG::get_str(r), h.regs[REG::get_index(r)]);
+        }
+
+        print("ip", h.ip);
+
+        if (h.flags)
+        {
+            printf("   flags: ");
+            print_flags(h.flags);
+            printf("\n");
+        }
+
+        printf("\n");
+    }
+
+
+    // prints a recorded trace in the listing_*.txt format
+    static bool format(cstr trace_file, cstr bin_file)
+    {
+        auto fd = open(trace_file, O_RDONLY);
+        if (fd < 0)
+        {
+            return false;
+        }
+
+        auto file_size = (size_t)lseek(fd, 0, SEEK_END);
+        if (file_size < sizeof(Header))
+        {
+            ::close(fd);
+            return false;
+        }
+
+        auto data = mmap(0, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+
+        if (data == MAP_FAILED)
+        {
+            return false;
+        }
+
+        auto& h = *(Header*)data;
+        auto records = (Record*)((u8*)data + sizeof(Header));
+
+        if (h.magic != MAGIC || h.record_size != sizeof(Record) || file_size < get_file_size(h.capacity))
+        {
+            munmap(data, file_size);
+            return false;
+        }
+
+        if (!bin_file)
+        {
+            bin_file = h.bin_file;
+        }
+
+        auto buffer = Bytes::read(bin_file);
+        if (!buffer.data)
+        {
+            munmap(data, file_size);
+            return false;
+        }
+
+        auto name = fs::path(bin_file).filename().string();
+        printf("--- test\\%s execution ---\n", name.c_str());
+
+        // oldest record first when the ring wrapped
+        u64 n_records = h.count < h.capacity ? h.count : h.capacity;
+        u64 first = h.count - n_records;
+
+        auto flags = get_flags(h.alu);
+
+        for (u64 i = 0; i < n_records; ++i)
+        {
+            auto& r = records[(first + i) % h.capacity];
+
+            OP::Op op{};
+            if (r.ip_begin < buffer.size)
+            {
+                op = decode_next(buffer.data, r.ip_begin);
+            }
+
+            print_record(r, op, flags);
+            flags = get_flags(r.alu);
+        }
+
+        print_final(h);
+
+        Bytes::destroy(buffer);
+        munmap(data, file_size);
+
+        return true;
+    }
+}
@@ -0,0 +1,23 @@
+; effective addresses wrap at 64k within the segment
+; assembled to wrap_ea, the final registers of every engine must match
+
+bits 16
+
+mov bx, 0xFFFF
+mov si, 3
+mov cx, 0x1234
+
+; bx + si = 0x10002 stores at ds:2
+mov word [bx + si], cx
+mov dx, [2]
+mov bp, [bx + si]
+
+; bx + di + 5 = 0x20003 stores at ds:3
+mov di, 0xFFFF
+mov word [bx + di + 5], 0x55
+mov sp, [3]
+
+; disp8 is sign extended, bp - 2 stores at ss:8
+mov bp, 10
+mov word [bp - 2], 5
+mov ax, [8]
@@ -0,0 +1,95 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+
+// program images shared by the disassemblers and the simulators
+namespace Bytes
+{
+    // zeroed bytes mapped after the file, decoders may read a whole instruction past the end
+    constexpr uint64_t PADDING = 16;
+
+
+    // how a file is mapped
+    enum class Map : int
+    {
+        // pages are shared with the page cache and cannot be written
+        read_only,
+
+        // writes go to private copies of the pages, the file does not change
+        copy_on_write
+    };
+
+
+    class Buffer
+    {
+    public:
+        uint64_t size = 0;
+        uint8_t* data = nullptr;
+    };
+
+
+    static void destroy(Buffer& buffer)
+    {
+        if (buffer.data)
+        {
+            munmap(buffer.data, buffer.size + PADDING);
+        }
+
+        buffer.data = nullptr;
+        buffer.size = 0;
+    }
+
+
+    // maps the file instead of copying it, pages are read in on first touch
+    // returns an empty buffer when the file cannot be mapped
+    static Buffer read(std::filesystem::path const& path, Map map = Map::read_only)
+    {
+        Buffer buffer{};
+
+        auto fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+        {
+            return buffer;
+        }
+
+        struct stat st{};
+        if (fstat(fd, &st) != 0 || st.st_size <= 0)
+        {
+            ::close(fd);
+            return buffer;
+        }
+
+        auto size = (uint64_t)st.st_size;
+        auto prot = map == Map::copy_on_write ? PROT_READ | PROT_WRITE : PROT_READ;
+
+        // reserve the padding as anonymous zero pages, then map the file over the start
+        // the tail of the last file page is zeroed by mmap
+        auto data = mmap(0, size + PADDING, prot, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (data == MAP_FAILED)
+        {
+            ::close(fd);
+            return buffer;
+        }
+
+        // the mapping keeps the file open
+        auto file = mmap(data, size, prot, MAP_PRIVATE | MAP_FIXED, fd, 0);
+        ::close(fd);
+
+        if (file == MAP_FAILED)
+        {
+            munmap(data, size + PADDING);
+            return buffer;
+        }
+
+        buffer.data = (uint8_t*)data;
+        buffer.size = size;
+
+        return buffer;
+    }
+}